@@ -0,0 +1,267 @@
+// MegaCache v1.0
+// Copyright (c) 2023 Joseph Huckaby
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <new>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#endif
+
+#include "MapRegion.h"
+
+int MapRegion::open(const char *newPath, uint32_t numShards) {
+	// open or create cache file, and map it at its own address
+	// the old contents are only used if the file was closed cleanly, by a build with the same layout, otherwise we start over
+	path = newPath;
+
+#ifdef _WIN32
+	return fail( "Persistent caches are not supported on Windows" );
+#else
+	fd = ::open( path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+	if (fd < 0) return fail( "Failed to open cache file", errno );
+	
+	// only one user at a time, as the shard locks live in process memory (use a named cache to share it between threads)
+	// the pointers in the file are only valid at its own address anyway, which another process may well have in use
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		if (errno == EWOULDBLOCK) return fail( "Cache file is already in use" );
+		return fail( "Failed to lock cache file", errno );
+	}
+	
+	struct stat info;
+	if (fstat(fd, &info) != 0) return fail( "Failed to open cache file", errno );
+	fileSize = (uint64_t)info.st_size;
+	
+	MapHeader old;
+	memset( (void *)&old, 0, sizeof(MapHeader) );
+	if ((pread(fd, (void *)&old, sizeof(MapHeader), 0) == (ssize_t)sizeof(MapHeader)) && valid(&old, fileSize)) {
+		if (old.numShards != numShards) return fail( "Cache file was created with a different number of shards" );
+		restored = map( old.base, 1 );
+	}
+	if (!restored && !create(numShards)) return MH_ERR;
+	
+	// mark file as open, so a crash from here on is caught by the next open
+	header->clean = 0;
+	header->generation++;
+	seal();
+	if (msync((void *)base, MH_MAP_PAGE, MS_SYNC) != 0) return fail( "Failed to sync cache file", errno );
+	
+	return MH_OK;
+#endif
+}
+
+void MapRegion::close() {
+	// flush everything to disk, then mark the file clean, so the next open can trust it
+#ifndef _WIN32
+	if (base) {
+		if (msync((void *)base, header->top, MS_SYNC) == 0) {
+			header->clean = 1;
+			seal();
+			msync( (void *)base, MH_MAP_PAGE, MS_SYNC );
+		}
+		munmap( (void *)base, MH_MAP_RESERVE );
+		base = NULL;
+		header = NULL;
+	}
+	if (fd >= 0) {
+		::close( fd );
+		fd = -1;
+	}
+#endif
+}
+
+void *MapRegion::alloc(uint64_t size, uint64_t align) {
+	// allocate whole pages, first fit from the free list, or else from the top of the file
+	// align must be a power of 2 (slabs are aligned to their own size)
+	std::lock_guard<std::mutex> guard( lock );
+	size = (size + MH_MAP_PAGE - 1) & ~((uint64_t)MH_MAP_PAGE - 1);
+	align = MAX( align, MH_MAP_PAGE );
+	
+	MapRun **link = &header->freeList;
+	for (MapRun *run = *link; run; link = &run->next, run = *link) {
+		uintptr_t start = (uintptr_t)run;
+		uintptr_t aligned = (start + align - 1) & ~((uintptr_t)align - 1);
+		uintptr_t end = start + run->size;
+		if (aligned + size > end) continue;
+		
+		// take the run out, and give back what's left on either side
+		*link = run->next;
+		if (aligned > start) insertRun( start, aligned - start );
+		if (aligned + size < end) insertRun( aligned + size, end - (aligned + size) );
+		return (void *)aligned;
+	}
+	
+	uintptr_t start = (uintptr_t)base + header->top;
+	uintptr_t aligned = (start + align - 1) & ~((uintptr_t)align - 1);
+	if (!grow(aligned + size - (uintptr_t)base)) return NULL;
+	
+	header->top = aligned + size - (uintptr_t)base;
+	if (aligned > start) insertRun( start, aligned - start );
+	return (void *)aligned;
+}
+
+void MapRegion::release(void *ptr, uint64_t size) {
+	// give pages back to the free list, size must match the original alloc() call
+	// the file never shrinks, but the space is reused
+	std::lock_guard<std::mutex> guard( lock );
+	insertRun( (uintptr_t)ptr, (size + MH_MAP_PAGE - 1) & ~((uint64_t)MH_MAP_PAGE - 1) );
+}
+
+Hash *MapRegion::newHash(unsigned char maxBuckets, unsigned char reindexScatter) {
+	// create hash table in the file, along with its arena and stats, so they all survive a restart
+	uint64_t hashSize = (sizeof(Hash) + 63) & ~63;
+	uint64_t arenaSize = (sizeof(Arena) + 63) & ~63;
+	
+	unsigned char *mem = (unsigned char *)alloc( hashSize + arenaSize + sizeof(Stats) );
+	if (!mem) return NULL;
+	
+	Arena *arena = new (mem + hashSize) Arena( this );
+	Stats *stats = new (mem + hashSize + arenaSize) Stats();
+	return new (mem) Hash( maxBuckets, reindexScatter, arena, stats );
+}
+
+int MapRegion::create(uint32_t numShards) {
+	// start over with an empty file, mapped at the first free fixed address
+#ifdef _WIN32
+	return MH_ERR;
+#else
+	if (base) {
+		munmap( (void *)base, MH_MAP_RESERVE );
+		base = NULL;
+		header = NULL;
+	}
+	if (ftruncate(fd, 0) != 0) return fail( "Failed to resize cache file", errno );
+	fileSize = 0;
+	if (!grow(MH_MAP_PAGE)) return fail( "Failed to resize cache file", errno );
+	
+	int mapped = 0;
+	for (uint64_t idx = 0; !mapped && (idx < MH_MAP_SLOTS); idx++) {
+		mapped = map( MH_MAP_BASE + (idx * MH_MAP_RESERVE), 1 );
+	}
+	if (!mapped && !map(0, 0)) return fail( "Failed to map cache file", errno );
+	
+	memset( (void *)header, 0, sizeof(MapHeader) );
+	memcpy( (void *)header->magic, MH_MAP_MAGIC, 8 );
+	header->version = MH_MAP_VERSION;
+	header->numShards = numShards;
+	header->layout = layout();
+	header->base = (uint64_t)(uintptr_t)base;
+	header->top = MH_MAP_PAGE;
+	return MH_OK;
+#endif
+}
+
+int MapRegion::map(uint64_t address, int fixed) {
+	// internal method: map the whole reservation at address (pages past the end of the file are never touched)
+	// fixed means that exact address or nothing, without replacing anything already mapped there
+#ifdef _WIN32
+	return 0;
+#else
+	int flags = MAP_SHARED;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+#ifdef MAP_FIXED_NOREPLACE
+	if (fixed) flags |= MAP_FIXED_NOREPLACE;
+#endif
+	
+	void *mem = mmap( (void *)(uintptr_t)address, MH_MAP_RESERVE, PROT_READ | PROT_WRITE, flags, fd, 0 );
+	if (mem == MAP_FAILED) return 0;
+	
+	// without MAP_FIXED_NOREPLACE the address is only a hint
+	if (fixed && (mem != (void *)(uintptr_t)address)) {
+		munmap( mem, MH_MAP_RESERVE );
+		return 0;
+	}
+	
+	base = (unsigned char *)mem;
+	header = (MapHeader *)mem;
+	return 1;
+#endif
+}
+
+int MapRegion::grow(uint64_t size) {
+	// internal method: make sure the file is at least size bytes
+	// the disk space is allocated up front where possible, so running out shows up here and not as a SIGBUS later
+#ifdef _WIN32
+	return 0;
+#else
+	if (size <= fileSize) return 1;
+	if (size > MH_MAP_RESERVE) return 0;
+	
+	uint64_t newSize = MIN( ((size + MH_MAP_GROW - 1) / MH_MAP_GROW) * MH_MAP_GROW, MH_MAP_RESERVE );
+#ifdef __linux__
+	int result = posix_fallocate( fd, fileSize, newSize - fileSize );
+	if (result != 0) {
+		errno = result;
+		return 0;
+	}
+#else
+	if (ftruncate(fd, newSize) != 0) return 0;
+#endif
+	
+	fileSize = newSize;
+	return 1;
+#endif
+}
+
+int MapRegion::valid(MapHeader *hdr, uint64_t size) {
+	// internal method: check if header is from a clean close, by this build
+	if (memcmp(hdr->magic, MH_MAP_MAGIC, 8) != 0) return 0;
+	if ((hdr->version != MH_MAP_VERSION) || (hdr->layout != layout())) return 0;
+	if (hdr->checksum != Hash::hashBytes((unsigned char *)hdr, offsetof(MapHeader, checksum))) return 0;
+	return hdr->clean && hdr->base && (hdr->top <= size);
+}
+
+void MapRegion::insertRun(uintptr_t start, uint64_t size) {
+	// internal method: add pages to the free list in address order, merging with neighbors (caller holds the lock)
+	MapRun *prev = NULL;
+	MapRun *next = header->freeList;
+	while (next && ((uintptr_t)next < start)) {
+		prev = next;
+		next = next->next;
+	}
+	
+	MapRun *run = (MapRun *)start;
+	run->size = size;
+	run->next = next;
+	if (next && (start + size == (uintptr_t)next)) {
+		run->size += next->size;
+		run->next = next->next;
+	}
+	
+	if (prev && ((uintptr_t)prev + prev->size == start)) {
+		prev->size += run->size;
+		prev->next = run->next;
+	}
+	else if (prev) prev->next = run;
+	else header->freeList = run;
+}
+
+void MapRegion::seal() {
+	// internal method: update header checksum
+	header->checksum = Hash::hashBytes( (unsigned char *)header, offsetof(MapHeader, checksum) );
+}
+
+int MapRegion::fail(const char *msg, int code) {
+	// internal method: record error (with the OS error code, if any), return MH_ERR
+	error = msg;
+	if (code) error = error + ": " + strerror(code);
+	close();
+	return MH_ERR;
+}
+
+uint64_t MapRegion::layout() {
+	// fingerprint of everything that decides where things are in the file
+	uint64_t sizes[] = { sizeof(Hash), sizeof(Arena), sizeof(Stats), sizeof(Index), sizeof(TableGroup), sizeof(Bucket), sizeof(Slab), sizeof(LargeAlloc), MH_SLAB_SIZE, MH_ARENA_CLASSES };
+	return Hash::hashBytes( (unsigned char *)sizes, sizeof(sizes) );
+}
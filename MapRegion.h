@@ -0,0 +1,107 @@
+// MegaCache v1.0
+// Copyright (c) 2023 Joseph Huckaby
+
+#ifndef MAPREGION_H
+#define MAPREGION_H
+
+#include <string>
+#include <mutex>
+#include "MegaCache.h"
+
+/** \name Persistent cache files:
+	The file is memory mapped at the same address every time, so the pointers inside it stay valid across restarts.
+	It holds absolute addresses rather than offsets, so it is for warm restarts of one process at a time (see MapRegion::open()),
+	not for sharing a cache between processes. */
+//@{
+/** Magic bytes at the start of every cache file. */
+#define MH_MAP_MAGIC "MEGAMAP1"
+/** Format version, bumped whenever the layout changes. */
+#define MH_MAP_VERSION 2
+/** Allocation granularity within the file. */
+#define MH_MAP_PAGE 4096
+/** Address space reserved for each file (the file itself only grows as needed). */
+#define MH_MAP_RESERVE ((uint64_t)1 << 40)
+/** First address tried for a new file, each further file in the process goes one reservation higher. */
+#define MH_MAP_BASE ((uint64_t)0x200000000000ull)
+/** Number of fixed addresses to try before letting the OS pick one. */
+#define MH_MAP_SLOTS 32
+/** The file grows in steps of this many bytes. */
+#define MH_MAP_GROW ((uint64_t)64 * 1024 * 1024)
+/** Room for one hash table per shard (same as MH_MAX_SHARDS). */
+#define MH_MAP_HASHES 256
+//@}
+
+class MapRun {
+public:
+	// run of free pages inside the file, the free list is kept in address order so neighbors can merge
+	MapRun *next;
+	uint64_t size;
+};
+
+class MapHeader {
+public:
+	// first page of the file
+	char magic[8];
+	uint32_t version;
+	uint32_t numShards;
+	uint64_t layout; /**< Fingerprint of the structure sizes, so a file from a different build is not trusted. */
+	uint64_t base; /**< Address the file is mapped at. */
+	uint64_t top; /**< Offset of the first never-allocated byte. */
+	uint64_t generation; /**< Number of times the file has been opened. */
+	uint32_t clean; /**< Set by a clean close, cleared while the file is open. */
+	uint32_t reserved;
+	MapRun *freeList;
+	Hash *hashes[MH_MAP_HASHES];
+	uint64_t checksum; /**< Hash::hashBytes() of everything above. */
+};
+
+class MapRegion {
+public:
+	// cache file mapped into memory, which the arenas of all shards allocate their slabs from
+	// crash consistency: the header is marked dirty (and synced) on open, and only marked clean again on close,
+	// after everything else has been synced, so a file which was not closed cleanly is never trusted
+	std::mutex lock; /**< Guards the allocator, as all shards share one file. */
+	std::string path;
+	int fd;
+	unsigned char *base;
+	MapHeader *header;
+	uint64_t fileSize;
+	int restored; /**< The file was reopened with its contents, rather than started over. */
+	std::string error;
+	
+	MapRegion() {
+		fd = -1;
+		base = NULL;
+		header = NULL;
+		fileSize = 0;
+		restored = 0;
+	}
+	
+	~MapRegion() {
+		close();
+	}
+	
+	int open(const char *newPath, uint32_t numShards);
+	void close();
+	void *alloc(uint64_t size, uint64_t align = MH_MAP_PAGE);
+	void release(void *ptr, uint64_t size);
+	Hash *newHash(unsigned char maxBuckets, unsigned char reindexScatter);
+	
+	uint64_t getFileSize() {
+		// current size of the file on disk
+		std::lock_guard<std::mutex> guard( lock );
+		return fileSize;
+	}
+	
+	// internal methods:
+	int create(uint32_t numShards);
+	int map(uint64_t address, int fixed);
+	int grow(uint64_t size);
+	int valid(MapHeader *hdr, uint64_t size);
+	void insertRun(uintptr_t start, uint64_t size);
+	void seal();
+	int fail(const char *msg, int code = 0);
+	static uint64_t layout();
+};
+
+#endif
@@ -5,128 +5,92 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <chrono>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 
 #include "MegaCache.h"
+#include "MapRegion.h"
 
-Response Hash::store(unsigned char *key, MH_KLEN_T keyLength, unsigned char *content, MH_LEN_T contentLength, unsigned char flags) {
+Response Hash::store(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength, unsigned char *content, MH_LEN_T contentLength, unsigned char flags, uint32_t expires) {
 	// store key/value pair in hash, promote to LRU head, expunge old if needed
-	unsigned char digest[MH_DIGEST_SIZE];
+	// hash must be hashKey(key, keyLength), computed by the caller
+	// expires is the absolute expiration time in seconds (0 = never), replacing any previous TTL
+	if (engine == MH_ENGINE_TABLE) return tableStore( hash, key, keyLength, content, contentLength, flags, expires );
 	Response resp;
 	
-	// first digest key
-	digestKey(key, keyLength, digest);
-	
-	// combine key and content together, with length prefixes, into single blob
-	// this reduces malloc bashing and memory frag
-	MH_LEN_T payloadSize = sizeof(Bucket) + MH_KLEN_SIZE + keyLength + MH_LEN_SIZE + contentLength;
-	MH_LEN_T offset = sizeof(Bucket);
-	unsigned char *payload = (unsigned char *)malloc(payloadSize);
-	
-	// check for malloc error here
-	if (!payload) {
-		resp.result = MH_ERR;
-		return resp;
-	}
-	
-	memcpy( (void *)&payload[offset], (void *)&keyLength, MH_KLEN_SIZE ); offset += MH_KLEN_SIZE;
-	memcpy( (void *)&payload[offset], (void *)key, keyLength ); offset += keyLength;
-	memcpy( (void *)&payload[offset], (void *)&contentLength, MH_LEN_SIZE ); offset += MH_LEN_SIZE;
-	memcpy( (void *)&payload[offset], (void *)content, contentLength ); offset += contentLength;
-	
 	unsigned char digestIndex = 0;
 	unsigned char ch;
 	unsigned char bucketIndex = 0;
-	Tag *tag = (Tag *)index;
+	Tag *tag = indexTag( index );
 	Index *level, *newLevel;
 	Bucket *bucket, *newBucket, *lastBucket;
 	
-	while (tag && (tag->type == MH_SIG_INDEX)) {
-		level = (Index *)tag;
-		ch = digest[digestIndex];
+	while (tag && isIndex(tag)) {
+		level = toIndex( tag );
+		ch = digestAt(hash, digestIndex);
 		tag = level->data[ch];
 		if (!tag) {
 			// create new bucket list here
-			bucket = (Bucket *)payload;
-			bucket->init();
-			bucket->flags = flags;
+			bucket = allocBucket(hash, key, keyLength, content, contentLength, flags);
+			if (!bucket) {
+				resp.result = MH_ERR;
+				return resp;
+			}
 			level->data[ch] = (Tag *)bucket;
+			setExpires( bucket, expires );
 			
 			// add new bucket as new LRU head
-			bucket->cachePrev = NULL;
-			bucket->cacheNext = cacheFirst;
-			if (cacheFirst) cacheFirst->cachePrev = bucket;
-			cacheFirst = bucket;
-			if (!cacheLast) cacheLast = bucket;
-			// end LRU section
+			insertBucket( bucket );
 			
 			resp.result = MH_ADD;
 			stats->dataSize += keyLength + contentLength;
-			stats->metaSize += sizeof(Bucket) + MH_KLEN_SIZE + MH_LEN_SIZE;
+			stats->metaSize += bucketMetaFor( bucket->type );
 			stats->numKeys++;
 			tag = NULL; // break
 		}
-		else if (tag->type == MH_SIG_BUCKET) {
+		else if (!isIndex(tag)) {
 			// found bucket list, append
 			bucket = (Bucket *)tag;
 			lastBucket = NULL;
 			
 			while (bucket) {
-				if (bucketKeyEquals(bucket, key, keyLength)) {
+				if ((bucket->hash == hash) && bucketKeyEquals(bucket, key, keyLength)) {
 					// replace
-					newBucket = (Bucket *)payload;
-					newBucket->init();
-					newBucket->flags = flags;
-					newBucket->next = bucket->next;
-					
-					// manage LRU linked list
-					if (bucket->cachePrev) bucket->cachePrev->cacheNext = bucket->cacheNext;
-					if (bucket->cacheNext) bucket->cacheNext->cachePrev = bucket->cachePrev;
-					if (bucket == cacheFirst) cacheFirst = bucket->cacheNext;
-					if (bucket == cacheLast) cacheLast = bucket->cachePrev;
-					
-					newBucket->cachePrev = NULL;
-					newBucket->cacheNext = cacheFirst;
-					if (cacheFirst) cacheFirst->cachePrev = newBucket;
-					cacheFirst = newBucket;
-					if (!cacheLast) cacheLast = newBucket;
-					// end LRU section
-					
-					if (lastBucket) lastBucket->next = newBucket;
-					else level->data[ch] = (Tag *)newBucket;
+					resp.result = updateBucket( bucket, lastBucket, &level->data[ch], content, contentLength, flags, expires );
+					if (resp.result == MH_ERR) return resp;
 					
-					resp.result = MH_REPLACE;
-					stats->dataSize -= (bucketGetKeyLength(bucket) + bucketGetContentLength(bucket));
-					stats->dataSize += keyLength + contentLength;
-					
-					free((void *)bucket);
 					bucket = NULL; // break
 				}
 				else if (!bucket->next) {
 					// append here
-					newBucket = (Bucket *)payload;
-					newBucket->init();
-					newBucket->flags = flags;
+					newBucket = allocBucket(hash, key, keyLength, content, contentLength, flags);
+					if (!newBucket) {
+						resp.result = MH_ERR;
+						return resp;
+					}
 					bucket->next = newBucket;
+					setExpires( newBucket, expires );
 					resp.result = MH_ADD;
 					
 					// add new bucket as new LRU head
-					newBucket->cachePrev = NULL;
-					newBucket->cacheNext = cacheFirst;
-					if (cacheFirst) cacheFirst->cachePrev = newBucket;
-					cacheFirst = newBucket;
-					if (!cacheLast) cacheLast = newBucket;
-					// end LRU section
+					insertBucket( newBucket );
 					
 					stats->dataSize += keyLength + contentLength;
-					stats->metaSize += sizeof(Bucket) + MH_KLEN_SIZE + MH_LEN_SIZE;
+					stats->metaSize += bucketMetaFor( newBucket->type );
 					stats->numKeys++;
 					bucket = NULL; // break
 					
 					// possibly reindex here
-					if ((bucketIndex >= maxBuckets + (ch % reindexScatter)) && (digestIndex < MH_DIGEST_SIZE - 1)) {
+					if ((bucketIndex >= maxBuckets + (ch % reindexScatter)) && (digestIndex < maxDepth - 1)) {
 						// deeper we go
 						digestIndex++;
-						newLevel = new Index();
+						newLevel = newIndex( digestIndex );
 						
 						// check for malloc error here
 						if (!newLevel) {
@@ -134,10 +98,8 @@ Response Hash::store(unsigned char *key, MH_KLEN_T keyLength, unsigned char *con
 							return resp;
 						}
 						
-						stats->indexSize += sizeof(Index);
-						
 						bucket = (Bucket *)tag;
-						level->data[ch] = (Tag *)newLevel;
+						level->data[ch] = indexTag( newLevel );
 						
 						while (bucket) {
 							lastBucket = bucket;
@@ -160,22 +122,430 @@ Response Hash::store(unsigned char *key, MH_KLEN_T keyLength, unsigned char *con
 		}
 	} // while tag
 	
-	// LRU space management
-	while ((maxKeys && (stats->numKeys > maxKeys)) || (maxBytes && (stats->dataSize + stats->indexSize + stats->metaSize > maxBytes))) {
-		remove( bucketGetKey(cacheLast), bucketGetKeyLength(cacheLast) );
-		stats->numEvictions++;
+	makeRoom();
+	return resp;
+}
+
+void Hash::makeRoom() {
+	// internal method: LRU space management after a store
+	// crossing the high watermark evicts down to the low watermark in one batch (in steps, right after a limit was lowered)
+	if (appending) return;
+	
+	if (overLimit(100)) {
+		if (!deferEvict) evict( shrinking ? MH_SHRINK_BUDGET : 0 );
+		return;
+	}
+	
+	shrinking = 0;
+	if (policy == MH_POLICY_TINYLFU) fillMain();
+}
+
+unsigned char Hash::updateBucket(Bucket *bucket, Bucket *lastBucket, Tag **slot, unsigned char *content, MH_LEN_T contentLength, unsigned char flags, uint32_t expires) {
+	// internal method: replace the value of an existing key, return MH_REPLACE (or MH_ERR if out of memory)
+	// lastBucket and slot say where the bucket is, for swapping in a new one (same as deleteBucket())
+	// if the old value's TTL ran out, it counts as expired and the key as a new one (MH_ADD)
+	// when appending, the key goes to the tail like a new one, so a loaded snapshot keeps its order
+	int expired = isExpired(bucket);
+	int requeue = expired || appending;
+	if (expired) {
+		stats->numExpired++;
+		stats->expiredBytes += bucketGetSize(bucket);
+	}
+	
+	MH_KLEN_T keyLength = bucketGetKeyLength(bucket);
+	unsigned char type = bucketTypeFor(keyLength, contentLength);
+	uint64_t payloadSize = bucketMetaFor(type) + keyLength + contentLength;
+	
+	if (!(bucket->state & MH_STATE_PINNED) && (bucket->type == type) && arena->fits( (void *)bucket, bucketGetSize(bucket), payloadSize )) {
+		// new value fits in the existing allocation, and keeps the same format, so overwrite in place (unless a view is looking at it)
+		// the bucket keeps its chain position, only the LRU list changes
+		stats->dataSize -= bucketGetContentLength(bucket);
+		stats->dataSize += contentLength;
+		
+		bucket->flags = flags;
+		bucketSetContent( bucket, content, contentLength );
+		setExpires( bucket, expires );
+		if (requeue) requeueBucket( bucket );
+		else touchBucket( bucket );
+		return expired ? MH_ADD : MH_REPLACE;
 	}
 	
+	// allocate new blob and swap it into the chain
+	Bucket *newBucket = allocBucket(bucket->hash, bucketGetKey(bucket), keyLength, content, contentLength, flags);
+	if (!newBucket) return MH_ERR;
+	
+	newBucket->next = bucket->next;
+	newBucket->expires = bucket->expires;
+	setExpires( newBucket, expires );
+	
+	// new bucket takes over the old one's list position, then counts as an access
+	replaceBucket( bucket, newBucket );
+	if (requeue) requeueBucket( newBucket );
+	else touchBucket( newBucket );
+	
+	if (lastBucket) lastBucket->next = newBucket;
+	else slot[0] = (Tag *)newBucket;
+	
+	stats->dataSize -= bucketGetContentLength(bucket);
+	stats->dataSize += contentLength;
+	stats->metaSize -= bucketMetaFor( bucket->type );
+	stats->metaSize += bucketMetaFor( type );
+	
+	freeBucket( bucket );
+	return expired ? MH_ADD : MH_REPLACE;
+}
+
+Response Hash::append(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength, unsigned char *content, MH_LEN_T contentLength, unsigned char flags, uint32_t expires) {
+	// store key/value pair at the LRU tail instead of the head, and skip eviction
+	// this is for loading snapshots, which are saved head first, so the list comes back in the same order
+	// the caller is responsible for checking limits
+	appending = 1;
+	Response resp = store( hash, key, keyLength, content, contentLength, flags, expires );
+	appending = 0;
 	return resp;
 }
 
+uint64_t Hash::evict(uint64_t budget) {
+	// evict keys from the LRU tail in one batch, until we're back under the low watermark
+	// budget caps the number of keys evicted in this call (0 = no cap), so a deferred batch can be spread over idle ticks
+	if (!cacheLast || !overLimit(lowWater)) return 0;
+	
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	uint64_t count = 0;
+	
+	// expired keys are dead weight, so reap some of those first (they count towards the budget, but not numEvictions)
+	// this is capped, so a big backlog of due timers doesn't land on a single store (expire() works off the rest)
+	uint64_t reaped = (wheel && wheel->numTimers) ? expire( budget ? MIN(budget, MH_EVICT_REAP) : MH_EVICT_REAP ) : 0;
+	
+	while (cacheLast && (!budget || (reaped + count < budget)) && overLimit(lowWater)) {
+		evictBucket( nextVictim() );
+		count++;
+	}
+	
+	stats->numEvictions += count;
+	stats->evictionBatches++;
+	stats->evictionTime += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+	
+	return reaped + count;
+}
+
+uint64_t Hash::expire(uint64_t budget, uint32_t now, uint64_t *processed) {
+	// reap keys whose TTL ran out, return number of keys removed
+	// budget caps the number of timers processed in this call (0 = no cap), including stale ones,
+	// so a big backlog can be spread over many calls (processed, if given, receives the timer count)
+	uint64_t numTimers = 0;
+	uint64_t count = 0;
+	
+	if (wheel) {
+		if (!now) now = mhNow();
+		wheel->advance( now );
+		
+		TimerEntry entry;
+		while ((!budget || (numTimers < budget)) && wheel->next(&entry)) {
+			count += reapTimer( &entry, now );
+			numTimers++;
+		}
+	}
+	
+	if (processed) *processed = numTimers;
+	return count;
+}
+
+int Hash::reapTimer(TimerEntry *entry, uint32_t now) {
+	// internal method: handle one timer off the due list, return 1 if its key was reaped
+	// follows the hash down the index like evictBucket(), but the key may be long gone
+	Bucket *bucket = NULL;
+	Bucket *lastBucket = NULL;
+	Tag **slot;
+	
+	if (engine == MH_ENGINE_TABLE) {
+		slot = tableFind( entry->hash, NULL, 0, NULL );
+		if (slot) bucket = (Bucket *)slot[0];
+	}
+	else {
+		unsigned char digestIndex = 0;
+		slot = &index->data[ digestAt(entry->hash, 0) ];
+		
+		while (slot[0] && isIndex(slot[0])) {
+			digestIndex++;
+			slot = &toIndex(slot[0])->data[ digestAt(entry->hash, digestIndex) ];
+		}
+		
+		bucket = (Bucket *)slot[0];
+		while (bucket && !((bucket->hash == entry->hash) && bucket->expires)) {
+			lastBucket = bucket;
+			bucket = bucket->next;
+		}
+	}
+	if (!bucket) return 0;
+	
+	if (bucket->expires <= now) {
+		reapBucket( bucket, lastBucket, slot );
+		return 1;
+	}
+	
+	// not yet: either the timer fired early from an upper level, or the TTL was extended
+	// (if the TTL was shortened, a newer timer is already pending, so drop this one)
+	if (entry->expires <= bucket->expires) wheel->schedule( bucket->hash, bucket->expires );
+	return 0;
+}
+
+void Hash::reapBucket(Bucket *bucket, Bucket *lastBucket, Tag **slot) {
+	// internal method: delete expired bucket and count it
+	stats->numExpired++;
+	stats->expiredBytes += bucketGetSize(bucket);
+	deleteBucket( bucket, lastBucket, slot );
+}
+
+void Hash::setExpires(Bucket *bucket, uint32_t expires) {
+	// internal method: set bucket TTL, scheduling a timer unless an earlier one is already pending
+	// a pending timer for an older, earlier TTL simply reschedules itself when it fires
+	if (expires && (!bucket->expires || (expires < bucket->expires))) {
+		if (!wheel) wheel = new TimerWheel();
+		wheel->schedule( bucket->hash, expires );
+	}
+	bucket->expires = expires;
+}
+
+Bucket *Hash::nextVictim() {
+	// internal method: pick the next bucket to evict (list must not be empty)
+	// for CLOCK, the list is the clock face, with the hand between the tail and the head
+	// referenced buckets get a second chance: clear the bit and move them past the hand
+	if (policy == MH_POLICY_CLOCK) {
+		while (cacheLast->state & MH_STATE_REF) {
+			cacheLast->state &= ~MH_STATE_REF;
+			promoteBucket( cacheLast );
+		}
+	}
+	else if ((policy == MH_POLICY_TINYLFU) && windowLast && ((windowCount > windowMax()) || (cacheLast == windowLast))) {
+		// window is over its size (or is all that's left), so its oldest key has to either enter the main area, or go
+		// it gets in only if it is more popular than the main area's eviction victim, the probation tail
+		// with nothing on probation there is no victim to trade places with, so it goes
+		Bucket *candidate = windowLast;
+		if (!(cacheLast->state & MH_STATE_SEGMENT) && (sketch->frequency(candidate->hash) > sketch->frequency(cacheLast->hash))) {
+			moveBucket( candidate, 0 );
+			stats->numAdmitted++;
+			return cacheLast;
+		}
+		
+		stats->numRejected++;
+		return candidate;
+	}
+	
+	return cacheLast;
+}
+
+void Hash::linkBucket(Bucket *bucket, Bucket *after) {
+	// internal method: insert bucket into the list after another (NULL for the head)
+	bucket->cachePrev = after;
+	bucket->cacheNext = after ? after->cacheNext : cacheFirst;
+	
+	if (bucket->cacheNext) bucket->cacheNext->cachePrev = bucket;
+	else cacheLast = bucket;
+	
+	if (after) after->cacheNext = bucket;
+	else cacheFirst = bucket;
+}
+
+void Hash::unlinkBucket(Bucket *bucket) {
+	// internal method: remove bucket from the list, moving any segment boundaries off of it
+	if (cursors) moveCursors( bucket, NULL );
+	if (bucket->state & MH_STATE_WINDOW) windowCount--;
+	else if (bucket->state & MH_STATE_PROTECTED) protectedCount--;
+	
+	if (bucket == protectedLast) protectedLast = (bucket->cachePrev != windowLast) ? bucket->cachePrev : NULL;
+	if (bucket == windowLast) windowLast = bucket->cachePrev;
+	
+	if (bucket->cachePrev) bucket->cachePrev->cacheNext = bucket->cacheNext;
+	else cacheFirst = bucket->cacheNext;
+	
+	if (bucket->cacheNext) bucket->cacheNext->cachePrev = bucket->cachePrev;
+	else cacheLast = bucket->cachePrev;
+}
+
+void Hash::replaceBucket(Bucket *bucket, Bucket *newBucket) {
+	// internal method: swap new bucket into the list in place of an old one, keeping its segment (but not its pin)
+	if (cursors) moveCursors( bucket, newBucket );
+	newBucket->state = bucket->state & ~MH_STATE_PINNED;
+	newBucket->cachePrev = bucket->cachePrev;
+	newBucket->cacheNext = bucket->cacheNext;
+	
+	if (bucket->cachePrev) bucket->cachePrev->cacheNext = newBucket;
+	else cacheFirst = newBucket;
+	
+	if (bucket->cacheNext) bucket->cacheNext->cachePrev = newBucket;
+	else cacheLast = newBucket;
+	
+	if (bucket == windowLast) windowLast = newBucket;
+	if (bucket == protectedLast) protectedLast = newBucket;
+}
+
+void Hash::moveCursors(Bucket *bucket, Bucket *newBucket) {
+	// internal method: bucket is leaving its place in the list, so move any cursors sitting on it
+	// to its replacement, or if there is none, one step along in their direction (call before changing any links)
+	for (size_t idx = 0; idx < cursors->size(); idx++) {
+		Cursor *cursor = (*cursors)[idx];
+		if (cursor->bucket != bucket) continue;
+		if (newBucket) cursor->bucket = newBucket;
+		else cursor->bucket = (cursor->dir > 0) ? bucket->cacheNext : bucket->cachePrev;
+	}
+}
+
+void Hash::insertBucket(Bucket *bucket) {
+	// internal method: add new bucket to the list, W-TinyLFU keys start out in the window
+	// when appending, the bucket goes after the tail (for W-TinyLFU that is the end of probation)
+	if (policy == MH_POLICY_TINYLFU) {
+		sketch->ensureCapacity( maxKeys ? maxKeys : (stats->numKeys + 1) );
+		sketch->increment( bucket->hash );
+	}
+	
+	if (appending) linkBucket( bucket, cacheLast );
+	else if (policy == MH_POLICY_TINYLFU) moveBucket( bucket, MH_STATE_WINDOW );
+	else linkBucket( bucket, NULL );
+}
+
+void Hash::requeueBucket(Bucket *bucket) {
+	// internal method: take bucket out of the list and put it back in as a new key, with no access history
+	unlinkBucket( bucket );
+	bucket->state &= ~(MH_STATE_SEGMENT | MH_STATE_REF);
+	bucket->cachePrev = bucket->cacheNext = NULL;
+	insertBucket( bucket );
+}
+
+void Hash::moveBucket(Bucket *bucket, unsigned char segment) {
+	// internal method: move bucket to the head of a W-TinyLFU segment (0 for probation)
+	// new buckets have no list links yet, so there's nothing to unlink
+	if (bucket->cachePrev || (bucket == cacheFirst)) unlinkBucket( bucket );
+	bucket->state = (bucket->state & ~MH_STATE_SEGMENT) | segment;
+	
+	if (segment == MH_STATE_WINDOW) {
+		linkBucket( bucket, NULL );
+		if (!windowLast) windowLast = bucket;
+		windowCount++;
+	}
+	else if (segment == MH_STATE_PROTECTED) {
+		linkBucket( bucket, windowLast );
+		if (!protectedLast) protectedLast = bucket;
+		protectedCount++;
+	}
+	else {
+		linkBucket( bucket, protectedLast ? protectedLast : windowLast );
+	}
+}
+
+void Hash::touchSegment(Bucket *bucket) {
+	// internal method: W-TinyLFU access, count it in the sketch and move up
+	// window keys stay in the window, main keys go to the protected segment,
+	// which pushes its oldest keys back down into probation
+	sketch->increment( bucket->hash );
+	
+	if (bucket->state & MH_STATE_WINDOW) {
+		if (bucket != cacheFirst) moveBucket( bucket, MH_STATE_WINDOW );
+	}
+	else {
+		moveBucket( bucket, MH_STATE_PROTECTED );
+		
+		uint64_t max = protectedMax();
+		while (protectedLast && (protectedCount > max)) {
+			moveBucket( protectedLast, 0 );
+		}
+	}
+}
+
+void Hash::fillMain() {
+	// internal method: while the cache has room, overflow from the window goes straight into probation
+	uint64_t max = windowMax();
+	while (windowLast && (windowCount > max)) {
+		moveBucket( windowLast, 0 );
+	}
+}
+
+int Hash::overLimit(uint64_t percent) {
+	// internal method: see if we're over a percentage of maxKeys or maxBytes
+	if (maxKeys && (stats->numKeys * 100 > maxKeys * percent)) return 1;
+	if (maxBytes && (usedBytes() * 100 > maxBytes * percent)) return 1;
+	return 0;
+}
+
+int Hash::fits(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength, MH_LEN_T contentLength) {
+	// internal method: see if storing a key would keep us within maxKeys and maxBytes, without storing or evicting anything
+	// replacing a key counts as its size difference, an expired one is counted as if it were new
+	// index nodes the store may add are not counted, so this can go over by one of those
+	if (!maxKeys && !maxBytes) return 1;
+	
+	Response resp = peek( hash, key, keyLength );
+	Bucket *old = (resp.result == MH_OK) ? resp.bucket : NULL;
+	
+	if (maxKeys && !old && (stats->numKeys + 1 > maxKeys)) return 0;
+	if (!maxBytes) return 1;
+	
+	uint64_t newSize = bucketMetaFor(bucketTypeFor(keyLength, contentLength)) + keyLength + contentLength;
+	uint64_t oldSize = old ? bucketGetSize(old) : 0;
+	if (accounting == MH_ACCOUNT_ARENA) {
+		newSize = Arena::chargeFor( newSize );
+		if (old) oldSize = Arena::chargeFor( oldSize );
+	}
+	return (usedBytes() + newSize <= maxBytes + oldSize) ? 1 : 0;
+}
+
+void Hash::setLimits(uint64_t newMaxKeys, uint64_t newMaxBytes) {
+	// change limits on the fly (0 = no limit)
+	// if that puts us over, each store only evicts MH_SHRINK_BUDGET keys until we're back under, so no single call pays for all of it
+	maxKeys = newMaxKeys;
+	maxBytes = newMaxBytes;
+	shrinking = (unsigned char)overLimit(100);
+}
+
+Bucket *Hash::allocBucket(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength, unsigned char *content, MH_LEN_T contentLength, unsigned char flags) {
+	// combine key and content together, with length prefixes, into single blob
+	// this is allocated from a size-classed slab, to reduce malloc bashing and memory frag
+	// small keys and values get one byte lengths, both in front of the key (see MH_SIG_SMALL)
+	unsigned char type = bucketTypeFor(keyLength, contentLength);
+	uint64_t payloadSize = bucketMetaFor(type) + keyLength + contentLength;
+	MH_LEN_T offset = sizeof(Bucket);
+	unsigned char *payload = (unsigned char *)arena->alloc(payloadSize);
+	
+	// check for malloc error here
+	if (!payload) return NULL;
+	
+	if (type == MH_SIG_SMALL) {
+		payload[offset++] = (unsigned char)keyLength;
+		payload[offset++] = (unsigned char)contentLength;
+		memcpy( (void *)&payload[offset], (void *)key, keyLength ); offset += keyLength;
+	}
+	else {
+		memcpy( (void *)&payload[offset], (void *)&keyLength, MH_KLEN_SIZE ); offset += MH_KLEN_SIZE;
+		memcpy( (void *)&payload[offset], (void *)key, keyLength ); offset += keyLength;
+		memcpy( (void *)&payload[offset], (void *)&contentLength, MH_LEN_SIZE ); offset += MH_LEN_SIZE;
+	}
+	memcpy( (void *)&payload[offset], (void *)content, contentLength ); offset += contentLength;
+	
+	Bucket *bucket = (Bucket *)payload;
+	bucket->init();
+	bucket->type = type;
+	bucket->flags = flags;
+	bucket->hash = hash;
+	return bucket;
+}
+
+void Hash::bucketSetContent(Bucket *bucket, unsigned char *content, MH_LEN_T contentLength) {
+	// overwrite bucket content (value) in place, caller must make sure it fits, in the same format
+	unsigned char *bucketData = ((unsigned char *)bucket) + sizeof(Bucket);
+	if (bucket->type == MH_SIG_SMALL) {
+		bucketData[1] = (unsigned char)contentLength;
+		memmove( (void *)(bucketData + MH_SMALL_META + bucketData[0]), (void *)content, contentLength );
+		return;
+	}
+	
+	unsigned char *tempCL = bucketData + MH_KLEN_SIZE + ((MH_KLEN_T *)bucketData)[0];
+	memcpy( (void *)tempCL, (void *)&contentLength, MH_LEN_SIZE );
+	memmove( (void *)(tempCL + MH_LEN_SIZE), (void *)content, contentLength );
+}
+
 void Hash::reindexBucket(Bucket *bucket, Index *index, unsigned char digestIndex) {
 	// reindex existing bucket into new subindex level
-	unsigned char digest[MH_DIGEST_SIZE];
-	MH_KLEN_T keyLength = bucketGetKeyLength(bucket);
-	unsigned char *key = bucketGetKey(bucket);
-	digestKey(key, keyLength, digest);
-	unsigned char ch = digest[digestIndex];
+	// uses the cached key hash, so this is a pure pointer shuffle
+	unsigned char ch = digestAt(bucket->hash, digestIndex);
 	
 	Tag *tag = index->data[ch];
 	if (!tag) {
@@ -194,63 +564,52 @@ void Hash::reindexBucket(Bucket *bucket, Index *index, unsigned char digestIndex
 	}
 }
 
-Response Hash::fetch(unsigned char *key, MH_KLEN_T keyLength) {
+Response Hash::fetch(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength) {
 	// fetch value given key, LRU promote to head
-	unsigned char digest[MH_DIGEST_SIZE];
+	// expired keys are not found, and are reaped on the spot
+	// hash must be hashKey(key, keyLength), computed by the caller
+	if (engine == MH_ENGINE_TABLE) return tableFetch( hash, key, keyLength, 1 );
 	Response resp;
 	
-	// first digest key
-	digestKey(key, keyLength, digest);
-	
 	unsigned char digestIndex = 0;
 	unsigned char ch;
 	
-	Tag *tag = (Tag *)index;
+	Tag *tag = indexTag( index );
 	Index *level;
-	Bucket *bucket;
-	
-	unsigned char *bucketData;
-	unsigned char *tempCL;
+	Bucket *bucket, *lastBucket;
 	
-	while (tag && (tag->type == MH_SIG_INDEX)) {
-		level = (Index *)tag;
-		ch = digest[digestIndex];
+	while (tag && isIndex(tag)) {
+		level = toIndex( tag );
+		ch = digestAt(hash, digestIndex);
 		tag = level->data[ch];
 		if (!tag) {
 			// not found
 			resp.result = MH_ERR;
 			tag = NULL; // break
 		}
-		else if (tag->type == MH_SIG_BUCKET) {
-			// found bucket list, append
+		else if (!isIndex(tag)) {
+			// found bucket list, traverse
 			bucket = (Bucket *)tag;
+			lastBucket = NULL;
 			
 			while (bucket) {
-				if (bucketKeyEquals(bucket, key, keyLength)) {
-					// found!
-					bucketData = ((unsigned char *)bucket) + sizeof(Bucket);
-					tempCL = bucketData + MH_KLEN_SIZE + keyLength;
-					
-					resp.result = MH_OK;
-					resp.contentLength = ((MH_LEN_T *)tempCL)[0];
-					resp.content = bucketData + MH_KLEN_SIZE + keyLength + MH_LEN_SIZE;
-					resp.flags = bucket->flags;
-					resp.bucket = bucket;
-					
-					// LRU promote to head
-					if (bucket != cacheFirst) {
-						if (bucket->cachePrev) bucket->cachePrev->cacheNext = bucket->cacheNext;
-						if (bucket->cacheNext) bucket->cacheNext->cachePrev = bucket->cachePrev;
-						if (bucket == cacheFirst) cacheFirst = bucket->cacheNext;
-						if (bucket == cacheLast) cacheLast = bucket->cachePrev;
+				if ((bucket->hash == hash) && bucketKeyEquals(bucket, key, keyLength)) {
+					if (isExpired(bucket)) {
+						// found, but TTL ran out, so reap it now
+						reapBucket( bucket, lastBucket, &level->data[ch] );
+						resp.result = MH_ERR;
+					}
+					else {
+						// found!
+						resp.result = MH_OK;
+						resp.contentLength = bucketGetContentLength(bucket);
+						resp.content = bucketGetContent(bucket);
+						resp.flags = bucket->flags;
+						resp.bucket = bucket;
 						
-						bucket->cachePrev = NULL;
-						bucket->cacheNext = cacheFirst;
-						if (cacheFirst) cacheFirst->cachePrev = bucket;
-						cacheFirst = bucket;
-						if (!cacheLast) cacheLast = bucket;
+						// LRU promote to head (or just set the CLOCK reference bit)
+						touchBucket( bucket );
 					}
-					// end LRU section
 					
 					bucket = NULL; // break
 				}
@@ -260,6 +619,7 @@ Response Hash::fetch(unsigned char *key, MH_KLEN_T keyLength) {
 					bucket = NULL; // break
 				}
 				else {
+					lastBucket = bucket;
 					bucket = bucket->next;
 				}
 			} // while bucket
@@ -274,48 +634,47 @@ Response Hash::fetch(unsigned char *key, MH_KLEN_T keyLength) {
 	return resp;
 }
 
-Response Hash::peek(unsigned char *key, MH_KLEN_T keyLength) {
+Response Hash::peek(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength) {
 	// fetch value given key, without LRU promotion
-	unsigned char digest[MH_DIGEST_SIZE];
+	// expired keys are not found, but are left for expire() (this may run under a shared lock)
+	// hash must be hashKey(key, keyLength), computed by the caller
+	if (engine == MH_ENGINE_TABLE) return tableFetch( hash, key, keyLength, 0 );
 	Response resp;
 	
-	// first digest key
-	digestKey(key, keyLength, digest);
-	
 	unsigned char digestIndex = 0;
 	unsigned char ch;
 	
-	Tag *tag = (Tag *)index;
+	Tag *tag = indexTag( index );
 	Index *level;
 	Bucket *bucket;
 	
-	unsigned char *bucketData;
-	unsigned char *tempCL;
-	
-	while (tag && (tag->type == MH_SIG_INDEX)) {
-		level = (Index *)tag;
-		ch = digest[digestIndex];
+	while (tag && isIndex(tag)) {
+		level = toIndex( tag );
+		ch = digestAt(hash, digestIndex);
 		tag = level->data[ch];
 		if (!tag) {
 			// not found
 			resp.result = MH_ERR;
 			tag = NULL; // break
 		}
-		else if (tag->type == MH_SIG_BUCKET) {
+		else if (!isIndex(tag)) {
 			// found bucket list, append
 			bucket = (Bucket *)tag;
 			
 			while (bucket) {
-				if (bucketKeyEquals(bucket, key, keyLength)) {
-					// found!
-					bucketData = ((unsigned char *)bucket) + sizeof(Bucket);
-					tempCL = bucketData + MH_KLEN_SIZE + keyLength;
-					
-					resp.result = MH_OK;
-					resp.contentLength = ((MH_LEN_T *)tempCL)[0];
-					resp.content = bucketData + MH_KLEN_SIZE + keyLength + MH_LEN_SIZE;
-					resp.flags = bucket->flags;
-					resp.bucket = bucket;
+				if ((bucket->hash == hash) && bucketKeyEquals(bucket, key, keyLength)) {
+					if (isExpired(bucket)) {
+						// found, but TTL ran out
+						resp.result = MH_ERR;
+					}
+					else {
+						// found!
+						resp.result = MH_OK;
+						resp.contentLength = bucketGetContentLength(bucket);
+						resp.content = bucketGetContent(bucket);
+						resp.flags = bucket->flags;
+						resp.bucket = bucket;
+					}
 					
 					bucket = NULL; // break
 				}
@@ -339,54 +698,132 @@ Response Hash::peek(unsigned char *key, MH_KLEN_T keyLength) {
 	return resp;
 }
 
-Response Hash::remove(unsigned char *key, MH_KLEN_T keyLength) {
+uint64_t Hash::peekMany(Lookup *lookups, uint32_t count, uint32_t group) {
+	// fetch values for a batch of keys, without LRU promotion, same as calling peek() for each one
+	// up to group lookups are in flight at once, and each round moves every one of them down one node,
+	// after prefetching the node it needs next, so the cache misses of different keys overlap instead of adding up
+	// results go into each lookup's resp, return total number of nodes visited (dependent loads, for benchmarks)
+	uint32_t active[MH_LOOKUP_MAX_GROUP];
+	uint32_t numActive = 0;
+	uint32_t next = 0;
+	uint64_t numSteps = 0;
+	
+	group = MAX( 1, MIN(group, MH_LOOKUP_MAX_GROUP) );
+	
+	while (numActive || (next < count)) {
+		// top up the group with new lookups (the top level index is always hot, so start one level down)
+		while ((numActive < group) && (next < count)) {
+			Lookup *lookup = &lookups[next];
+			lookup->resp = Response();
+			lookup->digestIndex = 0;
+			if (engine == MH_ENGINE_TABLE) startTableLookup( lookup );
+			else {
+				lookup->tag = index->data[ digestAt(lookup->hash, 0) ];
+				prefetchTag( lookup->tag, lookup->hash, 1 );
+			}
+			active[numActive++] = next++;
+		}
+		
+		// advance every lookup by one node, finished ones swap places with the last
+		for (uint32_t idx = 0; idx < numActive; ) {
+			Lookup *lookup = &lookups[ active[idx] ];
+			int more;
+			if (engine == MH_ENGINE_TABLE) {
+				numSteps++;
+				more = stepTableLookup( lookup );
+			}
+			else {
+				if (lookup->tag) numSteps++;
+				more = stepLookup( lookup );
+			}
+			if (more) idx++;
+			else active[idx] = active[--numActive];
+		}
+	}
+	
+	return numSteps;
+}
+
+int Hash::stepLookup(Lookup *lookup) {
+	// internal method: visit next node for an interleaved lookup, prefetch the one after, return false when done
+	Tag *tag = lookup->tag;
+	if (!tag) {
+		// not found
+		lookup->resp.result = MH_ERR;
+		return 0;
+	}
+	
+	if (isIndex(tag)) {
+		lookup->digestIndex++;
+		lookup->tag = toIndex(tag)->data[ digestAt(lookup->hash, lookup->digestIndex) ];
+		prefetchTag( lookup->tag, lookup->hash, lookup->digestIndex + 1 );
+		return 1;
+	}
+	
+	Bucket *bucket = (Bucket *)tag;
+	if ((bucket->hash == lookup->hash) && bucketKeyEquals(bucket, lookup->key, lookup->keyLength)) {
+		if (isExpired(bucket)) {
+			// found, but TTL ran out
+			lookup->resp.result = MH_ERR;
+		}
+		else {
+			// found!
+			lookup->resp.result = MH_OK;
+			lookup->resp.contentLength = bucketGetContentLength(bucket);
+			lookup->resp.content = bucketGetContent(bucket);
+			lookup->resp.flags = bucket->flags;
+			lookup->resp.bucket = bucket;
+		}
+		return 0;
+	}
+	
+	// next bucket in the list
+	lookup->tag = bucket->next;
+	prefetchTag( lookup->tag, lookup->hash, 0 );
+	return 1;
+}
+
+Response Hash::remove(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength) {
 	// remove bucket given key
-	unsigned char digest[MH_DIGEST_SIZE];
+	// hash must be hashKey(key, keyLength), computed by the caller
 	Response resp;
 	
-	// first digest key
-	digestKey(key, keyLength, digest);
+	if (engine == MH_ENGINE_TABLE) {
+		Tag **slot = tableFind( hash, key, keyLength, NULL );
+		if (slot) {
+			deleteBucket( (Bucket *)slot[0], NULL, slot );
+			resp.result = MH_OK;
+		}
+		if (table.oldGroups) tableMigrate( MH_TABLE_MIGRATE );
+		return resp;
+	}
 	
 	unsigned char digestIndex = 0;
 	unsigned char ch;
 	
-	Tag *tag = (Tag *)index;
+	Tag *tag = indexTag( index );
 	Index *level;
 	Bucket *bucket, *lastBucket;
 	
-	while (tag && (tag->type == MH_SIG_INDEX)) {
-		level = (Index *)tag;
-		ch = digest[digestIndex];
+	while (tag && isIndex(tag)) {
+		level = toIndex( tag );
+		ch = digestAt(hash, digestIndex);
 		tag = level->data[ch];
 		if (!tag) {
 			// not found
 			resp.result = MH_ERR;
 			tag = NULL; // break
 		}
-		else if (tag->type == MH_SIG_BUCKET) {
+		else if (!isIndex(tag)) {
 			// found bucket list, traverse
 			bucket = (Bucket *)tag;
 			lastBucket = NULL;
 			
 			while (bucket) {
-				if (bucketKeyEquals(bucket, key, keyLength)) {
+				if ((bucket->hash == hash) && bucketKeyEquals(bucket, key, keyLength)) {
 					// found!
-					stats->dataSize -= (bucketGetKeyLength(bucket) + bucketGetContentLength(bucket));
-					stats->metaSize -= (sizeof(Bucket) + MH_KLEN_SIZE + MH_LEN_SIZE);
-					stats->numKeys--;
-					
-					if (lastBucket) lastBucket->next = bucket->next;
-					else level->data[ch] = bucket->next;
-					
-					// LRU remove from linked list
-					if (bucket->cachePrev) bucket->cachePrev->cacheNext = bucket->cacheNext;
-					if (bucket->cacheNext) bucket->cacheNext->cachePrev = bucket->cachePrev;
-					if (bucket == cacheFirst) cacheFirst = bucket->cacheNext;
-					if (bucket == cacheLast) cacheLast = bucket->cachePrev;
-					// end LRU section
-					
+					deleteBucket( bucket, lastBucket, &level->data[ch] );
 					resp.result = MH_OK;
-					free((void *)bucket);
 					bucket = NULL; // break
 				}
 				else if (!bucket->next) {
@@ -410,105 +847,353 @@ Response Hash::remove(unsigned char *key, MH_KLEN_T keyLength) {
 	return resp;
 }
 
+void Hash::deleteBucket(Bucket *bucket, Bucket *lastBucket, Tag **slot) {
+	// internal method: unlink bucket from its chain and the LRU list, and free it
+	// lastBucket is the previous bucket in the chain (or NULL), slot is the index slot holding the chain (or the table slot)
+	if (engine == MH_ENGINE_TABLE) tableErase( slot );
+	else if (lastBucket) lastBucket->next = bucket->next;
+	else slot[0] = (Tag *)bucket->next;
+	
+	dropBucket( bucket );
+}
+
+void Hash::dropBucket(Bucket *bucket) {
+	// internal method: bucket is out of the index, so take it off the LRU list, count it and free it
+	stats->dataSize -= (bucketGetKeyLength(bucket) + bucketGetContentLength(bucket));
+	stats->metaSize -= bucketMetaFor( bucket->type );
+	stats->numKeys--;
+	
+	// LRU remove from linked list
+	unlinkBucket( bucket );
+	
+	freeBucket( bucket );
+}
+
+void Hash::freeBucket(Bucket *bucket) {
+	// internal method: free bucket which is no longer in the table, or leave it for unpin() if a view still needs it
+	if (bucket->state & MH_STATE_PINNED) bucket->state |= MH_STATE_RETIRED;
+	else arena->release( (void *)bucket, bucketGetSize(bucket) );
+}
+
+void Hash::evictBucket(Bucket *bucket) {
+	// internal method: remove bucket we already hold a pointer to (i.e. the LRU tail)
+	// follows the cached hash down the index, and finds the bucket in its chain by address,
+	// so the key is never rehashed or compared
+	if (engine == MH_ENGINE_TABLE) {
+		deleteBucket( bucket, NULL, tableFind(bucket->hash, NULL, 0, bucket) );
+		return;
+	}
+	
+	unsigned char digestIndex = 0;
+	Tag **slot = &index->data[ digestAt(bucket->hash, 0) ];
+	
+	while (isIndex(slot[0])) {
+		digestIndex++;
+		slot = &toIndex(slot[0])->data[ digestAt(bucket->hash, digestIndex) ];
+	}
+	
+	Bucket *current = (Bucket *)slot[0];
+	Bucket *lastBucket = NULL;
+	
+	while (current != bucket) {
+		lastBucket = current;
+		current = current->next;
+	}
+	
+	deleteBucket( bucket, lastBucket, slot );
+}
+
 void Hash::clear() {
 	// clear ALL keys/values
-	for (int idx = 0; idx < MH_INDEX_SIZE; idx++) {
-		if (index->data[idx]) {
-			clearTag( index->data[idx] );
-			index->data[idx] = NULL;
-		}
+	// every bucket and index lives in the arena, so release whole slabs instead of walking the tree
+	// unless views have buckets pinned, then those have to stay, so free everything else one by one
+	if (pins && !pins->empty()) {
+		if (engine == MH_ENGINE_TABLE) tableClearAll();
+		else clearTag( indexTag(index), 0 );
+	}
+	else arena->clear();
+	
+	reset();
+	sketch->clear();
+	if (wheel) wheel->clear();
+}
+
+void Hash::deleteWhere(Filter *filter, uint32_t slice) {
+	// delete the keys in one thin slice (see clear(char1, char2)) which match the filter, and add to its totals
+	// slices only depend on the key hash, so going through them in order visits every key once, even with stores and deletes in between
+	uint64_t prefix = (uint64_t)slice << 48;
+	uint64_t numKeys = stats->numKeys;
+	uint64_t numBytes = stats->dataSize + stats->metaSize;
+	
+	if (engine == MH_ENGINE_TABLE) {
+		tableClear( table.groups, table.bits, prefix, 16, filter );
+		if (table.oldGroups) tableClear( table.oldGroups, table.oldBits, prefix, 16, filter );
+	}
+	else filterIndex( index, 0, prefix, 16, filter );
+	
+	filter->numKeys += numKeys - stats->numKeys;
+	filter->numBytes += numBytes - (stats->dataSize + stats->metaSize);
+}
+
+Discard *Hash::discard() {
+	// clear ALL keys/values in constant time, by swapping in an empty arena, sketch and timer wheel,
+	// and hand the old ones back to the caller, to be freed elsewhere (delete the Discard when done)
+	// if views have buckets pinned, this falls back to clear() and returns NULL, as those buckets have to stay
+	if (pins && !pins->empty()) {
+		clear();
+		return NULL;
+	}
+	
+	Discard *old = new Discard();
+	old->numBytes = arena->residentSize();
+	old->arena = arena->detach();
+	old->sketchTable = sketch->detach();
+	
+	if (wheel && wheel->numTimers) {
+		old->wheel = wheel;
+		wheel = new TimerWheel();
 	}
 	
+	reset();
+	return old;
+}
+
+void Hash::reset() {
+	// internal method: start over with an empty index and LRU list (caller has freed all buckets)
+	stats->dataSize = 0;
+	stats->metaSize = 0;
+	stats->numKeys = 0;
+	stats->indexSize = 0;
+	stats->numIndexes = 0;
+	
+	if (engine == MH_ENGINE_TABLE) tableInit();
+	else index = newIndex( 0 );
+	
 	cacheFirst = NULL;
 	cacheLast = NULL;
+	
+	windowLast = NULL;
+	protectedLast = NULL;
+	windowCount = 0;
+	protectedCount = 0;
+	
+	// open cursors are now at the end
+	if (cursors) {
+		for (size_t idx = 0; idx < cursors->size(); idx++) (*cursors)[idx]->bucket = NULL;
+	}
 }
 
 void Hash::clear(unsigned char slice) {
-	// clear one "thick slice" from main index (about 1/256 of total keys)
+	// clear one "thick slice" from main index (about 1/256 of total keys, the ones whose hash starts with slice)
 	// this is so you can split up the job into pieces and not hang the CPU for too long
-	unsigned char slice1 = slice / 16;
-	unsigned char slice2 = slice % 16;
-	
-	// since our index system is 4-bit, we split the uchar into two pieces
-	// and traverse into a nested index for the 2nd piece, if applicable
-	if (index->data[slice1]) {
-		Tag *tag = index->data[slice1];
-		if (tag->type == MH_SIG_INDEX) {
-			// nested index, use idx2
-			Index *level = (Index *)tag;
-			if (level->data[slice2]) {
-				clearTag( level->data[slice2] );
-				level->data[slice2] = NULL;
-			}
-			
-			// also clear top-level index if it is now empty
-			int empty = 1;
-			for (int idx = 0; idx < MH_INDEX_SIZE; idx++) {
-				if (level->data[idx]) { empty = 0; idx = MH_INDEX_SIZE; }
-			}
-			if (empty) {
-				clearTag( tag );
-				index->data[slice1] = NULL;
-			}
-		}
-		else if (tag->type == MH_SIG_BUCKET) {
-			clearTag( tag );
-			index->data[slice1] = NULL;
-		}
+	if (engine == MH_ENGINE_TABLE) {
+		tableClear( table.groups, table.bits, (uint64_t)slice << 56, 8 );
+		if (table.oldGroups) tableClear( table.oldGroups, table.oldBits, (uint64_t)slice << 56, 8 );
 	}
+	else clearPrefix( index, 0, (uint64_t)slice << 56, 8 );
 }
 
 void Hash::clear(unsigned char char1, unsigned char char2) {
-	// clear one "thin slice" from main index (about 1/65536 of total keys)
+	// clear one "thin slice" from main index (about 1/65536 of total keys, the ones whose hash starts with char1, char2)
 	// this is so you can split up the job into pieces and not hang the CPU for too long
-	unsigned char slices[4];
-	slices[0] = char1 / 16;
-	slices[1] = char1 % 16;
-	slices[2] = char2 / 16;
-	slices[3] = char2 % 16;
+	uint64_t prefix = ((uint64_t)char1 << 56) | ((uint64_t)char2 << 48);
+	if (engine == MH_ENGINE_TABLE) {
+		tableClear( table.groups, table.bits, prefix, 16 );
+		if (table.oldGroups) tableClear( table.oldGroups, table.oldBits, prefix, 16 );
+	}
+	else clearPrefix( index, 0, prefix, 16 );
+}
+
+int Hash::setLayout(unsigned char newRootBits, unsigned char newIndexBits) {
+	// change index fan-out, only while the table is empty (bits are clamped to MH_INDEX_MIN_BITS - MH_INDEX_MAX_BITS)
+	// wider levels make the tree shallower, so lookups take fewer cache misses, but sparse levels waste more memory
+	if (stats->numKeys || (pins && !pins->empty()) || (engine != MH_ENGINE_TRIE)) return MH_ERR;
 	
-	clearSlice( index, slices, 0 );
+	freeIndex( index, 0 );
+	initLayout( newRootBits, newIndexBits );
+	index = newIndex( 0 );
+	return index ? MH_OK : MH_ERR;
 }
 
-void Hash::clearSlice(Index *level, unsigned char *slices, unsigned char idx) {
-	// traverse one 4-bit slice and traverse if we have more slices to go
-	unsigned char slice = slices[idx];
+int Hash::setEngine(unsigned char newEngine) {
+	// switch storage engine, only while the table is empty
+	if (stats->numKeys || (pins && !pins->empty())) return MH_ERR;
+	if (newEngine == engine) return MH_OK;
 	
-	if (level->data[slice]) {
-		Tag *tag = level->data[slice];
-		if (tag->type == MH_SIG_INDEX) {
-			if (idx < 3) clearSlice( (Index *)tag, slices, idx + 1 );
-			else {
-				clearTag( tag );
-				level->data[slice] = NULL;
-			}
-		}
-		else if (tag->type == MH_SIG_BUCKET) {
-			clearTag( tag );
-			level->data[slice] = NULL;
+	if (engine == MH_ENGINE_TABLE) {
+		tableFree( table.mem, table.bits );
+		if (table.oldGroups) tableFree( table.oldMem, table.oldBits );
+		table.init();
+	}
+	else {
+		freeIndex( index, 0 );
+		index = NULL;
+	}
+	
+	engine = newEngine;
+	if (engine == MH_ENGINE_TABLE) return tableInit();
+	
+	index = newIndex( 0 );
+	return index ? MH_OK : MH_ERR;
+}
+
+void Hash::setMetrics(uint32_t sample) {
+	// start counting and timing operations (timing one in sample of them), or stop and forget everything with 0
+	// changing the rate while already on keeps the numbers so far
+	// (caller holds the exclusive lock, as readers record into the metrics under the shared lock)
+	if (!sample) {
+		delete metrics;
+		metrics = NULL;
+	}
+	else if (metrics) metrics->sample = sample;
+	else metrics = new Metrics( sample );
+}
+
+void Hash::getShape(Shape *shape) {
+	// add up where the keys sit: per index level and longest bucket list, or for the flat table, how far they are from their home group
+	// this walks every key, so it takes a while on a big table (a shared lock is enough)
+	if (engine == MH_ENGINE_TABLE) {
+		if (table.groups) tableShape( table.groups, table.bits, shape );
+		if (table.oldGroups) tableShape( table.oldGroups, table.oldBits, shape );
+	}
+	else shapeIndex( index, 0, shape );
+}
+
+void Hash::shapeIndex(Index *level, unsigned char digestIndex, Shape *shape) {
+	// internal method: getShape() for an index and everything below it
+	uint32_t count = (uint32_t)1 << (digestIndex ? indexBits : rootBits);
+	
+	for (uint32_t ch = 0; ch < count; ch++) {
+		Tag *tag = level->data[ch];
+		if (!tag) continue;
+		if (isIndex(tag)) {
+			shapeIndex( toIndex(tag), digestIndex + 1, shape );
+			continue;
 		}
+		
+		uint64_t length = 0;
+		for (Bucket *bucket = (Bucket *)tag; bucket; bucket = bucket->next) length++;
+		
+		shape->depths[ MIN(digestIndex, MH_DIGEST_SIZE - 1) ] += length;
+		shape->maxChain = MAX( shape->maxChain, length );
+		shape->numChains++;
+	}
+}
+
+void Hash::initLayout(unsigned char newRootBits, unsigned char newIndexBits) {
+	// internal method: set bits per level, and work out where each level's digit sits in the hash
+	rootBits = MAX( MH_INDEX_MIN_BITS, MIN(newRootBits, MH_INDEX_MAX_BITS) );
+	indexBits = MAX( MH_INDEX_MIN_BITS, MIN(newIndexBits, MH_INDEX_MAX_BITS) );
+	maxDepth = 1 + ((64 - rootBits) / indexBits);
+	
+	for (unsigned char idx = 0; idx < MH_DIGEST_SIZE; idx++) {
+		shifts[idx] = (idx < maxDepth) ? (unsigned char)(64 - rootBits - (idx * indexBits)) : 0;
+	}
+}
+
+int Hash::clearPrefix(Index *level, unsigned char digestIndex, uint64_t prefix, unsigned char prefixBits) {
+	// internal method: clear all keys whose hash starts with the top prefixBits of prefix, from an index and everything below it
+	// slots entirely inside the prefix are cleared whole, the one slot which straddles its end is cleared key by key (or recursively)
+	// return true if the index is now empty
+	unsigned char bits = digestIndex ? indexBits : rootBits;
+	unsigned char start = 64 - shifts[digestIndex] - bits; // hash bits used by the levels above this one
+	
+	if (prefixBits >= start + bits) {
+		// prefix picks one slot here, and carries on below it
+		unsigned char ch = digestAt( prefix, digestIndex );
+		Tag *tag = level->data[ch];
+		if (tag && isIndex(tag)) {
+			if (clearPrefix(toIndex(tag), digestIndex + 1, prefix, prefixBits)) {
+				freeIndex( toIndex(tag), digestIndex + 1 );
+				level->data[ch] = NULL;
+			}
+		}
+		else if (tag) clearBuckets( &level->data[ch], prefix, prefixBits );
+	}
+	else {
+		// prefix ends within this level, so it covers a range of slots
+		unsigned char extra = start + bits - prefixBits;
+		uint32_t first = (uint32_t)digestAt(prefix, digestIndex) & ~(((uint32_t)1 << extra) - 1);
+		for (uint32_t ch = first; ch < first + ((uint32_t)1 << extra); ch++) {
+			if (level->data[ch]) {
+				clearTag( level->data[ch], digestIndex + 1 );
+				level->data[ch] = NULL;
+			}
+		}
+	}
+	
+	for (uint32_t ch = 0; ch < ((uint32_t)1 << bits); ch++) {
+		if (level->data[ch]) return 0;
+	}
+	return 1;
+}
+
+void Hash::clearBuckets(Tag **slot, uint64_t prefix, unsigned char prefixBits, Filter *filter) {
+	// internal method: delete the keys in one bucket list whose hash starts with the top prefixBits of prefix
+	// (and which match the filter, if there is one)
+	Bucket *bucket = (Bucket *)slot[0];
+	Bucket *lastBucket = NULL;
+	
+	while (bucket) {
+		Bucket *next = bucket->next;
+		if (((bucket->hash >> (64 - prefixBits)) == (prefix >> (64 - prefixBits))) && (!filter || matchBucket(bucket, filter))) deleteBucket( bucket, lastBucket, slot );
+		else lastBucket = bucket;
+		bucket = next;
+	}
+}
+
+void Hash::filterIndex(Index *level, unsigned char digestIndex, uint64_t prefix, unsigned char prefixBits, Filter *filter) {
+	// internal method: delete the keys below an index whose hash starts with the top prefixBits of prefix, and which match the filter
+	// same walk as clearPrefix(), but key by key, and indexes which end up empty are left in place
+	unsigned char bits = digestIndex ? indexBits : rootBits;
+	unsigned char start = 64 - shifts[digestIndex] - bits; // hash bits used by the levels above this one
+	uint32_t first = 0;
+	uint32_t count = (uint32_t)1 << bits;
+	
+	if (prefixBits >= start + bits) {
+		// prefix picks one slot here
+		first = digestAt( prefix, digestIndex );
+		count = 1;
+	}
+	else if (prefixBits > start) {
+		// prefix ends within this level, so it covers a range of slots
+		count = (uint32_t)1 << (start + bits - prefixBits);
+		first = (uint32_t)digestAt(prefix, digestIndex) & ~(count - 1);
+	}
+	
+	for (uint32_t ch = first; ch < first + count; ch++) {
+		Tag *tag = level->data[ch];
+		if (tag && isIndex(tag)) filterIndex( toIndex(tag), digestIndex + 1, prefix, prefixBits, filter );
+		else if (tag) clearBuckets( &level->data[ch], prefix, prefixBits, filter );
 	}
 }
 
-void Hash::clearTag(Tag *tag) {
-	// internal method: clear one tag (index or bucket)
+int Hash::matchBucket(Bucket *bucket, Filter *filter) {
+	// internal method: check if bucket matches the filter for deleteWhere()
+	filter->numVisited++;
+	if (filter->typeMask && !(filter->typeMask & ((uint32_t)1 << bucket->flags))) return 0;
+	if (filter->prefixLength > bucketGetKeyLength(bucket)) return 0;
+	return !filter->prefixLength || !memcmp( (void *)bucketGetKey(bucket), (void *)filter->prefix, filter->prefixLength );
+}
+
+void Hash::clearTag(Tag *tag, unsigned char digestIndex) {
+	// internal method: clear one tag (index or bucket), digestIndex is the level it is at if it is an index
 	// traverse lists, recurse for nested indexes
-	if (tag->type == MH_SIG_INDEX) {
+	if (isIndex(tag)) {
 		// traverse index
-		Index *level = (Index *)tag;
+		Index *level = toIndex( tag );
 		
-		for (int idx = 0; idx < MH_INDEX_SIZE; idx++) {
+		for (uint32_t idx = 0; idx < ((uint32_t)1 << (digestIndex ? indexBits : rootBits)); idx++) {
 			if (level->data[idx]) {
-				clearTag( level->data[idx] );
+				clearTag( level->data[idx], digestIndex + 1 );
 				level->data[idx] = NULL;
 			}
 		}
 		
 		// kill index
-		delete level;
-		stats->indexSize -= sizeof(Index);
+		freeIndex( level, digestIndex );
 	}
-	else if (tag->type == MH_SIG_BUCKET) {
+	else {
 		// delete all buckets in list
 		Bucket *bucket = (Bucket *)tag;
 		Bucket *lastBucket;
@@ -516,21 +1201,358 @@ void Hash::clearTag(Tag *tag) {
 		while (bucket) {
 			lastBucket = bucket;
 			bucket = bucket->next;
+			dropBucket( lastBucket );
+		}
+	}
+}
+
+Response Hash::tableStore(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength, unsigned char *content, MH_LEN_T contentLength, unsigned char flags, uint32_t expires) {
+	// internal method: store() for the flat table engine
+	// a new key always goes into the current array, and every store moves a little more of a rebuild along
+	Response resp;
+	
+	Tag **slot = tableFind( hash, key, keyLength, NULL );
+	if (slot) {
+		resp.result = updateBucket( (Bucket *)slot[0], NULL, slot, content, contentLength, flags, expires );
+		if (resp.result == MH_ERR) return resp;
+	}
+	else {
+		if (((table.used + 1) * 8 > table.capacity() * MH_TABLE_MAX_LOAD) && !tableGrow()) {
+			resp.result = MH_ERR;
+			return resp;
+		}
+		
+		Bucket *bucket = allocBucket(hash, key, keyLength, content, contentLength, flags);
+		if (!bucket) {
+			resp.result = MH_ERR;
+			return resp;
+		}
+		tableInsert( hash )[0] = (Tag *)bucket;
+		setExpires( bucket, expires );
+		
+		// add new bucket as new LRU head
+		insertBucket( bucket );
+		
+		resp.result = MH_ADD;
+		stats->dataSize += keyLength + contentLength;
+		stats->metaSize += bucketMetaFor( bucket->type );
+		stats->numKeys++;
+	}
+	
+	if (table.oldGroups) tableMigrate( MH_TABLE_MIGRATE );
+	
+	makeRoom();
+	return resp;
+}
+
+Response Hash::tableFetch(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength, int touch) {
+	// internal method: fetch() (touch true) or peek() for the flat table engine
+	Response resp;
+	
+	Tag **slot = tableFind( hash, key, keyLength, NULL );
+	if (!slot) return resp;
+	
+	Bucket *bucket = (Bucket *)slot[0];
+	if (isExpired(bucket)) {
+		// found, but TTL ran out, so reap it now (unless we are only peeking)
+		if (touch) reapBucket( bucket, NULL, slot );
+		return resp;
+	}
+	
+	resp.result = MH_OK;
+	resp.contentLength = bucketGetContentLength(bucket);
+	resp.content = bucketGetContent(bucket);
+	resp.flags = bucket->flags;
+	resp.bucket = bucket;
+	
+	if (touch) touchBucket( bucket );
+	return resp;
+}
+
+Tag **Hash::tableFind(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength, Bucket *target) {
+	// internal method: find the table slot holding a key, in the current array, then the old one
+	// matches by key, or by bucket address if key is NULL (or if that is NULL too, the first bucket with this hash and a TTL)
+	Tag **slot = tableProbe( table.groups, table.bits, hash, key, keyLength, target );
+	if (!slot && table.oldGroups) slot = tableProbe( table.oldGroups, table.oldBits, hash, key, keyLength, target );
+	return slot;
+}
+
+Tag **Hash::tableProbe(TableGroup *groups, unsigned char bits, uint64_t hash, unsigned char *key, MH_KLEN_T keyLength, Bucket *target) {
+	// internal method: find the slot holding a key in one array (see tableFind())
+	// probe one group at a time from the home group, until the key turns up, or a group which has never been full
+	uint64_t mask = ((uint64_t)1 << bits) - 1;
+	uint64_t pos = hash >> (64 - bits);
+	unsigned char ctrl = Table::ctrlFor( hash );
+	
+	for (uint64_t count = 0; count <= mask; count++) {
+		TableGroup *group = &groups[pos];
+		
+		for (uint32_t hits = group->match(ctrl); hits; hits &= hits - 1) {
+			Tag **slot = &group->slots[ mhLowBit(hits) ];
+			Bucket *bucket = (Bucket *)slot[0];
 			
-			stats->dataSize -= (bucketGetKeyLength(lastBucket) + bucketGetContentLength(lastBucket));
-			stats->metaSize -= (sizeof(Bucket) + MH_KLEN_SIZE + MH_LEN_SIZE);
-			stats->numKeys--;
-			
-			// LRU remove bucket from linked list
-			if (lastBucket->cachePrev) lastBucket->cachePrev->cacheNext = lastBucket->cacheNext;
-			if (lastBucket->cacheNext) lastBucket->cacheNext->cachePrev = lastBucket->cachePrev;
-			if (lastBucket == cacheFirst) cacheFirst = lastBucket->cacheNext;
-			if (lastBucket == cacheLast) cacheLast = lastBucket->cachePrev;
-			// end LRU section
+			if (key) {
+				if ((bucket->hash == hash) && bucketKeyEquals(bucket, key, keyLength)) return slot;
+			}
+			else if (target) {
+				if (bucket == target) return slot;
+			}
+			else if ((bucket->hash == hash) && bucket->expires) return slot;
+		}
+		
+		if (group->hasEmpty()) return NULL;
+		pos = (pos + 1) & mask;
+	}
+	
+	return NULL;
+}
+
+Tag **Hash::tableInsert(uint64_t hash) {
+	// internal method: claim a slot for a new key in the current array (caller checks the key is not already in the table)
+	// takes the first empty or deleted slot from the home group on, there is always one, as the array is never full
+	uint64_t mask = ((uint64_t)1 << table.bits) - 1;
+	uint64_t pos = hash >> (64 - table.bits);
+	uint32_t free;
+	
+	while (!(free = ~table.groups[pos].matchFull() & MH_TABLE_SLOT_MASK)) {
+		pos = (pos + 1) & mask;
+	}
+	
+	TableGroup *group = &table.groups[pos];
+	uint32_t idx = mhLowBit( free );
+	if (group->ctrl[idx] == MH_CTRL_DELETED) table.numDeleted--;
+	else table.used++;
+	
+	group->ctrl[idx] = Table::ctrlFor( hash );
+	return &group->slots[idx];
+}
+
+void Hash::tableErase(Tag **slot) {
+	// internal method: free a table slot, in either array
+	// it can go back to empty only if its group has another empty slot, as then no probe has ever gone past the group,
+	// otherwise it is marked deleted, so probes still carry on past it
+	TableGroup *group = (TableGroup *)((uintptr_t)slot & ~(uintptr_t)(sizeof(TableGroup) - 1));
+	uint32_t idx = (uint32_t)(slot - group->slots);
+	int current = (group >= table.groups) && (group < table.groups + ((uint64_t)1 << table.bits));
+	
+	slot[0] = NULL;
+	if (group->hasEmpty()) {
+		group->ctrl[idx] = MH_CTRL_EMPTY;
+		if (current) table.used--;
+	}
+	else {
+		group->ctrl[idx] = MH_CTRL_DELETED;
+		if (current) table.numDeleted++;
+	}
+}
+
+int Hash::tableInit() {
+	// internal method: start over with an empty table at the minimum size (caller has freed the old arrays)
+	table.init();
+	table.groups = tableAlloc( MH_TABLE_MIN_BITS, &table.mem );
+	table.bits = MH_TABLE_MIN_BITS;
+	return table.groups ? MH_OK : MH_ERR;
+}
+
+int Hash::tableGrow() {
+	// internal method: the current array is too full, so start rebuilding into a new one, twice the size
+	// (or the same size, if it is mostly deleted slots), and move the keys over a few groups at a time (see tableMigrate())
+	// the new array has room for at least 7/8 of the old capacity in new keys, and 1/14 of that many stores moves
+	// everything over, so the previous rebuild is always long done by the time the next one starts
+	if (table.oldGroups) tableMigrate( ((uint64_t)1 << table.oldBits) - table.migrated );
+	
+	uint64_t numKeys = table.used - table.numDeleted;
+	unsigned char newBits = (numKeys * 16 < table.capacity() * MH_TABLE_MAX_LOAD) ? table.bits : (table.bits + 1);
+	
+	void *newMem = NULL;
+	TableGroup *newGroups = tableAlloc( newBits, &newMem );
+	if (!newGroups) return MH_ERR;
+	
+	table.oldGroups = table.groups;
+	table.oldMem = table.mem;
+	table.oldBits = table.bits;
+	table.migrated = 0;
+	
+	table.groups = newGroups;
+	table.mem = newMem;
+	table.bits = newBits;
+	table.used = 0;
+	table.numDeleted = 0;
+	
+	stats->numRebuilds++;
+	return MH_OK;
+}
+
+void Hash::tableMigrate(uint64_t count) {
+	// internal method: move the keys from the next few old groups into the current array, and free the old one when done
+	// only slot pointers move, buckets stay put
+	uint64_t numGroups = (uint64_t)1 << table.oldBits;
+	
+	while (count-- && (table.migrated < numGroups)) {
+		TableGroup *group = &table.oldGroups[ table.migrated++ ];
+		
+		for (uint32_t full = group->matchFull(); full; full &= full - 1) {
+			uint32_t idx = mhLowBit( full );
+			Bucket *bucket = (Bucket *)group->slots[idx];
+			tableInsert( bucket->hash )[0] = (Tag *)bucket;
 			
-			free((void *)lastBucket);
+			group->ctrl[idx] = MH_CTRL_DELETED;
+			group->slots[idx] = NULL;
 		}
 	}
+	
+	if (table.migrated == numGroups) {
+		tableFree( table.oldMem, table.oldBits );
+		table.oldGroups = NULL;
+		table.oldMem = NULL;
+		table.oldBits = 0;
+		table.migrated = 0;
+	}
+}
+
+void Hash::tableClear(TableGroup *groups, unsigned char bits, uint64_t prefix, unsigned char prefixBits, Filter *filter) {
+	// internal method: clear all keys whose hash starts with the top prefixBits of prefix, from one array
+	// (only the ones which match the filter, if there is one)
+	// keys are placed by the top bits of their hash, so the prefix covers one run of home groups (or part of one group),
+	// and as a key never sits past a group which has an empty slot, the scan carries on to the first one of those
+	uint64_t numGroups = (uint64_t)1 << bits;
+	uint64_t first = prefix >> (64 - bits);
+	uint64_t count = (bits > prefixBits) ? ((uint64_t)1 << (bits - prefixBits)) : 1;
+	
+	for (uint64_t num = 0; num < numGroups; num++) {
+		TableGroup *group = &groups[ (first + num) & (numGroups - 1) ];
+		
+		for (uint32_t full = group->matchFull(); full; full &= full - 1) {
+			Tag **slot = &group->slots[ mhLowBit(full) ];
+			Bucket *bucket = (Bucket *)slot[0];
+			if (((bucket->hash >> (64 - prefixBits)) == (prefix >> (64 - prefixBits))) && (!filter || matchBucket(bucket, filter))) deleteBucket( bucket, NULL, slot );
+		}
+		
+		// erasing never makes a group without empty slots have one, so this is the same as before the loop
+		if ((num + 1 >= count) && group->hasEmpty()) break;
+	}
+}
+
+void Hash::tableClearAll() {
+	// internal method: delete every key one by one, and free both arrays (for clear() while views have buckets pinned)
+	TableGroup *arrays[2] = { table.groups, table.oldGroups };
+	unsigned char arrayBits[2] = { table.bits, table.oldBits };
+	
+	for (int pass = 0; pass < 2; pass++) {
+		if (!arrays[pass]) continue;
+		
+		for (uint64_t pos = 0; pos < ((uint64_t)1 << arrayBits[pass]); pos++) {
+			TableGroup *group = &arrays[pass][pos];
+			for (uint32_t full = group->matchFull(); full; full &= full - 1) {
+				dropBucket( (Bucket *)group->slots[ mhLowBit(full) ] );
+			}
+		}
+	}
+	
+	tableFree( table.mem, table.bits );
+	if (table.oldGroups) tableFree( table.oldMem, table.oldBits );
+	table.init();
+}
+
+void Hash::tableShape(TableGroup *groups, unsigned char bits, Shape *shape) {
+	// internal method: getShape() for one array, each key counts by the number of groups it sits past its home group
+	uint64_t mask = ((uint64_t)1 << bits) - 1;
+	
+	for (uint64_t pos = 0; pos <= mask; pos++) {
+		uint32_t full = groups[pos].matchFull();
+		if (!full) continue;
+		
+		for (; full; full &= full - 1) {
+			Bucket *bucket = (Bucket *)groups[pos].slots[ mhLowBit(full) ];
+			uint64_t distance = (pos - (bucket->hash >> (64 - bits))) & mask;
+			shape->depths[ MIN(distance, MH_DIGEST_SIZE - 1) ]++;
+			shape->maxChain = MAX( shape->maxChain, distance + 1 );
+		}
+		shape->numChains++;
+	}
+}
+
+TableGroup *Hash::tableAlloc(unsigned char bits, void **mem) {
+	// internal method: allocate an empty array of groups from the arena, aligned to the group size
+	// zero filled memory is an empty array, and big arrays come from fresh pages, so this does not touch them up front
+	uint64_t size = Table::arraySize( bits );
+	*mem = arena->allocZeroed( size );
+	if (!*mem) return NULL;
+	
+	stats->indexSize += size;
+	stats->numIndexes++;
+	return (TableGroup *)(((uintptr_t)*mem + sizeof(TableGroup) - 1) & ~(uintptr_t)(sizeof(TableGroup) - 1));
+}
+
+void Hash::tableFree(void *mem, unsigned char bits) {
+	// internal method: give an array of groups back to the arena
+	uint64_t size = Table::arraySize( bits );
+	arena->release( mem, size );
+	stats->indexSize -= size;
+	stats->numIndexes--;
+}
+
+void Hash::startTableLookup(Lookup *lookup) {
+	// internal method: start an interleaved flat table lookup at its home group
+	lookup->tag = NULL;
+	lookup->hits = 0;
+	lookup->pass = 0;
+	lookup->group = Table::home( table.groups, table.bits, lookup->hash );
+	prefetchGroup( lookup->group );
+}
+
+int Hash::stepTableLookup(Lookup *lookup) {
+	// internal method: visit next node for an interleaved flat table lookup, prefetch the one after, return false when done
+	// nodes alternate between a group, which gives the slots to check, and the buckets in those slots
+	if (lookup->tag) {
+		Bucket *bucket = (Bucket *)lookup->tag;
+		if ((bucket->hash == lookup->hash) && bucketKeyEquals(bucket, lookup->key, lookup->keyLength)) {
+			if (isExpired(bucket)) {
+				// found, but TTL ran out
+				lookup->resp.result = MH_ERR;
+			}
+			else {
+				// found!
+				lookup->resp.result = MH_OK;
+				lookup->resp.contentLength = bucketGetContentLength(bucket);
+				lookup->resp.content = bucketGetContent(bucket);
+				lookup->resp.flags = bucket->flags;
+				lookup->resp.bucket = bucket;
+			}
+			return 0;
+		}
+		lookup->tag = NULL;
+	}
+	else lookup->hits = lookup->group->match( Table::ctrlFor(lookup->hash) );
+	
+	if (lookup->hits) {
+		// next slot in this group with a matching control byte
+		lookup->tag = lookup->group->slots[ mhLowBit(lookup->hits) ];
+		lookup->hits &= lookup->hits - 1;
+		prefetchTag( lookup->tag, lookup->hash, 0 );
+		return 1;
+	}
+	
+	if (!lookup->group->hasEmpty()) {
+		// key may be further on, try the next group
+		TableGroup *groups = lookup->pass ? table.oldGroups : table.groups;
+		uint64_t numGroups = (uint64_t)1 << (lookup->pass ? table.oldBits : table.bits);
+		lookup->group = (lookup->group + 1 < groups + numGroups) ? (lookup->group + 1) : groups;
+	}
+	else if (!lookup->pass && table.oldGroups) {
+		// not in the current array, but a rebuild is in progress, so try the old one
+		lookup->pass = 1;
+		lookup->group = Table::home( table.oldGroups, table.oldBits, lookup->hash );
+	}
+	else {
+		// not found
+		lookup->resp.result = MH_ERR;
+		return 0;
+	}
+	
+	lookup->digestIndex++;
+	prefetchGroup( lookup->group );
+	return 1;
 }
 
 Response Hash::firstKey() {
@@ -608,3 +1630,637 @@ Response Hash::prevKey(unsigned char *key, MH_KLEN_T keyLength) {
 	
 	return resp;
 }
+
+void Hash::attach(MapRegion *region) {
+	// pick up a table from a reopened cache file: reconnect the arena, and rebuild the parts which lived on the heap
+	// the frequency sketch starts over, and expiration timers are rebuilt from the keys (only if there were any)
+	arena->region = region;
+	sketch = new Sketch();
+	wheel = NULL;
+	pins = NULL;
+	cursors = NULL;
+	metrics = NULL;
+	appending = 0;
+	
+	if (reschedule) {
+		for (Bucket *bucket = cacheFirst; bucket; bucket = bucket->cacheNext) {
+			if (!bucket->expires) continue;
+			if (!wheel) wheel = new TimerWheel();
+			wheel->schedule( bucket->hash, bucket->expires );
+		}
+		reschedule = 0;
+	}
+}
+
+void Hash::detach() {
+	// let go of the heap parts of a table in a cache file, before the file is closed (everything else stays in the file)
+	delete sketch;
+	sketch = NULL;
+	
+	if (wheel) {
+		delete wheel;
+		wheel = NULL;
+		reschedule = 1;
+	}
+	
+	// views hold a reference to the cache, so nothing can be pinned by now
+	delete pins;
+	pins = NULL;
+	delete cursors;
+	cursors = NULL;
+	delete metrics;
+	metrics = NULL;
+}
+
+void Hash::pin(Bucket *bucket) {
+	// keep bucket memory alive and unchanged until the matching unpin(), even if the key is deleted, replaced or evicted
+	// the key itself carries on as normal, a replacement simply goes into a new bucket
+	if (!pins) pins = new std::unordered_map<Bucket *, uint32_t>();
+	(*pins)[bucket]++;
+	bucket->state |= MH_STATE_PINNED;
+}
+
+void Hash::unpin(Bucket *bucket) {
+	// release one pin, and free the bucket if it was removed from the table in the meantime
+	auto iter = pins->find( bucket );
+	if (--iter->second) return;
+	pins->erase( iter );
+	
+	bucket->state &= ~MH_STATE_PINNED;
+	if (bucket->state & MH_STATE_RETIRED) arena->release( (void *)bucket, bucketGetSize(bucket) );
+}
+
+void Hash::openCursor(Cursor *cursor) {
+	// start iterating from the LRU head (cursor->dir 1) or tail (-1), the cursor stays valid until closeCursor()
+	if (!cursors) cursors = new std::vector<Cursor *>();
+	cursors->push_back( cursor );
+	cursor->bucket = (cursor->dir > 0) ? cacheFirst : cacheLast;
+}
+
+void Hash::closeCursor(Cursor *cursor) {
+	// forget cursor, the hash stops tracking buckets for iteration when the last one is closed
+	for (size_t idx = 0; idx < cursors->size(); idx++) {
+		if ((*cursors)[idx] != cursor) continue;
+		(*cursors)[idx] = cursors->back();
+		cursors->pop_back();
+		break;
+	}
+	if (cursors->empty()) {
+		delete cursors;
+		cursors = NULL;
+	}
+	cursor->bucket = NULL;
+}
+
+Bucket *Hash::stepCursor(Cursor *cursor) {
+	// return the bucket under the cursor and move it along, or NULL at the end of the list (expired keys are skipped)
+	// keys promoted or moved between steps may be skipped or seen again, as they change places in the list
+	Bucket *bucket = cursor->bucket;
+	while (bucket && isExpired(bucket)) bucket = (cursor->dir > 0) ? bucket->cacheNext : bucket->cachePrev;
+	if (bucket) cursor->bucket = (cursor->dir > 0) ? bucket->cacheNext : bucket->cachePrev;
+	else cursor->bucket = NULL;
+	return bucket;
+}
+
+Slab *Arena::newSlab(unsigned char sizeClass) {
+	// allocate new slab, aligned to its own size so items can find the header
+	unsigned char *mem = NULL;
+	
+	if (region) {
+		// persistent cache, carve slab out of the file
+		mem = (unsigned char *)region->alloc( MH_SLAB_SIZE, MH_SLAB_SIZE );
+		if (!mem) return NULL;
+	}
+	else {
+#ifdef _WIN32
+		mem = (unsigned char *)_aligned_malloc( MH_SLAB_SIZE, MH_SLAB_SIZE );
+		if (!mem) return NULL;
+#else
+		// map twice the size, then trim both ends down to one aligned slab
+		unsigned char *raw = (unsigned char *)mmap( NULL, MH_SLAB_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+		if (raw == (unsigned char *)MAP_FAILED) return NULL;
+		
+		mem = (unsigned char *)(((uintptr_t)raw + MH_SLAB_SIZE - 1) & ~((uintptr_t)MH_SLAB_SIZE - 1));
+		if (mem > raw) munmap( (void *)raw, mem - raw );
+		if (mem < raw + MH_SLAB_SIZE) munmap( (void *)(mem + MH_SLAB_SIZE), (raw + MH_SLAB_SIZE) - mem );
+#endif
+	}
+	
+	Slab *slab = (Slab *)mem;
+	slab->prev = NULL;
+	slab->next = NULL;
+	slab->freeList = NULL;
+	slab->itemSize = classSize(sizeClass);
+	slab->used = 0;
+	slab->sizeClass = sizeClass;
+	slab->full = 0;
+	
+	// items start on the first cache line after the header
+	slab->bump = mem + ((sizeof(Slab) + 63) & ~63);
+	slab->end = mem + MH_SLAB_SIZE;
+	
+	numSlabs++;
+	slabBytes += MH_SLAB_SIZE;
+	touchedBytes += slab->bump - mem;
+	return slab;
+}
+
+void Arena::freeSlab(Slab *slab) {
+	// give slab memory back to the OS (or the cache file)
+	numSlabs--;
+	slabBytes -= MH_SLAB_SIZE;
+	touchedBytes -= slab->bump - (unsigned char *)slab;
+	
+	if (region) {
+		region->release( (void *)slab, MH_SLAB_SIZE );
+		return;
+	}
+
+#ifdef _WIN32
+	_aligned_free( (void *)slab );
+#else
+	munmap( (void *)slab, MH_SLAB_SIZE );
+#endif
+}
+
+void Arena::trimSlab(Slab *slab) {
+	// internal method: the last slab in its class is kept when it empties out (so a class hovering around empty doesn't map and unmap
+	// all the time), but once it has touched more than MH_SLAB_TRIM, its pages go back to the OS and it starts over
+	// without this, every class a workload has moved away from would keep up to a whole slab resident
+	// (not for the cache file, where the pages are the data, nor on Windows, where slabs come from _aligned_malloc)
+#ifndef _WIN32
+	unsigned char *start = (unsigned char *)slab + ((sizeof(Slab) + 63) & ~63);
+	if (region || (slab->bump - start <= MH_SLAB_TRIM)) return;
+	
+	// the first page holds the header, so it stays
+	static const uintptr_t pageSize = (uintptr_t)sysconf( _SC_PAGESIZE );
+	unsigned char *pages = (unsigned char *)slab + pageSize;
+	if (slab->bump > pages) madvise( (void *)pages, slab->bump - pages, MADV_DONTNEED );
+	touchedBytes -= slab->bump - start;
+	slab->bump = start;
+	slab->freeList = NULL;
+#endif
+}
+
+void *Arena::alloc(uint64_t size) {
+	// allocate one item from the slab for its size class
+	unsigned char sizeClass = classFor(size);
+	
+	if (sizeClass == MH_ARENA_LARGE) {
+		// too big for a slab, malloc (or take whole pages from the cache file) with a header so clear() can find it
+		LargeAlloc *hdr = (LargeAlloc *)(region ? region->alloc( sizeof(LargeAlloc) + size ) : malloc( sizeof(LargeAlloc) + size ));
+		return hdr ? addLarge( hdr, size ) : NULL;
+	}
+	
+	Slab *slab = partial[sizeClass];
+	if (!slab) {
+		slab = newSlab(sizeClass);
+		if (!slab) return NULL;
+		partial[sizeClass] = slab;
+	}
+	
+	unsigned char *item;
+	if (slab->freeList) {
+		item = slab->freeList;
+		slab->freeList = ((unsigned char **)item)[0];
+	}
+	else {
+		item = slab->bump;
+		slab->bump += slab->itemSize;
+		touchedBytes += slab->itemSize;
+	}
+	
+	slab->used++;
+	usedBytes += slab->itemSize;
+	
+	if (!slab->freeList && (slab->bump + slab->itemSize > slab->end)) {
+		// slab is now full, move it out of the way
+		partial[sizeClass] = slab->next;
+		if (slab->next) slab->next->prev = NULL;
+		
+		slab->prev = NULL;
+		slab->next = full[sizeClass];
+		if (full[sizeClass]) full[sizeClass]->prev = slab;
+		full[sizeClass] = slab;
+		slab->full = 1;
+	}
+	
+	return (void *)item;
+}
+
+void *Arena::allocZeroed(uint64_t size) {
+	// allocate zero filled item, same as alloc() otherwise
+	// large items come from calloc(), which maps fresh pages for them, so the zeroing costs nothing up front
+	if (!region && (classFor(size) == MH_ARENA_LARGE)) {
+		LargeAlloc *hdr = (LargeAlloc *)calloc( 1, sizeof(LargeAlloc) + size );
+		return hdr ? addLarge( hdr, size ) : NULL;
+	}
+	
+	void *ptr = alloc( size );
+	if (ptr) memset( ptr, 0, size );
+	return ptr;
+}
+
+void *Arena::addLarge(LargeAlloc *hdr, uint64_t size) {
+	// internal method: track new large item, return its memory (just past the header)
+	hdr->size = size;
+	hdr->prev = NULL;
+	hdr->next = large;
+	if (large) large->prev = hdr;
+	large = hdr;
+	
+	largeBytes += sizeof(LargeAlloc) + size;
+	usedBytes += size;
+	return (void *)(hdr + 1);
+}
+
+void Arena::release(void *ptr, uint64_t size) {
+	// return one item to its slab, size must match the original alloc() call
+	unsigned char sizeClass = classFor(size);
+	
+	if (sizeClass == MH_ARENA_LARGE) {
+		LargeAlloc *hdr = ((LargeAlloc *)ptr) - 1;
+		if (hdr->prev) hdr->prev->next = hdr->next;
+		else large = hdr->next;
+		if (hdr->next) hdr->next->prev = hdr->prev;
+		
+		largeBytes -= sizeof(LargeAlloc) + hdr->size;
+		usedBytes -= hdr->size;
+		freeLarge( hdr );
+		return;
+	}
+	
+	Slab *slab = (Slab *)((uintptr_t)ptr & ~((uintptr_t)MH_SLAB_SIZE - 1));
+	((unsigned char **)ptr)[0] = slab->freeList;
+	slab->freeList = (unsigned char *)ptr;
+	slab->used--;
+	usedBytes -= slab->itemSize;
+	
+	if (slab->full) {
+		// slab has room again, move it to the head of the partial list
+		if (slab->prev) slab->prev->next = slab->next;
+		else full[sizeClass] = slab->next;
+		if (slab->next) slab->next->prev = slab->prev;
+		
+		slab->prev = NULL;
+		slab->next = partial[sizeClass];
+		if (partial[sizeClass]) partial[sizeClass]->prev = slab;
+		partial[sizeClass] = slab;
+		slab->full = 0;
+	}
+	
+	if (!slab->used && (slab->prev || slab->next)) {
+		// slab is empty and not the only one left in its class, so release it
+		if (slab->prev) slab->prev->next = slab->next;
+		else partial[sizeClass] = slab->next;
+		if (slab->next) slab->next->prev = slab->prev;
+		
+		freeSlab(slab);
+	}
+	else if (!slab->used) trimSlab(slab);
+}
+
+void Arena::freeLarge(LargeAlloc *hdr) {
+	// internal method: free large item (already unlinked)
+	if (region) region->release( (void *)hdr, sizeof(LargeAlloc) + hdr->size );
+	else free( (void *)hdr );
+}
+
+int Arena::fits(void *ptr, uint64_t oldSize, uint64_t newSize) {
+	// check if an existing item can be reused for a new size
+	// the size class must stay the same, so release() still finds the right class
+	unsigned char sizeClass = classFor(oldSize);
+	if (classFor(newSize) != sizeClass) return 0;
+	
+	if (sizeClass == MH_ARENA_LARGE) {
+		// large items are only reused if they would not waste more than half
+		LargeAlloc *hdr = ((LargeAlloc *)ptr) - 1;
+		return (newSize <= hdr->size) && (newSize >= hdr->size / 2);
+	}
+	
+	return 1;
+}
+
+void Arena::clear() {
+	// release all slabs and large allocations at once
+	Slab *slab, *nextSlab;
+	LargeAlloc *hdr, *nextHdr;
+	
+	for (int idx = 0; idx < MH_ARENA_CLASSES; idx++) {
+		for (slab = partial[idx]; slab; slab = nextSlab) {
+			nextSlab = slab->next;
+			freeSlab(slab);
+		}
+		for (slab = full[idx]; slab; slab = nextSlab) {
+			nextSlab = slab->next;
+			freeSlab(slab);
+		}
+		partial[idx] = NULL;
+		full[idx] = NULL;
+	}
+	
+	for (hdr = large; hdr; hdr = nextHdr) {
+		nextHdr = hdr->next;
+		freeLarge( hdr );
+	}
+	large = NULL;
+	
+	largeBytes = 0;
+	usedBytes = 0;
+}
+
+Arena *Arena::detach() {
+	// move all slabs and large allocations into a new arena, and start this one over empty
+	// the new arena frees everything when deleted, and may be deleted on any thread (the cache file allocator locks)
+	Arena *old = new Arena( region );
+	for (int idx = 0; idx < MH_ARENA_CLASSES; idx++) {
+		old->partial[idx] = partial[idx];
+		old->full[idx] = full[idx];
+	}
+	old->large = large;
+	old->numSlabs = numSlabs;
+	old->slabBytes = slabBytes;
+	old->touchedBytes = touchedBytes;
+	old->largeBytes = largeBytes;
+	old->usedBytes = usedBytes;
+	
+	init( region );
+	return old;
+}
+
+void Sketch::ensureCapacity(uint64_t maxKeys) {
+	// size table for the number of keys we expect to track (one word per key, rounded up to a power of 2)
+	// growing the table starts over with zero counts
+	if (maxKeys > ((uint64_t)1 << 30)) maxKeys = (uint64_t)1 << 30;
+	if (table && (tableSize >= maxKeys)) return;
+	
+	uint64_t newSize = 16;
+	while (newSize < maxKeys) newSize *= 2;
+	
+	uint64_t *newTable = (uint64_t *)calloc( newSize, sizeof(uint64_t) );
+	if (!newTable) return;
+	
+	if (table) free( (void *)table );
+	table = newTable;
+	tableSize = newSize;
+	sampleSize = newSize * 10;
+	additions = 0;
+}
+
+void Sketch::increment(uint64_t hash) {
+	// bump the key's 4 counters (they saturate at 15), and age the sketch every sampleSize increments
+	if (!table) return;
+	hash = spread(hash);
+	int start = (int)((hash & 3) << 2);
+	int added = 0;
+	
+	for (int row = 0; row < 4; row++) {
+		uint64_t idx = indexOf(hash, row);
+		int offset = (start + row) << 2;
+		uint64_t mask = (uint64_t)0xF << offset;
+		
+		if ((table[idx] & mask) != mask) {
+			table[idx] += (uint64_t)1 << offset;
+			added = 1;
+		}
+	}
+	
+	if (added && (++additions >= sampleSize)) reset();
+}
+
+unsigned char Sketch::frequency(uint64_t hash) {
+	// estimate key popularity, the smallest of its 4 counters
+	if (!table) return 0;
+	hash = spread(hash);
+	int start = (int)((hash & 3) << 2);
+	unsigned char freq = 15;
+	
+	for (int row = 0; row < 4; row++) {
+		uint64_t idx = indexOf(hash, row);
+		unsigned char count = (unsigned char)((table[idx] >> ((start + row) << 2)) & 0xF);
+		if (count < freq) freq = count;
+	}
+	
+	return freq;
+}
+
+void Sketch::reset() {
+	// halve all counters, so the sketch tracks recent popularity
+	uint64_t odd = 0;
+	
+	for (uint64_t idx = 0; idx < tableSize; idx++) {
+		odd += mhPopCount( table[idx] & 0x1111111111111111ull );
+		table[idx] = (table[idx] >> 1) & 0x7777777777777777ull;
+	}
+	
+	additions = (additions >> 1) - (odd >> 2);
+}
+
+void Sketch::clear() {
+	// forget all counts
+	if (table) memset( (void *)table, 0, tableSize * sizeof(uint64_t) );
+	additions = 0;
+}
+
+uint64_t *Sketch::detach() {
+	// forget all counts by swapping in a fresh table, and return the old one for the caller to free
+	// a big calloc comes straight from fresh pages, so this is much cheaper than clear() on a big table
+	if (!table) return NULL;
+	uint64_t *newTable = (uint64_t *)calloc( tableSize, sizeof(uint64_t) );
+	if (!newTable) {
+		clear();
+		return NULL;
+	}
+	
+	uint64_t *oldTable = table;
+	table = newTable;
+	additions = 0;
+	return oldTable;
+}
+
+void TimerWheel::schedule(uint64_t hash, uint32_t expires) {
+	// add timer to the lowest level where it shares a parent slot with the current tick
+	TimerEntry entry;
+	entry.hash = hash;
+	entry.expires = expires;
+	numTimers++;
+	
+	if (expires <= current) {
+		// already due
+		if (due.empty()) due.emplace_back();
+		due.back().push_back( entry );
+		return;
+	}
+	
+	int level = 0;
+	while ((level < MH_WHEEL_LEVELS - 1) && ((expires >> (MH_WHEEL_BITS * (level + 1))) != (current >> (MH_WHEEL_BITS * (level + 1))))) level++;
+	
+	// past the top level's span, the timer fires early and is rescheduled
+	uint32_t idx = (expires >> (MH_WHEEL_BITS * level)) & (MH_WHEEL_SLOTS - 1);
+	slots[level][idx].push_back( entry );
+	occupied[level] |= (uint64_t)1 << idx;
+}
+
+void TimerWheel::advance(uint32_t now) {
+	// tick up to now, moving every slot that comes due onto the due list (whole, without looking inside)
+	// a slot on an upper level comes due when all the levels below it wrap around
+	if (now <= current) return;
+	
+	if (!numTimers || ((uint64_t)(now - current) >= ((uint64_t)1 << (MH_WHEEL_BITS * MH_WHEEL_LEVELS)))) {
+		// nothing to do, or the whole wheel went around, so everything is due
+		for (int level = 0; level < MH_WHEEL_LEVELS; level++) {
+			for (int idx = 0; idx < MH_WHEEL_SLOTS; idx++) {
+				if (!slots[level][idx].empty()) {
+					due.emplace_back();
+					due.back().swap( slots[level][idx] );
+				}
+			}
+			occupied[level] = 0;
+		}
+		current = now;
+		return;
+	}
+	
+	// jump straight to each tick which has a slot to move, instead of stepping through every second in between
+	while (current < now) {
+		uint64_t next = nextTick();
+		if (!next || (next > now)) {
+			current = now;
+			break;
+		}
+		
+		current = (uint32_t)(next - 1);
+		tick();
+	}
+}
+
+uint64_t TimerWheel::nextTick() {
+	// first tick after the current one which comes to a slot with timers in it, 0 if the wheel is empty
+	// level L looks at slot (tick >> (MH_WHEEL_BITS * L)) on every tick which is a multiple of its slot span
+	uint64_t best = 0;
+	
+	for (int level = 0; level < MH_WHEEL_LEVELS; level++) {
+		if (!occupied[level]) continue;
+		
+		int shift = MH_WHEEL_BITS * level;
+		uint64_t first = ((uint64_t)current >> shift) + 1; // next multiple of the span, in spans
+		uint32_t rot = (uint32_t)(first & (MH_WHEEL_SLOTS - 1));
+		uint64_t mask = rot ? ((occupied[level] >> rot) | (occupied[level] << (MH_WHEEL_SLOTS - rot))) : occupied[level];
+		uint64_t when = (first + mhLowBit64(mask)) << shift;
+		
+		if (!best || (when < best)) best = when;
+	}
+	
+	return best;
+}
+
+void TimerWheel::tick() {
+	// advance one tick, moving the slots it comes to onto the due list
+	current++;
+	
+	for (int level = 0; level < MH_WHEEL_LEVELS; level++) {
+		int shift = MH_WHEEL_BITS * level;
+		if (level && (current & (((uint32_t)1 << shift) - 1))) break;
+		
+		uint32_t idx = (current >> shift) & (MH_WHEEL_SLOTS - 1);
+		if (!slots[level][idx].empty()) {
+			due.emplace_back();
+			due.back().swap( slots[level][idx] );
+		}
+		occupied[level] &= ~((uint64_t)1 << idx);
+	}
+}
+
+int TimerWheel::next(TimerEntry *entry) {
+	// pop one timer off the due list, return false if there are none left
+	while (!due.empty()) {
+		if (due.back().empty()) {
+			due.pop_back();
+			continue;
+		}
+		
+		*entry = due.back().back();
+		due.back().pop_back();
+		numTimers--;
+		return 1;
+	}
+	
+	return 0;
+}
+
+void TimerWheel::clear() {
+	// drop all timers and free their memory
+	for (int level = 0; level < MH_WHEEL_LEVELS; level++) {
+		for (int idx = 0; idx < MH_WHEEL_SLOTS; idx++) {
+			std::vector<TimerEntry>().swap( slots[level][idx] );
+		}
+		occupied[level] = 0;
+	}
+	std::vector< std::vector<TimerEntry> >().swap( due );
+	numTimers = 0;
+}
+
+uint64_t TimerWheel::memorySize() {
+	// total memory used by the wheel, including pending and stale timers
+	uint64_t size = sizeof(TimerWheel);
+	
+	for (int level = 0; level < MH_WHEEL_LEVELS; level++) {
+		for (int idx = 0; idx < MH_WHEEL_SLOTS; idx++) {
+			size += slots[level][idx].capacity() * sizeof(TimerEntry);
+		}
+	}
+	
+	size += due.capacity() * sizeof(std::vector<TimerEntry>);
+	for (size_t idx = 0; idx < due.size(); idx++) {
+		size += due[idx].capacity() * sizeof(TimerEntry);
+	}
+	
+	return size;
+}
+
+uint64_t Metrics::start() {
+	// timestamp to pass to finish() if this operation is sampled, 0 if not
+	// the count is per thread (and shared by all hashes), so readers on different threads never fight over it
+	static thread_local uint32_t count = 0;
+	if (++count < sample) return 0;
+	count = 0;
+	return mhTicks();
+}
+
+void Metrics::add(Metrics *other) {
+	// add up counters and histograms from another hash (for totals across shards)
+	hits.fetch_add( other->hits.load(std::memory_order_relaxed), std::memory_order_relaxed );
+	misses.fetch_add( other->misses.load(std::memory_order_relaxed), std::memory_order_relaxed );
+	adds.fetch_add( other->adds.load(std::memory_order_relaxed), std::memory_order_relaxed );
+	replaces.fetch_add( other->replaces.load(std::memory_order_relaxed), std::memory_order_relaxed );
+	removes.fetch_add( other->removes.load(std::memory_order_relaxed), std::memory_order_relaxed );
+	for (int op = 0; op < MH_NUM_OPS; op++) latency[op].add( &other->latency[op] );
+	sample = other->sample;
+}
+
+#ifdef MH_RDTSC
+static double mhMeasureTickRate() {
+	// clock ticks per nanosecond, timed against the steady clock over a couple of milliseconds
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	uint64_t startTicks = mhTicks();
+	std::chrono::steady_clock::time_point now;
+	
+	do {
+		now = std::chrono::steady_clock::now();
+	} while (now - start < std::chrono::milliseconds(2));
+	
+	uint64_t elapsed = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>( now - start ).count();
+	uint64_t ticks = mhTicks() - startTicks;
+	return (elapsed && ticks) ? ((double)ticks / (double)elapsed) : 1.0;
+}
+#endif
+
+double mhTickRate() {
+	// clock ticks per nanosecond, for turning latencies into time (measured on first use, the TSC runs at a fixed rate on any recent x86)
+#ifdef MH_RDTSC
+	static double rate = mhMeasureTickRate();
+	return rate;
+#else
+	return 1.0;
+#endif
+}
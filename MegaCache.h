@@ -1,9 +1,30 @@
 // MegaCache v1.0
 // Copyright (c) 2023 Joseph Huckaby
 
+#ifndef MEGACACHE_CORE_H
+#define MEGACACHE_CORE_H
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+/** Time operations with the CPU timestamp counter, otherwise with the steady clock. */
+#define MH_RDTSC 1
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+/** Probe flat table groups with SSE2 (16 control bytes per compare), otherwise one byte at a time. */
+#define MH_TABLE_SSE2 1
+#endif
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
@@ -17,11 +38,134 @@
 #define MH_KLEN_SIZE sizeof(MH_KLEN_T)
 #define MH_LEN_SIZE sizeof(MH_LEN_T)
 
-/** Size of one hashed key, in bytes. */
-#define MH_DIGEST_SIZE 8
+/** \name Index layout:
+	Each index level picks a slot with the next few bits of the key hash, most significant first. */
+//@{
+/** Default bits per level, for the top level and for the levels below it (16 slots). */
+#define MH_INDEX_BITS 4
+/** Fewest bits per level (16 slots, which is 128 bytes, two cache lines). */
+#define MH_INDEX_MIN_BITS 4
+/** Most bits per level (256 slots, 2 KB). */
+#define MH_INDEX_MAX_BITS 8
+/** Most slots in one index. */
+#define MH_INDEX_SIZE (1 << MH_INDEX_MAX_BITS)
+/** Most index levels (64-bit hash, at least 4 bits per level). */
+#define MH_DIGEST_SIZE 16
+/** Low bit set in an index slot means it points to another index, not a bucket list (everything in the arena is 16 byte aligned). */
+#define MH_TAG_INDEX 1
+//@}
+
+/** \name Storage engines (see Hash::setEngine()): */
+//@{
+/** Trie of indexes over the key hash, with short bucket lists at the bottom. */
+#define MH_ENGINE_TRIE 0
+/** Flat open addressing table (Swiss table style), one slot per key. */
+#define MH_ENGINE_TABLE 1
+//@}
+
+/** \name Flat table layout:
+	Slots come in groups, each with a control byte per slot holding 7 bits of the key hash, so one compare checks a whole group,
+	and only buckets whose control byte matches are looked at.  A key's home group is the top bits of its hash. */
+//@{
+/** Slots per group (with its 16 control bytes, a group is exactly 128 bytes, two cache lines). */
+#define MH_TABLE_SLOTS 14
+/** Mask of the control bytes which have slots. */
+#define MH_TABLE_SLOT_MASK ((1 << MH_TABLE_SLOTS) - 1)
+/** Control byte of a slot which was never used, zero so fresh memory is an empty table (a probe stops at a group with one). */
+#define MH_CTRL_EMPTY 0x00
+/** Control byte of a slot whose key was removed (a probe has to carry on past it). */
+#define MH_CTRL_DELETED 0x01
+/** High bit of the control byte marks a slot with a key in it. */
+#define MH_CTRL_FULL 0x80
+/** Position of the 7 hash bits kept in the control byte (the low 8 bits pick the shard, so they hardly vary within a table). */
+#define MH_TABLE_TAG_SHIFT 8
+/** Fewest groups, in bits (16 groups, 224 slots). */
+#define MH_TABLE_MIN_BITS 4
+/** Most slots in use (keys and deleted slots) before the table is rebuilt, in eighths. */
+#define MH_TABLE_MAX_LOAD 7
+/** Old groups moved over by each store or remove while a rebuild is in progress. */
+#define MH_TABLE_MIGRATE 2
+//@}
+
+/** \name Slab arena settings: */
+//@{
+/** Size of one slab, in bytes (slabs are aligned to this, must be a power of 2). */
+#define MH_SLAB_SIZE (2 * 1024 * 1024)
+/** Size classes per power of 2 above 256 bytes, in bits (16 classes, so no more than 1/16 of an item is lost to rounding). */
+#define MH_ARENA_STEP_BITS 4
+/** Number of slab size classes (8 byte steps up to 128, 16 byte steps up to 256, then 1 << MH_ARENA_STEP_BITS steps per power of 2 up to 16K). */
+#define MH_ARENA_CLASSES (24 + (6 << MH_ARENA_STEP_BITS))
+/** Largest allocation served from a slab, anything bigger goes straight to malloc (or the cache file). */
+#define MH_ARENA_MAX_ITEM 16384
+/** Size class used for allocations too big for a slab. */
+#define MH_ARENA_LARGE 255
+/** An empty slab kept as the last one in its class gives its pages back to the OS once it has touched this many bytes. */
+#define MH_SLAB_TRIM (64 * 1024)
+//@}
+
+/** Hint the CPU to start loading an address into cache, ahead of using it (no-op where unsupported). */
+#if defined(__GNUC__) || defined(__clang__)
+#define MH_PREFETCH(addr) __builtin_prefetch( (const void *)(addr) )
+#else
+#define MH_PREFETCH(addr)
+#endif
+
+/** Force a helper inline, for the ones wrapping MH_PREFETCH: GCC treats a function doing nothing but prefetch as pure,
+	and drops calls to it as dead code, unless the prefetch is inlined into the caller first. */
+#if defined(__GNUC__) || defined(__clang__)
+#define MH_INLINE inline __attribute__((always_inline))
+#else
+#define MH_INLINE inline
+#endif
+
+/** \name Interleaved lookups (Hash::peekMany):
+	Several lookups walk the index at once, one node per round each, so their cache misses overlap. */
+//@{
+/** Default number of lookups in flight. */
+#define MH_LOOKUP_GROUP 16
+/** Most lookups in flight (1 is the plain serial walk). */
+#define MH_LOOKUP_MAX_GROUP 32
+//@}
+
+/** Default low watermark, as a percentage of maxKeys / maxBytes (100 = evict just enough keys on each store). */
+#define MH_LOW_WATER 100
+
+/** Most keys evicted by one store while working off a lowered limit (see Hash::setLimits()). */
+#define MH_SHRINK_BUDGET 1024
+
+/** Most expiration timers one eviction batch processes before it evicts live keys (the rest is left to expire()). */
+#define MH_EVICT_REAP 64
+
+/** Number of thin slices of the hash space (see Hash::clear(char1, char2)), which deleteWhere() works through in order. */
+#define MH_THIN_SLICES 65536
+
+/** What walking one thin slice of one shard costs against the deleteWhere() budget, in keys, even if it holds none. */
+#define MH_SLICE_COST 4
 
-/** Size of one index level. */
-#define MH_INDEX_SIZE 16
+/** \name Instrumentation (see Metrics): */
+//@{
+/** Operation types, each with its own latency histogram. */
+#define MH_OP_GET 0
+#define MH_OP_SET 1
+#define MH_OP_DELETE 2
+#define MH_NUM_OPS 3
+/** Histogram sub-buckets per power of 2, in bits (so every value is kept to within 1/16). */
+#define MH_HIST_SUB_BITS 4
+/** Longest time a histogram tells apart, in bits of clock ticks (anything longer lands in the last bucket). */
+#define MH_HIST_MAX_BITS 40
+/** Number of histogram buckets. */
+#define MH_HIST_BUCKETS ((MH_HIST_MAX_BITS - MH_HIST_SUB_BITS + 1) << MH_HIST_SUB_BITS)
+/** Default sampling rate: time one in this many operations (per thread), the counters see all of them. */
+#define MH_METRICS_SAMPLE 8
+//@}
+
+/** \name Byte accounting for maxBytes: */
+//@{
+/** Count keys, values and their metadata, plus the index (the sizes asked for, before any rounding). */
+#define MH_ACCOUNT_DATA 0
+/** Count the memory actually handed out by the arena, including size class rounding, so the limit tracks RSS more closely. */
+#define MH_ACCOUNT_ARENA 1
+//@}
 
 /** \name Result codes after pair is stored or fetched:
 	These all go into the result property of the Response object. */
@@ -36,29 +180,559 @@
 #define MH_REPLACE 2
 //@}
 
-/** \name Signatures used to identify tags: */
+/** \name Bucket formats:
+	Kept in Tag::type, and chosen automatically by size (index slots pointing to indexes are tagged with MH_TAG_INDEX instead). */
 //@{
-/** Signature used for identifying index tags. */
-#define MH_SIG_INDEX 'I'
-/** Signature used for identifying bucket tags. */
+/** Key length (MH_KLEN_T) in front of the key, and value length (MH_LEN_T) in front of the value. */
 #define MH_SIG_BUCKET 'B'
+/** Small key and value: both lengths are one byte, stored together in front of the key. */
+#define MH_SIG_SMALL 'S'
+/** Largest key and value length stored in the small format. */
+#define MH_SMALL_MAX 255
+/** Length fields of the small format, the same as MH_KLEN_SIZE, so the key starts at the same offset in both formats. */
+#define MH_SMALL_META 2
+//@}
+
+/** \name Eviction policies: */
+//@{
+/** Least recently used: every access moves the key to the head of the list. */
+#define MH_POLICY_LRU 0
+/** CLOCK (second chance): an access only sets the reference bit, eviction sweeps past referenced keys. */
+#define MH_POLICY_CLOCK 1
+/** W-TinyLFU: small LRU window in front of a segmented LRU, with admission decided by key frequency. */
+#define MH_POLICY_TINYLFU 2
+//@}
+
+/** \name W-TinyLFU segment sizes, as percentages: */
+//@{
+/** Size of the window, as a percentage of all keys. */
+#define MH_TINYLFU_WINDOW 1
+/** Size of the protected segment, as a percentage of the main area (the rest is probation). */
+#define MH_TINYLFU_PROTECTED 80
+//@}
+
+/** \name Bucket state bits (cache bookkeeping, separate from the caller's flags): */
+//@{
+/** Bucket was accessed since the CLOCK hand last passed it. */
+#define MH_STATE_REF 0x01
+/** Bucket is in the W-TinyLFU window. */
+#define MH_STATE_WINDOW 0x02
+/** Bucket is in the W-TinyLFU protected segment (neither bit means probation). */
+#define MH_STATE_PROTECTED 0x04
+/** Mask for the W-TinyLFU segment bits. */
+#define MH_STATE_SEGMENT (MH_STATE_WINDOW | MH_STATE_PROTECTED)
+/** Bucket memory is referenced by a zero-copy view, so it cannot be freed or overwritten (see Hash::pin()). */
+#define MH_STATE_PINNED 0x08
+/** Pinned bucket was removed from the table, and is freed by the last unpin. */
+#define MH_STATE_RETIRED 0x10
 //@}
 
+/** \name Timer wheel for key expiration (TTL): */
+//@{
+/** Bits per wheel level, each level has 64 slots. */
+#define MH_WHEEL_BITS 6
+/** Number of slots per wheel level. */
+#define MH_WHEEL_SLOTS (1 << MH_WHEEL_BITS)
+/** Number of wheel levels (1 second ticks, so the wheel spans 2^24 seconds, about 194 days). */
+#define MH_WHEEL_LEVELS 4
+//@}
+
+/** \name Constants used by the 64-bit key hash (wyhash final v4 secrets): */
+//@{
+#define MH_HASH_P0 0xa0761d6478bd642full
+#define MH_HASH_P1 0xe7037ed1a0b428dbull
+#define MH_HASH_P2 0x8ebc6af09c88c6e3ull
+#define MH_HASH_P3 0x589965cc75374cc3ull
+//@}
+
+static inline uint64_t mhRead64(const unsigned char *p) {
+	// unaligned 64-bit read
+	uint64_t v;
+	memcpy( (void *)&v, (void *)p, 8 );
+	return v;
+}
+
+static inline uint64_t mhRead32(const unsigned char *p) {
+	// unaligned 32-bit read
+	uint32_t v;
+	memcpy( (void *)&v, (void *)p, 4 );
+	return v;
+}
+
+static inline void mhMum(uint64_t *a, uint64_t *b) {
+	// 64x64 -> 128 bit multiply, low half into a, high half into b
+#if defined(__SIZEOF_INT128__)
+	__uint128_t r = *a;
+	r *= *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32);
+	uint64_t c = t < rl;
+	uint64_t lo = t + (rm1 << 32);
+	c += lo < t;
+	uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+	*a = lo;
+	*b = hi;
+#endif
+}
+
+static inline uint64_t mhMix(uint64_t a, uint64_t b) {
+	// multiply and fold
+	mhMum(&a, &b);
+	return a ^ b;
+}
+
+static inline uint32_t mhNow() {
+	// current time for key expiration, in whole seconds since the epoch
+	return (uint32_t)time(NULL);
+}
+
+static inline uint32_t mhLowBit(uint32_t x) {
+	// position of the lowest set bit (x must not be zero)
+#if defined(__GNUC__) || defined(__clang__)
+	return (uint32_t)__builtin_ctz( x );
+#else
+	uint32_t pos = 0;
+	while (!(x & 1)) {
+		x >>= 1;
+		pos++;
+	}
+	return pos;
+#endif
+}
+
+static inline uint32_t mhHighBit(uint64_t x) {
+	// position of the highest set bit (x must not be zero)
+#if defined(__GNUC__) || defined(__clang__)
+	return 63 - (uint32_t)__builtin_clzll( x );
+#else
+	uint32_t pos = 0;
+	while (x >>= 1) pos++;
+	return pos;
+#endif
+}
+
+static inline uint64_t mhTicks() {
+	// timestamp for latency sampling, in clock ticks (see mhTickRate())
+#ifdef MH_RDTSC
+	return __rdtsc();
+#else
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+#endif
+}
+
+double mhTickRate();
+
+static inline uint32_t mhLowBit64(uint64_t x) {
+	// position of the lowest set bit (x must not be zero)
+#if defined(__GNUC__) || defined(__clang__)
+	return (uint32_t)__builtin_ctzll( x );
+#else
+	uint32_t pos = 0;
+	while (!(x & 1)) {
+		x >>= 1;
+		pos++;
+	}
+	return pos;
+#endif
+}
+
+static inline uint64_t mhPopCount(uint64_t x) {
+	// count set bits
+	x = x - ((x >> 1) & 0x5555555555555555ull);
+	x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+	return (x * 0x0101010101010101ull) >> 56;
+}
+
 class Stats {
 public:
 	// current stats about the hash table
 	uint64_t numKeys;
 	uint64_t indexSize;
+	uint64_t numIndexes;
 	uint64_t metaSize;
 	uint64_t dataSize;
 	uint64_t numEvictions;
+	uint64_t evictionBatches;
+	uint64_t evictionTime; /**< Total time spent evicting, in nanoseconds. */
+	uint64_t numAdmitted; /**< W-TinyLFU keys let into the main area from the window. */
+	uint64_t numRejected; /**< W-TinyLFU keys evicted straight out of the window. */
+	uint64_t numExpired; /**< Keys removed because their TTL ran out. */
+	uint64_t expiredBytes; /**< Memory reclaimed from expired keys (key, value and metadata). */
+	uint64_t numRebuilds; /**< Flat table rebuilds started (growing, or clearing out deleted slots). */
 	
 	Stats() {
 		numKeys = 0;
 		indexSize = 0;
+		numIndexes = 0;
 		metaSize = 0;
 		dataSize = 0;
 		numEvictions = 0;
+		evictionBatches = 0;
+		evictionTime = 0;
+		numAdmitted = 0;
+		numRejected = 0;
+		numExpired = 0;
+		expiredBytes = 0;
+		numRebuilds = 0;
+	}
+};
+
+class Sketch {
+public:
+	// count-min sketch of key popularity, for W-TinyLFU admission
+	// each 64-bit word holds 16 4-bit counters, and each key maps to 4 counters in 4 different words
+	// all counters are halved every sampleSize increments, so old popularity fades away
+	uint64_t *table;
+	uint64_t tableSize; /**< Number of 64-bit words (power of 2). */
+	uint64_t sampleSize;
+	uint64_t additions;
+	
+	Sketch() {
+		table = NULL;
+		tableSize = 0;
+		sampleSize = 0;
+		additions = 0;
+	}
+	
+	~Sketch() {
+		if (table) free( (void *)table );
+	}
+	
+	void ensureCapacity(uint64_t maxKeys);
+	void increment(uint64_t hash);
+	unsigned char frequency(uint64_t hash);
+	void reset();
+	void clear();
+	uint64_t *detach();
+	
+	uint64_t spread(uint64_t hash) {
+		// remix key hash, as its top bits pick the index slots and its low bits pick the shard
+		hash *= 0x9e3779b97f4a7c15ull;
+		return hash ^ (hash >> 32);
+	}
+	
+	uint64_t indexOf(uint64_t hash, int row) {
+		// pick word for one of the 4 rows
+		static const uint64_t seeds[4] = { 0xc3a5c85c97cb3127ull, 0xb492b66fbe98f273ull, 0x9ae16a3b2f90404full, 0xcbf29ce484222325ull };
+		uint64_t idx = (hash + seeds[row]) * seeds[row];
+		idx += idx >> 32;
+		return idx & (tableSize - 1);
+	}
+};
+
+class TimerEntry {
+public:
+	// one scheduled expiration: the key is found again by its hash, so buckets don't need wheel links
+	// entries are never removed early, stale ones (key deleted, or TTL changed) are skipped when they fire
+	uint64_t hash;
+	uint32_t expires;
+};
+
+class TimerWheel {
+public:
+	// hierarchical timer wheel with 1 second ticks, 64 slots per level
+	// an entry goes in the lowest level where it shares a parent slot with the current time,
+	// so level 0 covers the next 64 seconds, level 1 the next 68 minutes, and so on
+	// due slots are moved whole onto the due list, and entries from the upper levels which are not
+	// actually expired yet are rescheduled into the lower levels as they come off the due list
+	std::vector<TimerEntry> slots[MH_WHEEL_LEVELS][MH_WHEEL_SLOTS];
+	std::vector< std::vector<TimerEntry> > due;
+	uint32_t current; /**< Last tick processed, in seconds. */
+	uint64_t numTimers;
+	uint64_t occupied[MH_WHEEL_LEVELS]; /**< Bit per slot with timers in it (MH_WHEEL_SLOTS is 64), so advance() can skip over empty stretches. */
+	
+	TimerWheel() {
+		current = mhNow();
+		numTimers = 0;
+		for (int level = 0; level < MH_WHEEL_LEVELS; level++) occupied[level] = 0;
+	}
+	
+	void schedule(uint64_t hash, uint32_t expires);
+	void advance(uint32_t now);
+	uint64_t nextTick();
+	void tick();
+	int next(TimerEntry *entry);
+	void clear();
+	uint64_t memorySize();
+};
+
+class Slab {
+public:
+	// a slab is one aligned chunk of memory carved into equal sized items
+	// the header lives at the start of the slab, so any item can find it by masking its address
+	Slab *prev;
+	Slab *next;
+	unsigned char *freeList; /**< Singly linked list of freed items. */
+	unsigned char *bump; /**< Next never-used item. */
+	unsigned char *end;
+	uint32_t itemSize;
+	uint32_t used;
+	unsigned char sizeClass;
+	unsigned char full;
+};
+
+class LargeAlloc {
+public:
+	// header in front of allocations too big for a slab, so clear() can find and free them
+	LargeAlloc *prev;
+	LargeAlloc *next;
+	uint64_t size;
+	uint64_t pad;
+};
+
+class MapRegion;
+
+class Arena {
+public:
+	// size-classed slab allocator for buckets and indexes
+	// each class keeps a list of slabs with free items, and a list of full slabs
+	// slabs and large items come from the OS, or from a cache file for persistent caches (see MapRegion)
+	MapRegion *region;
+	Slab *partial[MH_ARENA_CLASSES];
+	Slab *full[MH_ARENA_CLASSES];
+	LargeAlloc *large;
+	
+	uint64_t numSlabs;
+	uint64_t slabBytes; /**< Memory reserved for slabs (address space). */
+	uint64_t touchedBytes; /**< Slab memory actually handed out at least once (resident). */
+	uint64_t largeBytes; /**< Memory malloc'ed for large items, including headers. */
+	uint64_t usedBytes; /**< Memory handed out, rounded up to the size class. */
+	
+	Arena() {
+		init( NULL );
+	}
+	
+	Arena(MapRegion *newRegion) {
+		init( newRegion );
+	}
+	
+	void init(MapRegion *newRegion) {
+		region = newRegion;
+		for (int idx = 0; idx < MH_ARENA_CLASSES; idx++) {
+			partial[idx] = NULL;
+			full[idx] = NULL;
+		}
+		large = NULL;
+		numSlabs = 0;
+		slabBytes = 0;
+		touchedBytes = 0;
+		largeBytes = 0;
+		usedBytes = 0;
+	}
+	
+	~Arena() {
+		clear();
+	}
+	
+	void *alloc(uint64_t size);
+	void *allocZeroed(uint64_t size);
+	void release(void *ptr, uint64_t size);
+	int fits(void *ptr, uint64_t oldSize, uint64_t newSize);
+	void clear();
+	Arena *detach();
+	
+	uint64_t residentSize() {
+		// memory the arena contributes to process RSS
+		return touchedBytes + largeBytes;
+	}
+	
+	// internal methods:
+	void *addLarge(LargeAlloc *hdr, uint64_t size);
+	Slab *newSlab(unsigned char sizeClass);
+	void freeSlab(Slab *slab);
+	void trimSlab(Slab *slab);
+	void freeLarge(LargeAlloc *hdr);
+	
+	static unsigned char classFor(uint64_t size) {
+		// compute size class for allocation size
+		// small items (i.e. buckets with tiny keys and values) get finer steps, so less is lost to rounding
+		if (size <= 128) return (unsigned char)(size ? ((size - 1) / 8) : 0);
+		if (size <= 256) return (unsigned char)(16 + ((size - 129) / 16));
+		if (size > MH_ARENA_MAX_ITEM) return MH_ARENA_LARGE;
+		
+		// 1 << MH_ARENA_STEP_BITS classes per power of 2 above 256
+		int bits = 8;
+		while (((uint64_t)1 << (bits + 1)) < size) bits++;
+		uint64_t step = ((uint64_t)1 << bits) >> MH_ARENA_STEP_BITS;
+		return (unsigned char)(24 + ((bits - 8) << MH_ARENA_STEP_BITS) + ((size - 1 - ((uint64_t)1 << bits)) / step));
+	}
+	
+	static uint32_t classSize(unsigned char sizeClass) {
+		// compute item size for size class
+		if (sizeClass < 16) return (sizeClass + 1) * 8;
+		if (sizeClass < 24) return 128 + (sizeClass - 15) * 16;
+		int bits = 8 + ((sizeClass - 24) >> MH_ARENA_STEP_BITS);
+		uint32_t step = ((uint32_t)1 << bits) >> MH_ARENA_STEP_BITS;
+		return ((uint32_t)1 << bits) + (((sizeClass - 24) & ((1 << MH_ARENA_STEP_BITS) - 1)) + 1) * step;
+	}
+	
+	static uint64_t chargeFor(uint64_t size) {
+		// compute what an allocation adds to usedBytes
+		unsigned char sizeClass = classFor(size);
+		return (sizeClass == MH_ARENA_LARGE) ? size : classSize(sizeClass);
+	}
+};
+
+class Discard {
+public:
+	// memory taken out of a hash by Hash::discard(), which the caller frees later (i.e. on a worker thread)
+	// nothing in here is reachable from the hash anymore, so freeing it needs no lock
+	Arena *arena;
+	uint64_t *sketchTable;
+	TimerWheel *wheel;
+	uint64_t numBytes; /**< Arena memory to be freed (see Arena::residentSize()). */
+	
+	Discard() {
+		arena = NULL;
+		sketchTable = NULL;
+		wheel = NULL;
+		numBytes = 0;
+	}
+	
+	~Discard() {
+		delete arena;
+		if (sketchTable) free( (void *)sketchTable );
+		delete wheel;
+	}
+};
+
+class Histogram {
+public:
+	// latency distribution in clock ticks, HDR style: exact up to 2 << MH_HIST_SUB_BITS, then 1 << MH_HIST_SUB_BITS buckets per power of 2
+	// recorded into by readers under the shared lock too, so all counts are atomic (relaxed, they order nothing else)
+	std::atomic<uint64_t> counts[MH_HIST_BUCKETS];
+	std::atomic<uint64_t> numValues;
+	std::atomic<uint64_t> total; /**< Sum of all values, for the mean. */
+	std::atomic<uint64_t> max;
+	
+	Histogram() {
+		for (uint32_t idx = 0; idx < MH_HIST_BUCKETS; idx++) counts[idx].store( 0, std::memory_order_relaxed );
+		numValues.store( 0, std::memory_order_relaxed );
+		total.store( 0, std::memory_order_relaxed );
+		max.store( 0, std::memory_order_relaxed );
+	}
+	
+	static uint32_t bucketFor(uint64_t value) {
+		// bucket holding value: the top MH_HIST_SUB_BITS bits below the highest set bit pick the sub-bucket
+		if (value < ((uint64_t)2 << MH_HIST_SUB_BITS)) return (uint32_t)value;
+		uint32_t bits = mhHighBit( value );
+		if (bits >= MH_HIST_MAX_BITS) return MH_HIST_BUCKETS - 1;
+		return ((bits - MH_HIST_SUB_BITS + 1) << MH_HIST_SUB_BITS) + (uint32_t)((value >> (bits - MH_HIST_SUB_BITS)) & ((1 << MH_HIST_SUB_BITS) - 1));
+	}
+	
+	static uint64_t bucketTop(uint32_t idx) {
+		// highest value which lands in a bucket
+		if (idx < ((uint32_t)2 << MH_HIST_SUB_BITS)) return idx;
+		uint32_t shift = (idx >> MH_HIST_SUB_BITS) - 1;
+		uint64_t base = (uint64_t)((idx & ((1 << MH_HIST_SUB_BITS) - 1)) | (1 << MH_HIST_SUB_BITS)) << shift;
+		return base + ((uint64_t)1 << shift) - 1;
+	}
+	
+	void record(uint64_t value, uint64_t count = 1) {
+		// add count occurrences of value
+		counts[ bucketFor(value) ].fetch_add( count, std::memory_order_relaxed );
+		numValues.fetch_add( count, std::memory_order_relaxed );
+		total.fetch_add( value * count, std::memory_order_relaxed );
+		
+		uint64_t old = max.load( std::memory_order_relaxed );
+		while ((value > old) && !max.compare_exchange_weak(old, value, std::memory_order_relaxed)) {}
+	}
+	
+	void add(Histogram *other) {
+		// merge other histogram into this one (for totals across shards)
+		for (uint32_t idx = 0; idx < MH_HIST_BUCKETS; idx++) {
+			uint64_t count = other->counts[idx].load( std::memory_order_relaxed );
+			if (count) counts[idx].fetch_add( count, std::memory_order_relaxed );
+		}
+		numValues.fetch_add( other->numValues.load(std::memory_order_relaxed), std::memory_order_relaxed );
+		total.fetch_add( other->total.load(std::memory_order_relaxed), std::memory_order_relaxed );
+		max.store( MAX(max.load(std::memory_order_relaxed), other->max.load(std::memory_order_relaxed)), std::memory_order_relaxed );
+	}
+	
+	uint64_t percentile(double percent) {
+		// value at or below which percent of all values fall (the top of its bucket, so never under the real one)
+		uint64_t count = numValues.load( std::memory_order_relaxed );
+		if (!count) return 0;
+		
+		uint64_t target = (uint64_t)((percent * (double)count) / 100.0 + 0.5);
+		if (target < 1) target = 1;
+		uint64_t seen = 0;
+		
+		for (uint32_t idx = 0; idx < MH_HIST_BUCKETS; idx++) {
+			seen += counts[idx].load( std::memory_order_relaxed );
+			if (seen >= target) return MIN( bucketTop(idx), max.load(std::memory_order_relaxed) );
+		}
+		return max.load( std::memory_order_relaxed );
+	}
+};
+
+class Metrics {
+public:
+	// operation counters and latency histograms for one hash, while turned on (see Hash::setMetrics())
+	// the callers record around their calls into the hash (under the shard lock), so internal lookups and snapshot loads do not count
+	std::atomic<uint64_t> hits;
+	std::atomic<uint64_t> misses;
+	std::atomic<uint64_t> adds;
+	std::atomic<uint64_t> replaces;
+	std::atomic<uint64_t> removes;
+	Histogram latency[MH_NUM_OPS]; /**< Time spent in the hash per operation, in clock ticks (see mhTickRate()). */
+	uint32_t sample; /**< Time one in this many operations. */
+	
+	Metrics(uint32_t newSample = MH_METRICS_SAMPLE) {
+		hits.store( 0, std::memory_order_relaxed );
+		misses.store( 0, std::memory_order_relaxed );
+		adds.store( 0, std::memory_order_relaxed );
+		replaces.store( 0, std::memory_order_relaxed );
+		removes.store( 0, std::memory_order_relaxed );
+		sample = newSample ? newSample : 1;
+	}
+	
+	uint64_t start();
+	void add(Metrics *other);
+	
+	void finish(unsigned char op, uint64_t started, uint64_t count = 1) {
+		// record latency of a sampled operation (or a batch of count, as that many of the average)
+		if (!started) return;
+		uint64_t now = mhTicks();
+		uint64_t elapsed = (now > started) ? (now - started) : 0;
+		latency[op].record( elapsed / count, count );
+	}
+	
+	void recordGet(uint64_t started, unsigned char result) {
+		// count a lookup, found or not, and time it if sampled
+		(result == MH_OK ? hits : misses).fetch_add( 1, std::memory_order_relaxed );
+		finish( MH_OP_GET, started );
+	}
+	
+	void recordSet(uint64_t started, unsigned char result) {
+		// count a store by its result (failed ones are only timed)
+		if (result == MH_ADD) adds.fetch_add( 1, std::memory_order_relaxed );
+		else if (result == MH_REPLACE) replaces.fetch_add( 1, std::memory_order_relaxed );
+		finish( MH_OP_SET, started );
+	}
+	
+	void recordDelete(uint64_t started, unsigned char result) {
+		// count a removal, if the key was there
+		if (result == MH_OK) removes.fetch_add( 1, std::memory_order_relaxed );
+		finish( MH_OP_DELETE, started );
+	}
+};
+
+class Shape {
+public:
+	// layout of the keys in a hash, from a full walk (see Hash::getShape())
+	uint64_t depths[MH_DIGEST_SIZE]; /**< Keys per index level, or for the flat table, per groups probed past their home group (the last one counts all deeper). */
+	uint64_t maxChain; /**< Longest bucket list, or for the flat table, longest probe in groups. */
+	uint64_t numChains; /**< Bucket lists, or for the flat table, groups with keys in them. */
+	
+	Shape() {
+		for (uint32_t idx = 0; idx < MH_DIGEST_SIZE; idx++) depths[idx] = 0;
+		maxChain = 0;
+		numChains = 0;
 	}
 };
 
@@ -67,37 +741,35 @@ public:
 
 class Tag {
 public:
-	// a tag is a base class shared by indexes and buckets
+	// a tag is what an index slot points to: a bucket list, or another index (tagged with MH_TAG_INDEX, see Hash::isIndex())
 	unsigned char type;
 };
 
-class Index : public Tag {
+class Index {
 public:
-	// an index represents 4 bits of the key hash, and has 16 slots
+	// an index represents the next few bits of the key hash (4 to 8, see Hash::setLayout()), and has one slot per value
 	// each slot may point to another index, or a bucket linked list
+	// only the slots the level needs are allocated (16 to 256), so an index is always a multiple of 64 bytes,
+	// which the arena hands out cache line aligned, and a lookup touches just the one line holding its slot
 	Tag *data[MH_INDEX_SIZE];
-	
-	Index() {
-		init();
-	}
-	
-	void init() {
-		type = MH_SIG_INDEX;
-		for (int idx = 0; idx < MH_INDEX_SIZE; idx++) data[idx] = NULL;
-	}
 };
 
 class Bucket : public Tag {
 public:
 	// a bucket represents one key/value pair in the hash table
 	// this is also a linked list, for collisions
-	// currently this is 24 bytes
+	// currently this is 39 bytes
 	unsigned char flags;
+	unsigned char state;
+	uint32_t expires; /**< Expiration time in seconds since the epoch (0 = never). */
 	Bucket *next;
 	
 	Bucket *cachePrev;
 	Bucket *cacheNext;
 	
+	// full 64-bit key hash, so reindexing and chain walks never rehash the key
+	uint64_t hash;
+	
 	Bucket() {
 		init();
 	}
@@ -105,15 +777,112 @@ public:
 	void init() {
 		type = MH_SIG_BUCKET;
 		flags = 0;
+		state = 0;
+		expires = 0;
 		next = NULL;
 		
 		cachePrev = NULL;
 		cacheNext = NULL;
+		
+		hash = 0;
 	}
 };
 
 #pragma pack(pop)   /* restore original alignment from stack */
 
+class TableGroup {
+public:
+	// one group of flat table slots, with their control bytes in front (empty, deleted, or MH_CTRL_FULL plus 7 bits of the key hash)
+	// groups are aligned to their size, so the control bytes and the first 6 slots share one cache line
+	unsigned char ctrl[16]; /**< The last 2 have no slots, and stay empty. */
+	Tag *slots[MH_TABLE_SLOTS];
+	
+	uint32_t match(unsigned char value) {
+		// bitmask of slots whose control byte is value
+#ifdef MH_TABLE_SSE2
+		__m128i bytes = _mm_load_si128( (const __m128i *)ctrl );
+		return (uint32_t)_mm_movemask_epi8( _mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)value)) ) & MH_TABLE_SLOT_MASK;
+#else
+		uint32_t mask = 0;
+		for (uint32_t idx = 0; idx < MH_TABLE_SLOTS; idx++) {
+			if (ctrl[idx] == value) mask |= (uint32_t)1 << idx;
+		}
+		return mask;
+#endif
+	}
+	
+	uint32_t matchFull() {
+		// bitmask of slots with a key in them
+#ifdef MH_TABLE_SSE2
+		return (uint32_t)_mm_movemask_epi8( _mm_load_si128((const __m128i *)ctrl) ) & MH_TABLE_SLOT_MASK;
+#else
+		uint32_t mask = 0;
+		for (uint32_t idx = 0; idx < MH_TABLE_SLOTS; idx++) {
+			if (ctrl[idx] & MH_CTRL_FULL) mask |= (uint32_t)1 << idx;
+		}
+		return mask;
+#endif
+	}
+	
+	int hasEmpty() {
+		// check if any slot was never used, which means no probe has ever gone past this group
+		return match(MH_CTRL_EMPTY) != 0;
+	}
+};
+
+class Table {
+public:
+	// flat table engine: one array of groups, plus the old one while a rebuild is in progress
+	// a rebuild moves keys over a few old groups at a time (see Hash::tableMigrate()), and until it is done,
+	// every key is in one array or the other, so lookups check the current array, then the old one
+	TableGroup *groups;
+	void *mem; /**< Arena allocation holding groups (which are aligned within it). */
+	unsigned char bits; /**< Number of groups, in bits. */
+	uint64_t used; /**< Slots with a key in them or deleted, in the current array. */
+	uint64_t numDeleted;
+	
+	TableGroup *oldGroups; /**< Array being moved out of, NULL if no rebuild is in progress. */
+	void *oldMem;
+	unsigned char oldBits;
+	uint64_t migrated; /**< Old groups moved over so far. */
+	
+	Table() {
+		init();
+	}
+	
+	void init() {
+		groups = NULL;
+		mem = NULL;
+		bits = 0;
+		used = 0;
+		numDeleted = 0;
+		oldGroups = NULL;
+		oldMem = NULL;
+		oldBits = 0;
+		migrated = 0;
+	}
+	
+	uint64_t capacity() {
+		// number of slots in the current array
+		return (uint64_t)MH_TABLE_SLOTS << bits;
+	}
+	
+	static uint64_t arraySize(unsigned char numBits) {
+		// allocation size for an array of groups, with room to align it
+		return ((uint64_t)sizeof(TableGroup) << numBits) + sizeof(TableGroup);
+	}
+	
+	static TableGroup *home(TableGroup *array, unsigned char numBits, uint64_t hash) {
+		// first group to probe for a key hash
+		return &array[ hash >> (64 - numBits) ];
+	}
+	
+	static unsigned char ctrlFor(uint64_t hash) {
+		// control byte for a key hash
+		return (unsigned char)(MH_CTRL_FULL | ((hash >> MH_TABLE_TAG_SHIFT) & 0x7F));
+	}
+};
+
 class Response {
 public:
 	// a response object is returned from all hash table operations
@@ -133,31 +902,104 @@ public:
 	}
 };
 
+class Lookup {
+public:
+	// one key in a batch of interleaved lookups, the caller fills in hash, key and keyLength, and peekMany() does the rest
+	uint64_t hash;
+	unsigned char *key;
+	MH_KLEN_T keyLength;
+	Tag *tag; /**< Next node to visit, index or bucket (already prefetched). */
+	unsigned char digestIndex; /**< Index level, or for the flat table, number of groups probed so far. */
+	TableGroup *group; /**< Flat table group being probed. */
+	uint32_t hits; /**< Flat table slots in the group still to check. */
+	unsigned char pass; /**< Flat table array being probed, 1 for the old one. */
+	Response resp;
+};
+
+class Cursor {
+public:
+	// position in the LRU list for iteration (see Hash::openCursor())
+	// the hash keeps it valid: when the bucket it sits on is deleted, evicted or moved, the cursor steps along to its neighbor
+	Bucket *bucket; /**< Next bucket to visit, NULL at the end of the list. */
+	int dir; /**< 1 to walk from the head (most popular first), -1 from the tail. */
+	uint32_t shard; /**< Shard the cursor is in (see ShardedHash::openCursor()), numShards when done. */
+	
+	Cursor() {
+		bucket = NULL;
+		dir = 1;
+		shard = 0;
+	}
+};
+
+class Filter {
+public:
+	// which keys Hash::deleteWhere() deletes, and running totals of what it did
+	unsigned char *prefix; /**< Key prefix to match, NULL for any key. */
+	uint32_t prefixLength;
+	uint32_t typeMask; /**< Bit (1 << flags) set for each value type to match, 0 for any type. */
+	uint64_t numVisited; /**< Keys looked at. */
+	uint64_t numKeys; /**< Keys deleted. */
+	uint64_t numBytes; /**< Data and metadata deleted (see Stats). */
+	
+	Filter() {
+		prefix = NULL;
+		prefixLength = 0;
+		typeMask = 0;
+		numVisited = 0;
+		numKeys = 0;
+		numBytes = 0;
+	}
+};
+
 class Hash {
 public:
 	// main hash table object
-	// starts with one 8-bit index (auto-expands)
-	Index *index;
+	// starts with one index (auto-expands), or an empty flat table (auto-grows), depending on the engine
+	Index *index; /**< Top level index, NULL for the flat table engine. */
+	Table table;
+	unsigned char engine; /**< MH_ENGINE_TRIE or MH_ENGINE_TABLE. */
 	Stats *stats;
+	Arena *arena;
 	unsigned char maxBuckets;
 	unsigned char reindexScatter;
 	
+	// index layout: the top level uses rootBits of the key hash, and every level below it indexBits
+	unsigned char rootBits;
+	unsigned char indexBits;
+	unsigned char maxDepth; /**< Number of levels the hash has enough bits for. */
+	unsigned char shifts[MH_DIGEST_SIZE]; /**< Bit position of each level's digit in the hash. */
+	
 	// LRU additions:
 	uint64_t maxKeys;
 	uint64_t maxBytes;
 	Bucket *cacheFirst;
 	Bucket *cacheLast;
 	
+	// eviction watermarks:
+	// crossing maxKeys or maxBytes (the high mark) evicts down to lowWater percent of them in one batch
+	unsigned char lowWater;
+	unsigned char deferEvict; /**< Leave eviction to explicit evict() calls. */
+	unsigned char accounting; /**< MH_ACCOUNT_DATA or MH_ACCOUNT_ARENA. */
+	unsigned char shrinking; /**< Over a lowered limit, so each store only evicts part of the excess (see setLimits()). */
+	unsigned char policy; /**< MH_POLICY_LRU, MH_POLICY_CLOCK or MH_POLICY_TINYLFU. */
+	unsigned char appending; /**< New keys go to the LRU tail and nothing is evicted (see append()). */
+	
+	// W-TinyLFU segments, all in the one list: [window][protected][probation], head to tail
+	// the boundary pointers are the last bucket in each segment (NULL if empty)
+	Bucket *windowLast;
+	Bucket *protectedLast;
+	uint64_t windowCount;
+	uint64_t protectedCount;
+	Sketch *sketch;
+	TimerWheel *wheel; /**< Expiration timers, NULL until a key is stored with a TTL. */
+	unsigned char reschedule; /**< Keys had timers when the table was detached, so attach() rebuilds them. */
+	std::unordered_map<Bucket *, uint32_t> *pins; /**< Pin counts for buckets referenced by zero-copy views, NULL until the first pin. */
+	std::vector<Cursor *> *cursors; /**< Open iteration cursors, NULL if there are none. */
+	Metrics *metrics; /**< Operation counters and latency histograms, NULL unless turned on (see setMetrics()). */
+	
 	Hash() {
 		maxBuckets = 16;
 		reindexScatter = 1;
-		
-		// LRU init
-		maxKeys = 0;
-		maxBytes = 0;
-		cacheFirst = NULL;
-		cacheLast = NULL;
-		
 		init();
 	}
 	
@@ -179,52 +1021,315 @@ public:
 		init();
 	}
 	
+	Hash(unsigned char newMaxBuckets, unsigned char newReindexScatter, Arena *newArena, Stats *newStats) {
+		// same, but with the arena and stats placed by the caller (i.e. in a cache file)
+		maxBuckets = newMaxBuckets;
+		if (maxBuckets < 1) maxBuckets = 1;
+		
+		reindexScatter = newReindexScatter;
+		if (reindexScatter < 1) reindexScatter = 1;
+		if ((int)maxBuckets + (int)reindexScatter > 256) reindexScatter = 1;
+		
+		init( newArena, newStats );
+	}
+	
 	~Hash() {
-		clear();
+		// all buckets and indexes live in the arena
+		// (tables in a cache file are never destroyed, only detached)
+		delete arena;
+		delete stats;
+		delete sketch;
+		delete wheel;
+		delete pins;
+		delete cursors;
+		delete metrics;
 	}
 	
-	void init() {
-		index = new Index();
-		stats = new Stats();
-		stats->indexSize += sizeof(Index);
+	void init(Arena *newArena = NULL, Stats *newStats = NULL) {
+		// LRU init (shared by all constructors)
+		maxKeys = 0;
+		maxBytes = 0;
+		cacheFirst = NULL;
+		cacheLast = NULL;
+		lowWater = MH_LOW_WATER;
+		deferEvict = 0;
+		accounting = MH_ACCOUNT_DATA;
+		shrinking = 0;
+		policy = MH_POLICY_LRU;
+		appending = 0;
+		
+		windowLast = NULL;
+		protectedLast = NULL;
+		windowCount = 0;
+		protectedCount = 0;
+		sketch = new Sketch();
+		wheel = NULL; // created on first TTL
+		reschedule = 0;
+		pins = NULL; // created on first pin
+		cursors = NULL;
+		metrics = NULL;
+		
+		arena = newArena ? newArena : new Arena();
+		stats = newStats ? newStats : new Stats();
+		engine = MH_ENGINE_TRIE;
+		initLayout( MH_INDEX_BITS, MH_INDEX_BITS );
+		index = newIndex( 0 );
 	}
 	
 	// public methods:
-	Response store(unsigned char *key, MH_KLEN_T keyLength, unsigned char *content, MH_LEN_T contentLength, unsigned char flags = 0);
-	Response fetch(unsigned char *key, MH_KLEN_T keyLength);
-	Response peek(unsigned char *key, MH_KLEN_T keyLength);
-	Response remove(unsigned char *key, MH_KLEN_T keyLength);
+	Response store(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength, unsigned char *content, MH_LEN_T contentLength, unsigned char flags = 0, uint32_t expires = 0);
+	Response fetch(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength);
+	Response peek(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength);
+	Response remove(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength);
+	uint64_t peekMany(Lookup *lookups, uint32_t count, uint32_t group = MH_LOOKUP_GROUP);
+	
+	Response store(unsigned char *key, MH_KLEN_T keyLength, unsigned char *content, MH_LEN_T contentLength, unsigned char flags = 0, uint32_t expires = 0) {
+		return store( hashKey(key, keyLength), key, keyLength, content, contentLength, flags, expires );
+	}
+	Response fetch(unsigned char *key, MH_KLEN_T keyLength) {
+		return fetch( hashKey(key, keyLength), key, keyLength );
+	}
+	Response peek(unsigned char *key, MH_KLEN_T keyLength) {
+		return peek( hashKey(key, keyLength), key, keyLength );
+	}
+	Response remove(unsigned char *key, MH_KLEN_T keyLength) {
+		return remove( hashKey(key, keyLength), key, keyLength );
+	}
 	Response firstKey();
 	Response nextKey(unsigned char *key, MH_KLEN_T keyLength);
 	Response lastKey();
 	Response prevKey(unsigned char *key, MH_KLEN_T keyLength);
+	Response append(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength, unsigned char *content, MH_LEN_T contentLength, unsigned char flags = 0, uint32_t expires = 0);
+	uint64_t evict(uint64_t budget = 0);
+	uint64_t expire(uint64_t budget = 0, uint32_t now = 0, uint64_t *processed = NULL);
+	void setLimits(uint64_t newMaxKeys, uint64_t newMaxBytes);
 	
 	void clear();
 	void clear(unsigned char slice);
 	void clear(unsigned char slice1, unsigned char slice2);
+	Discard *discard();
+	void deleteWhere(Filter *filter, uint32_t slice);
+	int setLayout(unsigned char newRootBits, unsigned char newIndexBits);
+	int setEngine(unsigned char newEngine);
+	
+	// instrumentation:
+	void setMetrics(uint32_t sample);
+	void getShape(Shape *shape);
+	
+	// persistent caches:
+	void attach(MapRegion *region);
+	void detach();
+	
+	// zero-copy views:
+	void pin(Bucket *bucket);
+	void unpin(Bucket *bucket);
+	uint64_t numPinned() { return pins ? pins->size() : 0; }
+	
+	// iteration:
+	void openCursor(Cursor *cursor);
+	void closeCursor(Cursor *cursor);
+	Bucket *stepCursor(Cursor *cursor);
 	
 	// internal methods:
-	void clearSlice(Index *level, unsigned char *slices, unsigned char idx);
-	void clearTag(Tag *tag);
+	int overLimit(uint64_t percent);
+	int fits(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength, MH_LEN_T contentLength);
+	void reset();
+	int clearPrefix(Index *level, unsigned char digestIndex, uint64_t prefix, unsigned char prefixBits);
+	void clearTag(Tag *tag, unsigned char digestIndex);
+	void clearBuckets(Tag **slot, uint64_t prefix, unsigned char prefixBits, Filter *filter = NULL);
+	void filterIndex(Index *level, unsigned char digestIndex, uint64_t prefix, unsigned char prefixBits, Filter *filter);
+	void shapeIndex(Index *level, unsigned char digestIndex, Shape *shape);
+	int matchBucket(Bucket *bucket, Filter *filter);
+	void initLayout(unsigned char newRootBits, unsigned char newIndexBits);
 	void reindexBucket(Bucket *bucket, Index *index, unsigned char digestIndex);
+	void deleteBucket(Bucket *bucket, Bucket *lastBucket, Tag **slot);
+	void dropBucket(Bucket *bucket);
+	void freeBucket(Bucket *bucket);
+	void evictBucket(Bucket *bucket);
+	Bucket *nextVictim();
+	int reapTimer(TimerEntry *entry, uint32_t now);
+	void reapBucket(Bucket *bucket, Bucket *lastBucket, Tag **slot);
+	void setExpires(Bucket *bucket, uint32_t expires);
+	void linkBucket(Bucket *bucket, Bucket *after);
+	void unlinkBucket(Bucket *bucket);
+	void replaceBucket(Bucket *bucket, Bucket *newBucket);
+	void moveCursors(Bucket *bucket, Bucket *newBucket);
+	void insertBucket(Bucket *bucket);
+	void requeueBucket(Bucket *bucket);
+	void moveBucket(Bucket *bucket, unsigned char segment);
+	void touchSegment(Bucket *bucket);
+	void fillMain();
+	void makeRoom();
+	unsigned char updateBucket(Bucket *bucket, Bucket *lastBucket, Tag **slot, unsigned char *content, MH_LEN_T contentLength, unsigned char flags, uint32_t expires);
+	int stepLookup(Lookup *lookup);
+	
+	// flat table engine:
+	Response tableStore(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength, unsigned char *content, MH_LEN_T contentLength, unsigned char flags, uint32_t expires);
+	Response tableFetch(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength, int touch);
+	Tag **tableFind(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength, Bucket *target);
+	Tag **tableProbe(TableGroup *groups, unsigned char bits, uint64_t hash, unsigned char *key, MH_KLEN_T keyLength, Bucket *target);
+	Tag **tableInsert(uint64_t hash);
+	void tableErase(Tag **slot);
+	int tableInit();
+	int tableGrow();
+	void tableMigrate(uint64_t count);
+	void tableClear(TableGroup *groups, unsigned char bits, uint64_t prefix, unsigned char prefixBits, Filter *filter = NULL);
+	void tableClearAll();
+	void tableShape(TableGroup *groups, unsigned char bits, Shape *shape);
+	TableGroup *tableAlloc(unsigned char bits, void **mem);
+	void tableFree(void *mem, unsigned char bits);
+	void startTableLookup(Lookup *lookup);
+	int stepTableLookup(Lookup *lookup);
+	
+	void touchBucket(Bucket *bucket) {
+		// record an access to bucket, according to the eviction policy
+		if (policy == MH_POLICY_LRU) promoteBucket( bucket );
+		else if (policy == MH_POLICY_CLOCK) bucket->state |= MH_STATE_REF;
+		else touchSegment( bucket );
+	}
+	
+	int isExpired(Bucket *bucket) {
+		// check if bucket TTL ran out (expired keys stay put until they are reaped, but can't be seen)
+		return bucket->expires && (bucket->expires <= mhNow());
+	}
+	
+	uint64_t usedBytes() {
+		// memory charged against maxBytes, depending on the accounting mode
+		if (accounting == MH_ACCOUNT_ARENA) return arena->usedBytes;
+		return stats->dataSize + stats->indexSize + stats->metaSize;
+	}
+	
+	uint64_t windowMax() {
+		// W-TinyLFU window size, based on maxKeys (or the current size, if there's no key limit)
+		uint64_t capacity = maxKeys ? maxKeys : stats->numKeys;
+		return MAX( 1, (capacity * MH_TINYLFU_WINDOW) / 100 );
+	}
+	
+	uint64_t protectedMax() {
+		// W-TinyLFU protected segment size
+		uint64_t capacity = maxKeys ? maxKeys : stats->numKeys;
+		uint64_t window = windowMax();
+		return (capacity > window) ? (((capacity - window) * MH_TINYLFU_PROTECTED) / 100) : 0;
+	}
+	
+	void promoteBucket(Bucket *bucket) {
+		// move bucket to LRU head (LRU and CLOCK only, this doesn't know about segments)
+		if (bucket == cacheFirst) return;
+		if (cursors) moveCursors( bucket, NULL );
+		
+		if (bucket->cachePrev) bucket->cachePrev->cacheNext = bucket->cacheNext;
+		if (bucket->cacheNext) bucket->cacheNext->cachePrev = bucket->cachePrev;
+		if (bucket == cacheLast) cacheLast = bucket->cachePrev;
+		
+		bucket->cachePrev = NULL;
+		bucket->cacheNext = cacheFirst;
+		if (cacheFirst) cacheFirst->cachePrev = bucket;
+		cacheFirst = bucket;
+		if (!cacheLast) cacheLast = bucket;
+	}
+	Bucket *allocBucket(uint64_t hash, unsigned char *key, MH_KLEN_T keyLength, unsigned char *content, MH_LEN_T contentLength, unsigned char flags);
+	void bucketSetContent(Bucket *bucket, unsigned char *content, MH_LEN_T contentLength);
+	
+	Index *newIndex(unsigned char digestIndex) {
+		// allocate new (empty) index for the given level from the arena
+		uint64_t size = indexSizeAt( digestIndex );
+		Index *level = (Index *)arena->alloc( size );
+		if (!level) return NULL;
+		
+		memset( (void *)level, 0, size );
+		stats->indexSize += size;
+		stats->numIndexes++;
+		return level;
+	}
+	
+	void freeIndex(Index *level, unsigned char digestIndex) {
+		// give index back to the arena (its slots must be cleared already)
+		uint64_t size = indexSizeAt( digestIndex );
+		arena->release( (void *)level, size );
+		stats->indexSize -= size;
+		stats->numIndexes--;
+	}
+	
+	static int isIndex(Tag *tag) {
+		// check if slot points to another index (rather than a bucket list)
+		return (int)((uintptr_t)tag & MH_TAG_INDEX);
+	}
+	
+	static Index *toIndex(Tag *tag) {
+		// get index from tagged slot pointer
+		return (Index *)((uintptr_t)tag & ~(uintptr_t)MH_TAG_INDEX);
+	}
+	
+	static Tag *indexTag(Index *level) {
+		// tag index pointer for storing it in a slot
+		return (Tag *)((uintptr_t)level | MH_TAG_INDEX);
+	}
+	
+	MH_INLINE void prefetch(uint64_t hash) {
+		// start loading the first index level (or bucket list) for a key we are about to look up
+		// the top level index is always hot, so this takes the first real cache miss off the lookup
+		if (engine == MH_ENGINE_TABLE) prefetchGroup( Table::home(table.groups, table.bits, hash) );
+		else prefetchTag( index->data[ digestAt(hash, 0) ], hash, 1 );
+	}
+	
+	MH_INLINE void prefetchGroup(TableGroup *group) {
+		// start loading a flat table group, control bytes and slots
+		MH_PREFETCH( group );
+		MH_PREFETCH( ((unsigned char *)group) + 64 );
+	}
+	
+	MH_INLINE void prefetchTag(Tag *tag, uint64_t hash, unsigned char digestIndex) {
+		// start loading a node we are about to visit: for an index just the line with the slot we need (digestIndex is its level),
+		// for a bucket its header and key, which may be on the next line
+		if (!tag) return;
+		if (isIndex(tag)) MH_PREFETCH( &toIndex(tag)->data[ digestAt(hash, digestIndex) ] );
+		else {
+			MH_PREFETCH( tag );
+			MH_PREFETCH( ((unsigned char *)tag) + sizeof(Bucket) + MH_KLEN_SIZE );
+		}
+	}
+	
+	unsigned char digestAt(uint64_t hash, unsigned char digestIndex) {
+		// get the slot number for a key hash at one index level (the top level may be wider than the rest)
+		return (unsigned char)((hash >> shifts[digestIndex]) & ((1 << (digestIndex ? indexBits : rootBits)) - 1));
+	}
+	
+	uint64_t indexSizeAt(unsigned char digestIndex) {
+		// size of one index at the given level, in bytes
+		return sizeof(Tag *) << (digestIndex ? indexBits : rootBits);
+	}
 	
 	int bucketKeyEquals(Bucket *bucket, unsigned char *key, MH_KLEN_T keyLength) {
 		// compare key to bucket key
-		unsigned char *bucketData = ((unsigned char *)bucket) + sizeof(Bucket);
-		if (keyLength != ((MH_KLEN_T *)bucketData)[0]) return 0;
-		unsigned char *bucketKey = bucketData + MH_KLEN_SIZE;
-		return (int)!memcmp( (void *)key, (void *)bucketKey, (size_t)keyLength );
+		if (keyLength != bucketGetKeyLength(bucket)) return 0;
+		return (int)!memcmp( (void *)key, (void *)bucketGetKey(bucket), (size_t)keyLength );
+	}
+	
+	static unsigned char bucketTypeFor(MH_KLEN_T keyLength, MH_LEN_T contentLength) {
+		// pick bucket format by size (MH_SIG_SMALL or MH_SIG_BUCKET)
+		return ((keyLength <= MH_SMALL_MAX) && (contentLength <= MH_SMALL_MAX)) ? MH_SIG_SMALL : MH_SIG_BUCKET;
+	}
+	
+	static uint64_t bucketMetaFor(unsigned char type) {
+		// per key overhead of a bucket format: header and length fields
+		return sizeof(Bucket) + ((type == MH_SIG_SMALL) ? MH_SMALL_META : (MH_KLEN_SIZE + MH_LEN_SIZE));
+	}
+	
+	uint64_t bucketGetSize(Bucket *bucket) {
+		// get total allocation size of bucket (header, key, value and lengths)
+		return bucketMetaFor(bucket->type) + bucketGetKeyLength(bucket) + bucketGetContentLength(bucket);
 	}
 	
 	MH_KLEN_T bucketGetKeyLength(Bucket *bucket) {
 		// get bucket key length
 		unsigned char *bucketData = ((unsigned char *)bucket) + sizeof(Bucket);
+		if (bucket->type == MH_SIG_SMALL) return bucketData[0];
 		MH_KLEN_T *tempKL = (MH_KLEN_T *)bucketData;
 		return tempKL[0];
 	}
 	
 	unsigned char *bucketGetKey(Bucket *bucket) {
-		// get pointer to bucket key
+		// get pointer to bucket key (same offset in both formats)
 		unsigned char *bucketData = ((unsigned char *)bucket) + sizeof(Bucket);
 		return bucketData + MH_KLEN_SIZE;
 	}
@@ -232,6 +1337,7 @@ public:
 	MH_LEN_T bucketGetContentLength(Bucket *bucket) {
 		// get bucket content (value) length
 		unsigned char *bucketData = ((unsigned char *)bucket) + sizeof(Bucket);
+		if (bucket->type == MH_SIG_SMALL) return bucketData[1];
 		unsigned char *tempCL = bucketData + MH_KLEN_SIZE + ((MH_KLEN_T *)bucketData)[0];
 		return ((MH_LEN_T *)tempCL)[0];
 	}
@@ -239,27 +1345,60 @@ public:
 	unsigned char *bucketGetContent(Bucket *bucket) {
 		// get pointer to bucket content (value)
 		unsigned char *bucketData = ((unsigned char *)bucket) + sizeof(Bucket);
+		if (bucket->type == MH_SIG_SMALL) return bucketData + MH_SMALL_META + bucketData[0];
 		return bucketData + MH_KLEN_SIZE + ((MH_KLEN_T *)bucketData)[0] + MH_LEN_SIZE;
 	}
 	
-	void digestKey(unsigned char *key, MH_KLEN_T keyLength, unsigned char *digest) {
-		// Create 32-bit digest of custom key using DJB2 algorithm.
-		// Return as 8 separate bytes (4 bits each) in unsigned char array
-		uint32_t hash = 5381;
-		for (unsigned int i = 0; i < keyLength; i++) {
-			hash = ((hash << 5) + hash) + key[i];
-		}
-		((uint32_t *)digest)[0] = hash;
+	static uint64_t hashKey(unsigned char *key, MH_KLEN_T keyLength) {
+		// Create 64-bit hash of custom key
+		return hashBytes( key, keyLength );
+	}
+	
+	static uint64_t hashBytes(const unsigned char *data, uint64_t length) {
+		// Create 64-bit hash of any length of data, reading 8 bytes at a time (wyhash)
+		// also used to checksum snapshot blocks
+		const unsigned char *p = data;
+		uint64_t seed = mhMix( MH_HASH_P0, MH_HASH_P1 );
+		uint64_t a, b;
+		size_t len = (size_t)length;
 		
-		digest[4] = digest[0] % 16;
-		digest[5] = digest[1] % 16;
-		digest[6] = digest[2] % 16;
-		digest[7] = digest[3] % 16;
+		if (len <= 16) {
+			if (len >= 4) {
+				a = (mhRead32(p) << 32) | mhRead32(p + ((len >> 3) << 2));
+				b = (mhRead32(p + len - 4) << 32) | mhRead32(p + len - 4 - ((len >> 3) << 2));
+			}
+			else if (len > 0) {
+				a = (((uint64_t)p[0]) << 16) | (((uint64_t)p[len >> 1]) << 8) | p[len - 1];
+				b = 0;
+			}
+			else a = b = 0;
+		}
+		else {
+			size_t i = len;
+			if (i > 48) {
+				uint64_t see1 = seed, see2 = seed;
+				do {
+					seed = mhMix( mhRead64(p) ^ MH_HASH_P1, mhRead64(p + 8) ^ seed );
+					see1 = mhMix( mhRead64(p + 16) ^ MH_HASH_P2, mhRead64(p + 24) ^ see1 );
+					see2 = mhMix( mhRead64(p + 32) ^ MH_HASH_P3, mhRead64(p + 40) ^ see2 );
+					p += 48; i -= 48;
+				} while (i > 48);
+				seed ^= see1 ^ see2;
+			}
+			while (i > 16) {
+				seed = mhMix( mhRead64(p) ^ MH_HASH_P1, mhRead64(p + 8) ^ seed );
+				i -= 16; p += 16;
+			}
+			a = mhRead64(p + i - 16);
+			b = mhRead64(p + i - 8);
+		}
 		
-		digest[0] /= 16;
-		digest[1] /= 16;
-		digest[2] /= 16;
-		digest[3] /= 16;
+		a ^= MH_HASH_P1;
+		b ^= seed;
+		mhMum(&a, &b);
+		return mhMix( a ^ MH_HASH_P0 ^ len, b ^ MH_HASH_P1 );
 	}
 
 }; // Hash
+
+#endif
@@ -0,0 +1,698 @@
+// MegaCache v1.0
+// Copyright (c) 2023 Joseph Huckaby
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <map>
+#include <chrono>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#endif
+
+#include "ShardedHash.h"
+
+class SnapshotReport {
+public:
+	// outcome of a background save, sent from the forked child to the parent
+	unsigned char result;
+	uint64_t numKeys;
+	uint64_t numSkipped;
+	uint64_t numBytes;
+	char error[256]; /**< SnapshotWriter::failure, the parent puts the message together (see SnapshotWriter::describe()). */
+	int code;
+};
+
+// named caches, so multiple threads can attach to the same one
+static std::mutex registryLock;
+static std::map<std::string, ShardedHash *> registry;
+
+ShardedHash::ShardedHash(ShardOptions &opts) {
+	// round shard count up to a power of 2, so we can mask the hash
+	numShards = 1;
+	while ((numShards < opts.numShards) && (numShards < MH_MAX_SHARDS)) numShards *= 2;
+	shardMask = numShards - 1;
+	refCount = 1;
+	saving = 0;
+	region = NULL;
+	
+	if (!opts.file.empty()) {
+		// persistent cache, pick up where we left off if the file was closed cleanly
+		region = new MapRegion();
+		if (!region->open(opts.file.c_str(), numShards)) error = region->error;
+		else if (region->restored) {
+			for (uint32_t idx = 0; idx < numShards; idx++) {
+				Hash *hash = region->header->hashes[idx];
+				if (!hash) error = "Cache file is incomplete";
+				else if (hash->policy != opts.policy) error = "Cache file was created with a different eviction policy";
+				else if (hash->engine != opts.engine) error = "Cache file was created with a different storage engine";
+				else if ((hash->rootBits != opts.rootBits) || (hash->indexBits != opts.indexBits)) error = "Cache file was created with a different index fan-out";
+			}
+		}
+		if (!error.empty()) {
+			delete region;
+			region = NULL;
+		}
+	}
+	
+	// global limits are split evenly across shards (keys hash evenly, so shards fill evenly)
+	shards = new Shard[ numShards ];
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		// 8 buckets per list with 16 scatter is about the perfect balance of speed and memory
+		Hash *hash = NULL;
+		if (region && region->restored) {
+			hash = region->header->hashes[idx];
+			hash->attach( region );
+		}
+		else if (region) {
+			hash = region->newHash( 8, 16 );
+			region->header->hashes[idx] = hash;
+		}
+		if (!hash) {
+			if (region) error = "Failed to allocate space in cache file";
+			hash = new Hash( 8, 16 );
+		}
+		
+		hash->lowWater = opts.lowWater;
+		hash->deferEvict = opts.deferEvict;
+		hash->accounting = opts.accounting;
+		hash->policy = opts.policy;
+		hash->setLimits( (opts.maxKeys + numShards - 1) / numShards, (opts.maxBytes + numShards - 1) / numShards );
+		if ((hash->rootBits != opts.rootBits) || (hash->indexBits != opts.indexBits)) hash->setLayout( opts.rootBits, opts.indexBits );
+		if (hash->engine != opts.engine) hash->setEngine( opts.engine );
+		shards[idx].hash = hash;
+	}
+}
+
+ShardedHash::~ShardedHash() {
+	// cleanup and free memory
+	// tables in a cache file are only detached, then the file is synced and marked clean
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		Hash *hash = shards[idx].hash;
+		if (region && (hash->arena->region == region)) hash->detach();
+		else delete hash;
+	}
+	delete [] shards;
+	if (region) delete region;
+}
+
+Response ShardedHash::store(unsigned char *key, MH_KLEN_T keyLength, unsigned char *content, MH_LEN_T contentLength, unsigned char flags, uint32_t expires) {
+	// store key/value pair in its shard (evicting from that shard only)
+	uint64_t hash = Hash::hashKey(key, keyLength);
+	Shard *shard = shardFor(hash);
+	
+	std::lock_guard<std::shared_mutex> guard( shard->lock );
+	shard->drainReads();
+	
+	Metrics *metrics = shard->hash->metrics;
+	uint64_t started = metrics ? metrics->start() : 0;
+	Response resp = shard->hash->store( hash, key, keyLength, content, contentLength, flags, expires );
+	if (metrics) metrics->recordSet( started, resp.result );
+	return resp;
+}
+
+Response ShardedHash::remove(unsigned char *key, MH_KLEN_T keyLength) {
+	// remove key/value pair from its shard
+	uint64_t hash = Hash::hashKey(key, keyLength);
+	Shard *shard = shardFor(hash);
+	
+	std::lock_guard<std::shared_mutex> guard( shard->lock );
+	shard->drainReads();
+	
+	Metrics *metrics = shard->hash->metrics;
+	uint64_t started = metrics ? metrics->start() : 0;
+	Response resp = shard->hash->remove( hash, key, keyLength );
+	if (metrics) metrics->recordDelete( started, resp.result );
+	return resp;
+}
+
+int ShardedHash::has(unsigned char *key, MH_KLEN_T keyLength) {
+	// see if key exists, without LRU promotion
+	uint64_t hash = Hash::hashKey(key, keyLength);
+	Shard *shard = shardFor(hash);
+	
+	std::shared_lock<std::shared_mutex> guard( shard->lock );
+	
+	Metrics *metrics = shard->hash->metrics;
+	uint64_t started = metrics ? metrics->start() : 0;
+	unsigned char result = shard->hash->peek( hash, key, keyLength ).result;
+	if (metrics) metrics->recordGet( started, result );
+	return result == MH_OK;
+}
+
+Response ShardedHash::fetchView(unsigned char *key, MH_KLEN_T keyLength) {
+	// fetch value and pin its bucket, so the content pointer stays valid until unpin()
+	// this takes the lock exclusively, like a write, as pinning changes the bucket (and the promotion is applied right away)
+	uint64_t hash = Hash::hashKey(key, keyLength);
+	Shard *shard = shardFor(hash);
+	
+	std::lock_guard<std::shared_mutex> guard( shard->lock );
+	shard->drainReads();
+	
+	Metrics *metrics = shard->hash->metrics;
+	uint64_t started = metrics ? metrics->start() : 0;
+	Response resp = shard->hash->fetch( hash, key, keyLength );
+	if (metrics) metrics->recordGet( started, resp.result );
+	
+	if (resp.result == MH_OK) shard->hash->pin( resp.bucket );
+	return resp;
+}
+
+void ShardedHash::unpin(Bucket *bucket) {
+	// release pin from fetchView(), the bucket (alive until now) still has its hash, which leads to its shard
+	Shard *shard = shardFor(bucket->hash);
+	
+	std::lock_guard<std::shared_mutex> guard( shard->lock );
+	shard->drainReads();
+	shard->hash->unpin( bucket );
+}
+
+void ShardedHash::openCursor(Cursor *cursor, int dir) {
+	// start iterating at the first shard (dir 1, LRU heads first) or the last (dir -1, LRU tails first)
+	// the cursor is registered with one shard at a time, and moves on to the next with nextShard()
+	cursor->dir = dir;
+	cursor->shard = (dir > 0) ? 0 : (numShards - 1);
+	
+	Shard *shard = &shards[cursor->shard];
+	std::lock_guard<std::shared_mutex> guard( shard->lock );
+	shard->drainReads();
+	shard->hash->openCursor( cursor );
+}
+
+void ShardedHash::nextShard(Cursor *cursor) {
+	// cursor reached the end of its shard, so move it to the next one (or past the last, which means done)
+	uint32_t next = (cursor->dir > 0) ? (cursor->shard + 1) : (cursor->shard - 1);
+	closeCursor( cursor );
+	if (next >= numShards) return;
+	
+	cursor->shard = next;
+	
+	Shard *shard = &shards[cursor->shard];
+	std::lock_guard<std::shared_mutex> guard( shard->lock );
+	shard->drainReads();
+	shard->hash->openCursor( cursor );
+}
+
+void ShardedHash::closeCursor(Cursor *cursor) {
+	// stop iterating, safe to call again once closed (the cursor is then past the last shard)
+	if (cursor->shard >= numShards) return;
+	
+	Shard *shard = &shards[cursor->shard];
+	std::lock_guard<std::shared_mutex> guard( shard->lock );
+	shard->hash->closeCursor( cursor );
+	cursor->shard = numShards;
+}
+
+uint64_t ShardedHash::evict(uint64_t budget) {
+	// evict each shard down to its low watermark, return total evicted
+	uint64_t count = 0;
+	
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		if (budget && (count >= budget)) break;
+		
+		std::lock_guard<std::shared_mutex> guard( shards[idx].lock );
+		shards[idx].drainReads();
+		count += shards[idx].hash->evict( budget ? (budget - count) : 0 );
+	}
+	
+	return count;
+}
+
+uint32_t ShardedHash::deleteWhere(Filter *filter, uint32_t cursor, uint64_t budget) {
+	// delete matching keys from each thin slice in turn, starting at cursor, until budget is used up
+	// each key looked at costs 1, and each slice of each shard MH_SLICE_COST, so a sparse (or empty) cache still stops early
+	// return the slice to carry on from next time, or MH_THIN_SLICES when done (totals are added to the filter)
+	uint64_t numVisited = filter->numVisited;
+	uint32_t start = cursor;
+	uint64_t cost = 0;
+	
+	while ((cursor < MH_THIN_SLICES) && (!budget || (cost < budget))) {
+		for (uint32_t idx = 0; idx < numShards; idx++) {
+			std::lock_guard<std::shared_mutex> guard( shards[idx].lock );
+			shards[idx].drainReads();
+			shards[idx].hash->deleteWhere( filter, cursor );
+		}
+		cursor++;
+		cost = (filter->numVisited - numVisited) + ((uint64_t)(cursor - start) * numShards * MH_SLICE_COST);
+	}
+	
+	return cursor;
+}
+
+int ShardedHash::setLimits(uint64_t maxKeys, uint64_t maxBytes) {
+	// change the global limits, split across shards like the constructor does
+	// return 1 if any shard is now over its limit (stores work that off in steps, or evict() can do it between them)
+	int over = 0;
+	
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		std::lock_guard<std::shared_mutex> guard( shards[idx].lock );
+		Hash *hash = shards[idx].hash;
+		hash->setLimits( (maxKeys + numShards - 1) / numShards, (maxBytes + numShards - 1) / numShards );
+		if (hash->shrinking) over = 1;
+	}
+	
+	return over;
+}
+
+uint64_t ShardedHash::expire(uint64_t budget) {
+	// reap expired keys from each shard, return total reaped
+	// the budget (timers processed) is shared across shards, like evict()
+	uint64_t count = 0;
+	uint64_t processed = 0;
+	
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		if (budget && (processed >= budget)) break;
+		
+		std::lock_guard<std::shared_mutex> guard( shards[idx].lock );
+		if (!shards[idx].hash->wheel) continue;
+		
+		uint64_t numTimers = 0;
+		shards[idx].drainReads();
+		count += shards[idx].hash->expire( budget ? (budget - processed) : 0, 0, &numTimers );
+		processed += numTimers;
+	}
+	
+	return count;
+}
+
+void ShardedHash::clear() {
+	// clear all shards, one at a time
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		std::lock_guard<std::shared_mutex> guard( shards[idx].lock );
+		shards[idx].discardReads();
+		shards[idx].hash->clear();
+	}
+}
+
+void ShardedHash::clearBegin(ClearJob *job) {
+	// empty every shard at once, but leave freeing the memory to clearEnd() (see Hash::discard())
+	// all shards are locked together, so no reader ever sees some shards cleared and others not
+	job->start = std::chrono::steady_clock::now();
+	
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		shards[idx].lock.lock();
+	}
+	
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		shards[idx].discardReads();
+		Hash *hash = shards[idx].hash;
+		uint64_t numKeys = hash->stats->numKeys;
+		Discard *old = hash->discard();
+		
+		if (old) {
+			job->numBytes += old->numBytes;
+			job->discards.push_back( old );
+		}
+		job->numKeys += numKeys;
+	}
+	
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		shards[idx].lock.unlock();
+	}
+	job->pause = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - job->start ).count();
+}
+
+void ShardedHash::clearEnd(ClearJob *job) {
+	// free everything clearBegin() took out of the shards (slow, so call this from a worker thread)
+	// the discarded memory is not reachable from the cache anymore, so this takes no locks, and the cache stays usable meanwhile
+	for (size_t idx = 0; idx < job->discards.size(); idx++) {
+		delete job->discards[idx];
+	}
+	job->discards.clear();
+	job->elapsed = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - job->start ).count();
+}
+
+void ShardedHash::clear(unsigned char slice) {
+	// clear one thick slice from every shard (still about 1/256 of total keys)
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		std::lock_guard<std::shared_mutex> guard( shards[idx].lock );
+		shards[idx].drainReads();
+		shards[idx].hash->clear( slice );
+	}
+}
+
+void ShardedHash::clear(unsigned char slice1, unsigned char slice2) {
+	// clear one thin slice from every shard (still about 1/65536 of total keys)
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		std::lock_guard<std::shared_mutex> guard( shards[idx].lock );
+		shards[idx].drainReads();
+		shards[idx].hash->clear( slice1, slice2 );
+	}
+}
+
+int ShardedHash::save(const char *path, SnapshotResult *res) {
+	// write all keys to a snapshot file, one shard at a time, each in LRU order (most recent first)
+	// each shard is locked only while it is being written, so the snapshot is not a single point in time
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	SnapshotWriter writer;
+	
+	if (writer.open(path)) {
+		for (uint32_t idx = 0; idx < numShards; idx++) {
+			std::lock_guard<std::shared_mutex> guard( shards[idx].lock );
+			shards[idx].drainReads();
+			if (!writeShard(&writer, shards[idx].hash, res)) break;
+		}
+		if (!writer.failure) writer.close();
+	}
+	
+	res->result = writer.failure ? MH_ERR : MH_OK;
+	res->error = writer.errorString();
+	res->numKeys = writer.numKeys;
+	res->numBytes = writer.numBytes;
+	res->elapsed = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+	res->pause = res->elapsed;
+	return res->result;
+}
+
+int ShardedHash::writeShard(SnapshotWriter *writer, Hash *hash, SnapshotResult *res) {
+	// internal method: write one shard in LRU order (caller holds the lock, or is the forked child)
+	for (Bucket *bucket = hash->cacheFirst; bucket; bucket = bucket->cacheNext) {
+		if (hash->isExpired(bucket)) {
+			res->numSkipped++;
+			continue;
+		}
+		if (!writer->add(hash, bucket)) return MH_ERR;
+	}
+	return MH_OK;
+}
+
+int ShardedHash::saveBegin(const char *path, SnapshotJob *job) {
+	// start saving a snapshot in the background, return MH_ERR (with job->result.error set) if it could not be started
+	// on POSIX this forks, like Redis BGSAVE: every shard is locked just long enough to fork, so the child
+	// gets a point-in-time copy of the whole cache, and the caller only pauses for the fork itself
+	// only the forking thread makes it into the child, and any lock another thread held (malloc, stdio) stays locked there for good,
+	// so the child sticks to plain system calls: the file is opened and the block buffer allocated before the fork
+	SnapshotResult *res = &job->result;
+	job->path = path;
+	job->start = std::chrono::steady_clock::now();
+	
+	if (saving.exchange(1)) {
+		res->error = "Snapshot already in progress";
+		return MH_ERR;
+	}
+
+#ifdef _WIN32
+	// no fork() here, so saveEnd() does a regular save() instead, one shard at a time
+	return MH_OK;
+#else
+	if (region) {
+		// a cache file is shared with a forked child rather than copied, so the child would see our changes,
+		// and saveEnd() does a regular save() instead
+		return MH_OK;
+	}
+	
+	SnapshotWriter writer;
+	if (!writer.open(path)) {
+		res->error = writer.errorString();
+		saving.store( 0 );
+		return MH_ERR;
+	}
+	
+	int fds[2];
+	if (pipe(fds) != 0) {
+		res->error = std::string("Failed to create pipe: ") + strerror(errno);
+		saving.store( 0 );
+		return MH_ERR;
+	}
+	fcntl( fds[0], F_SETFD, FD_CLOEXEC );
+	fcntl( fds[1], F_SETFD, FD_CLOEXEC );
+	
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		shards[idx].lock.lock();
+		shards[idx].drainReads();
+	}
+	
+	pid_t pid = fork();
+	if (pid == 0) {
+		// child: write our private copy of the cache, report back, and exit without running any destructors
+		// we still hold every shard lock, but no other thread made it across the fork, so nobody is waiting on them
+		// no malloc, stdio or std::string from here on (see above), errors are handed back as static strings
+		SnapshotReport report;
+		memset( (void *)&report, 0, sizeof(SnapshotReport) );
+		writer.forked = 1;
+		
+		for (uint32_t idx = 0; idx < numShards; idx++) {
+			if (!writeShard(&writer, shards[idx].hash, res)) break;
+		}
+		if (!writer.failure) writer.close();
+		
+		report.result = writer.failure ? MH_ERR : MH_OK;
+		report.numKeys = writer.numKeys;
+		report.numSkipped = res->numSkipped;
+		report.numBytes = writer.numBytes;
+		report.code = writer.failCode;
+		if (writer.failure) strncpy( report.error, writer.failure, sizeof(report.error) - 1 );
+		
+		ssize_t count = ::write( fds[1], (void *)&report, sizeof(SnapshotReport) );
+		_exit( (count == (ssize_t)sizeof(SnapshotReport)) ? 0 : 1 );
+	}
+	int forkError = errno;
+	
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		shards[idx].lock.unlock();
+	}
+	
+	// the child writes the file through its own copy of the descriptor (if the fork failed, the writer removes the temp file)
+	if (pid > 0) writer.detach();
+	res->pause = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - job->start ).count();
+	::close( fds[1] );
+	
+	if (pid < 0) {
+		::close( fds[0] );
+		res->error = std::string("Failed to fork snapshot process: ") + strerror(forkError);
+		saving.store( 0 );
+		return MH_ERR;
+	}
+	
+	job->pid = pid;
+	job->fd = fds[0];
+	return MH_OK;
+#endif
+}
+
+void ShardedHash::saveEnd(SnapshotJob *job) {
+	// wait for background save to finish (blocks, so call this from a worker thread), result is in job->result
+	SnapshotResult *res = &job->result;
+	
+	if (!job->pid) {
+		// no child process (see saveBegin), so save from this thread, one shard at a time
+		save( job->path.c_str(), res );
+		res->pause = 0;
+	}
+#ifndef _WIN32
+	else {
+		SnapshotReport report;
+		uint64_t length = 0;
+		
+		while (length < sizeof(SnapshotReport)) {
+			ssize_t count = ::read( job->fd, ((char *)&report) + length, sizeof(SnapshotReport) - length );
+			if ((count < 0) && (errno == EINTR)) continue;
+			if (count <= 0) break;
+			length += count;
+		}
+		::close( job->fd );
+		
+		int status = 0;
+		while ((waitpid(job->pid, &status, 0) < 0) && (errno == EINTR)) {}
+		
+		if (length == sizeof(SnapshotReport)) {
+			res->result = report.result;
+			res->numKeys = report.numKeys;
+			res->numSkipped = report.numSkipped;
+			res->numBytes = report.numBytes;
+			res->error = SnapshotWriter::describe( (report.result == MH_OK) ? NULL : report.error, report.code );
+		}
+		else {
+			// child died before reporting back (i.e. killed by a signal)
+			res->result = MH_ERR;
+			res->error = "Snapshot process exited unexpectedly";
+		}
+	}
+#endif
+	
+	res->elapsed = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - job->start ).count();
+}
+
+void ShardedHash::saveDone() {
+	// allow the next background save, once the result of this one has been handed back
+	// (not in saveEnd(), so a caller never sees its save rejected because of one it hasn't heard the end of yet)
+	saving.store( 0 );
+}
+
+int ShardedHash::load(const char *path, SnapshotResult *res) {
+	// read keys from a snapshot file, appending each to the LRU tail of its shard, so the order comes back as saved
+	// there are no per-key eviction checks: once a shard is full, the rest of its keys (the least recent) are skipped
+	// on error, the keys loaded so far are kept
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	SnapshotReader reader;
+	SnapshotRecord record;
+	unsigned char full[MH_MAX_SHARDS];
+	memset( (void *)full, 0, sizeof(full) );
+	uint32_t now = mhNow();
+	
+	if (reader.open(path)) {
+		while (reader.next(&record)) {
+			uint64_t hash = Hash::hashKey( record.key, record.keyLength );
+			Shard *shard = shardFor( hash );
+			uint32_t idx = (uint32_t)(shard - shards);
+			
+			if (full[idx] || (record.expires && (record.expires <= now))) {
+				res->numSkipped++;
+				continue;
+			}
+			
+			std::lock_guard<std::shared_mutex> guard( shard->lock );
+			shard->drainReads();
+			Hash *table = shard->hash;
+			
+			if (!table->fits(hash, record.key, record.keyLength, record.contentLength)) {
+				// this one doesn't fit, so the shard is full (checked up front, as the key may replace one already in there)
+				full[idx] = 1;
+				res->numSkipped++;
+				continue;
+			}
+			if (table->append(hash, record.key, record.keyLength, record.content, record.contentLength, record.flags, record.expires).result == MH_ERR) {
+				reader.fail( "Out of memory" );
+				break;
+			}
+			res->numKeys++;
+		}
+	}
+	
+	res->result = reader.error.empty() ? MH_OK : MH_ERR;
+	res->error = reader.error;
+	res->numBytes = reader.numBytes;
+	res->elapsed = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+	res->pause = res->elapsed;
+	return res->result;
+}
+
+void ShardedHash::getStats(Stats *total, uint64_t *numSlabs, uint64_t *arenaSize, uint64_t *arenaUsed, uint64_t *sketchSize, uint64_t *timerSize) {
+	// sum up stats from all shards
+	*numSlabs = 0;
+	*arenaSize = 0;
+	*arenaUsed = 0;
+	*sketchSize = 0;
+	*timerSize = 0;
+	
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		std::shared_lock<std::shared_mutex> guard( shards[idx].lock );
+		Hash *hash = shards[idx].hash;
+		
+		total->numKeys += hash->stats->numKeys;
+		total->indexSize += hash->stats->indexSize;
+		total->numIndexes += hash->stats->numIndexes;
+		total->metaSize += hash->stats->metaSize;
+		total->dataSize += hash->stats->dataSize;
+		total->numEvictions += hash->stats->numEvictions;
+		total->evictionBatches += hash->stats->evictionBatches;
+		total->evictionTime += hash->stats->evictionTime;
+		total->numAdmitted += hash->stats->numAdmitted;
+		total->numRejected += hash->stats->numRejected;
+		total->numExpired += hash->stats->numExpired;
+		total->expiredBytes += hash->stats->expiredBytes;
+		total->numRebuilds += hash->stats->numRebuilds;
+		
+		*numSlabs += hash->arena->numSlabs;
+		*arenaSize += hash->arena->residentSize();
+		*arenaUsed += hash->arena->usedBytes;
+		*sketchSize += hash->sketch->tableSize * sizeof(uint64_t);
+		if (hash->wheel) *timerSize += hash->wheel->memorySize();
+	}
+}
+
+void ShardedHash::setMetrics(uint32_t sample) {
+	// turn instrumentation on in every shard (timing one in sample operations), or off with 0
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		std::lock_guard<std::shared_mutex> guard( shards[idx].lock );
+		shards[idx].hash->setMetrics( sample );
+	}
+}
+
+int ShardedHash::getMetrics(Metrics *total) {
+	// sum up counters and histograms from all shards, return false if instrumentation is off
+	int found = 0;
+	
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		std::shared_lock<std::shared_mutex> guard( shards[idx].lock );
+		Metrics *metrics = shards[idx].hash->metrics;
+		if (!metrics) continue;
+		
+		total->add( metrics );
+		found = 1;
+	}
+	
+	return found;
+}
+
+void ShardedHash::getShape(Shape *total) {
+	// walk every shard in turn (see Hash::getShape()), only writers to the shard being walked have to wait
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		std::shared_lock<std::shared_mutex> guard( shards[idx].lock );
+		shards[idx].hash->getShape( total );
+	}
+}
+
+uint64_t ShardedHash::readsDropped() {
+	// total LRU promotions lost to full read buffers
+	uint64_t count = 0;
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		count += shards[idx].readsDropped.load( std::memory_order_relaxed );
+	}
+	return count;
+}
+
+uint64_t ShardedHash::numPinned() {
+	// total buckets pinned by zero-copy views (including ones already removed from the table)
+	uint64_t count = 0;
+	for (uint32_t idx = 0; idx < numShards; idx++) {
+		std::shared_lock<std::shared_mutex> guard( shards[idx].lock );
+		count += shards[idx].hash->numPinned();
+	}
+	return count;
+}
+
+ShardedHash *ShardedHash::open(const char *name, ShardOptions &opts) {
+	// create new cache, or attach to existing one by name
+	// settings only apply when the cache is created, later attachments inherit them
+	if (!name || !name[0]) {
+		return new ShardedHash( opts );
+	}
+	
+	std::lock_guard<std::mutex> guard( registryLock );
+	
+	std::map<std::string, ShardedHash *>::iterator iter = registry.find( name );
+	if (iter != registry.end()) {
+		iter->second->refCount++;
+		return iter->second;
+	}
+	
+	ShardedHash *cache = new ShardedHash( opts );
+	if (!cache->error.empty()) return cache;
+	
+	cache->name = name;
+	registry[ cache->name ] = cache;
+	return cache;
+}
+
+void ShardedHash::retain(ShardedHash *cache) {
+	// attach another user to cache, i.e. a background save that must outlive the MegaCache object
+	std::lock_guard<std::mutex> guard( registryLock );
+	cache->refCount++;
+}
+
+void ShardedHash::release(ShardedHash *cache) {
+	// detach from cache, and free it when the last user is gone
+	{
+		std::lock_guard<std::mutex> guard( registryLock );
+		if (--cache->refCount > 0) return;
+		if (!cache->name.empty()) registry.erase( cache->name );
+	}
+	
+	delete cache;
+}
@@ -0,0 +1,185 @@
+// MegaCache v1.0
+// Copyright (c) 2023 Joseph Huckaby
+
+#ifndef SHARDEDHASH_H
+#define SHARDEDHASH_H
+
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "MegaCache.h"
+#include "Snapshot.h"
+#include "MapRegion.h"
+
+/** Maximum number of shards in one cache. */
+#define MH_MAX_SHARDS 256
+
+/** Number of LRU promotions each shard buffers up between drains. */
+#define MH_READ_BUFFER_SIZE 64
+
+class Shard {
+public:
+	// one independently locked hash table, with its own LRU list and arena
+	// readers share the lock and never touch the LRU list, they just log the bucket in the read buffer
+	// writers take the lock exclusively, and apply the logged promotions before changing anything
+	std::shared_mutex lock;
+	Hash *hash;
+	
+	Bucket *readBuffer[MH_READ_BUFFER_SIZE];
+	std::atomic<uint32_t> readCount;
+	std::atomic<uint64_t> readsDropped; /**< Promotions lost because the buffer was full. */
+	unsigned char pad[64];
+	
+	Shard() : readCount(0), readsDropped(0) {
+		hash = NULL;
+	}
+	
+	int recordRead(Bucket *bucket) {
+		// log LRU promotion (caller holds the shared lock), return true if the buffer is now full
+		// this is lossy: when the buffer is full the promotion is simply dropped
+		uint32_t slot = readCount.fetch_add( 1, std::memory_order_relaxed );
+		if (slot < MH_READ_BUFFER_SIZE) readBuffer[slot] = bucket;
+		else readsDropped.fetch_add( 1, std::memory_order_relaxed );
+		return slot + 1 >= MH_READ_BUFFER_SIZE;
+	}
+	
+	void drainReads() {
+		// apply logged promotions in order (caller holds the exclusive lock)
+		// every bucket in the buffer is still alive, as buckets are only freed by writers, who drain first
+		uint32_t count = MIN( readCount.load(std::memory_order_relaxed), MH_READ_BUFFER_SIZE );
+		for (uint32_t idx = 0; idx < count; idx++) hash->touchBucket( readBuffer[idx] );
+		readCount.store( 0, std::memory_order_relaxed );
+	}
+	
+	void tryDrainReads() {
+		// drain from the read side, unless someone else holds the lock (caller must not hold it)
+		if (lock.try_lock()) {
+			drainReads();
+			lock.unlock();
+		}
+	}
+	
+	void discardReads() {
+		// forget logged promotions, i.e. after clear() has freed the buckets
+		readCount.store( 0, std::memory_order_relaxed );
+	}
+};
+
+class ShardOptions {
+public:
+	// settings for a new cache, applied to every shard
+	uint32_t numShards;
+	uint64_t maxKeys; /**< Total for the cache, split across shards. */
+	uint64_t maxBytes; /**< Total for the cache, split across shards. */
+	unsigned char lowWater;
+	unsigned char deferEvict;
+	unsigned char accounting; /**< MH_ACCOUNT_DATA or MH_ACCOUNT_ARENA (see Hash::usedBytes()). */
+	unsigned char policy;
+	unsigned char rootBits; /**< Index fan-out of the top level, in bits (see Hash::setLayout()). */
+	unsigned char indexBits; /**< Index fan-out of all other levels, in bits. */
+	unsigned char engine; /**< MH_ENGINE_TRIE or MH_ENGINE_TABLE (see Hash::setEngine()). */
+	std::string file; /**< Cache file for a persistent cache, empty to keep everything in memory. */
+	
+	ShardOptions() {
+		numShards = 1;
+		maxKeys = 0;
+		maxBytes = 0;
+		lowWater = MH_LOW_WATER;
+		deferEvict = 0;
+		accounting = MH_ACCOUNT_DATA;
+		policy = MH_POLICY_LRU;
+		rootBits = MH_INDEX_BITS;
+		indexBits = MH_INDEX_BITS;
+		engine = MH_ENGINE_TRIE;
+	}
+};
+
+class ClearJob {
+public:
+	// background clear in progress, started by ShardedHash::clearBegin() and finished by clearEnd()
+	// holds everything the shards let go of, which clearEnd() frees without taking any locks
+	std::vector<Discard *> discards;
+	std::chrono::steady_clock::time_point start;
+	uint64_t numKeys; /**< Keys removed from the cache. */
+	uint64_t numBytes; /**< Memory given back, see Discard::numBytes. */
+	uint64_t pause; /**< Time the caller was blocked, in nanoseconds. */
+	uint64_t elapsed; /**< Total time until everything was freed, in nanoseconds. */
+	
+	ClearJob() {
+		numKeys = 0;
+		numBytes = 0;
+		pause = 0;
+		elapsed = 0;
+	}
+	
+	~ClearJob() {
+		for (size_t idx = 0; idx < discards.size(); idx++) delete discards[idx];
+	}
+};
+
+class ShardedHash {
+public:
+	// set of hash tables, each key lives in exactly one of them (chosen by the low bits of its hash)
+	// safe to share across threads (i.e. Node.js worker_threads), all access goes through the shard locks
+	Shard *shards;
+	uint32_t numShards;
+	uint32_t shardMask;
+	
+	std::string name; /**< Registry name, empty if private. */
+	int refCount; /**< Number of MegaCache objects attached (guarded by the registry lock). */
+	std::atomic<int> saving; /**< Set while a background save is running. */
+	MapRegion *region; /**< Cache file, NULL unless persistent. */
+	std::string error; /**< Set if the cache could not be opened (it still works, but in memory only). */
+	
+	ShardedHash(ShardOptions &opts);
+	~ShardedHash();
+	
+	Shard *shardFor(uint64_t hash) {
+		// the index consumes the hash from the top, so select shards from the bottom
+		return &shards[ hash & shardMask ];
+	}
+	
+	// public methods (these all lock, writers drain the read buffer first):
+	Response store(unsigned char *key, MH_KLEN_T keyLength, unsigned char *content, MH_LEN_T contentLength, unsigned char flags = 0, uint32_t expires = 0);
+	Response remove(unsigned char *key, MH_KLEN_T keyLength);
+	int has(unsigned char *key, MH_KLEN_T keyLength);
+	Response fetchView(unsigned char *key, MH_KLEN_T keyLength);
+	void unpin(Bucket *bucket);
+	void openCursor(Cursor *cursor, int dir);
+	void nextShard(Cursor *cursor);
+	void closeCursor(Cursor *cursor);
+	uint64_t evict(uint64_t budget = 0);
+	uint64_t expire(uint64_t budget = 0);
+	int setLimits(uint64_t maxKeys, uint64_t maxBytes);
+	uint32_t deleteWhere(Filter *filter, uint32_t cursor, uint64_t budget = 0);
+	
+	void clear();
+	void clear(unsigned char slice);
+	void clear(unsigned char slice1, unsigned char slice2);
+	void clearBegin(ClearJob *job);
+	void clearEnd(ClearJob *job);
+	
+	int save(const char *path, SnapshotResult *res);
+	int load(const char *path, SnapshotResult *res);
+	int saveBegin(const char *path, SnapshotJob *job);
+	void saveEnd(SnapshotJob *job);
+	void saveDone();
+	int writeShard(SnapshotWriter *writer, Hash *hash, SnapshotResult *res);
+	
+	void getStats(Stats *total, uint64_t *numSlabs, uint64_t *arenaSize, uint64_t *arenaUsed, uint64_t *sketchSize, uint64_t *timerSize);
+	void setMetrics(uint32_t sample);
+	int getMetrics(Metrics *total);
+	void getShape(Shape *total);
+	uint64_t readsDropped();
+	uint64_t numPinned();
+	
+	// registry of named caches, shared by all threads in the process:
+	static ShardedHash *open(const char *name, ShardOptions &opts);
+	static void retain(ShardedHash *cache);
+	static void release(ShardedHash *cache);
+};
+
+#endif
@@ -0,0 +1,305 @@
+// MegaCache v1.0
+// Copyright (c) 2023 Joseph Huckaby
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "Snapshot.h"
+
+int SnapshotWriter::open(const char *newPath) {
+	// create temp file next to the final path, allocate the block buffer, and write the file header
+	path = newPath;
+	tempPath = path + ".tmp";
+
+#ifdef _WIN32
+	fd = _open( tempPath.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE );
+#else
+	fd = ::open( tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+#endif
+	if (fd < 0) return fail( "Failed to create snapshot file", errno );
+	
+	capacity = MH_SNAP_BLOCK_SIZE;
+	buffer = (unsigned char *)malloc( capacity );
+	if (!buffer) return fail( "Out of memory" );
+	
+	SnapshotHeader header;
+	memset( (void *)&header, 0, sizeof(SnapshotHeader) );
+	memcpy( (void *)header.magic, MH_SNAP_MAGIC, 8 );
+	header.version = MH_SNAP_VERSION;
+	header.blockSize = MH_SNAP_BLOCK_SIZE;
+	header.created = (uint64_t)mhNow();
+	
+	return write( (void *)&header, sizeof(SnapshotHeader) );
+}
+
+int SnapshotWriter::add(Hash *hash, Bucket *bucket) {
+	// append one bucket to the current block: flags, expiration, then key and value with lengths
+	// records always use the full length fields, whatever format the bucket is in (see MH_SIG_SMALL)
+	MH_KLEN_T keyLength = hash->bucketGetKeyLength(bucket);
+	MH_LEN_T contentLength = hash->bucketGetContentLength(bucket);
+	uint64_t size = MH_SNAP_RECORD_SIZE + MH_KLEN_SIZE + keyLength + MH_LEN_SIZE + contentLength;
+	
+	if (length && (length + size > MH_SNAP_BLOCK_SIZE) && !flush()) return MH_ERR;
+	
+	if ((size > capacity) && !grow(size)) return MH_ERR;
+	
+	unsigned char *record = buffer + length;
+	record[0] = bucket->flags;
+	memcpy( (void *)(record + 1), (void *)&bucket->expires, sizeof(uint32_t) );
+	unsigned char *data = record + MH_SNAP_RECORD_SIZE;
+	memcpy( (void *)data, (void *)&keyLength, MH_KLEN_SIZE ); data += MH_KLEN_SIZE;
+	memcpy( (void *)data, (void *)hash->bucketGetKey(bucket), keyLength ); data += keyLength;
+	memcpy( (void *)data, (void *)&contentLength, MH_LEN_SIZE ); data += MH_LEN_SIZE;
+	memcpy( (void *)data, (void *)hash->bucketGetContent(bucket), contentLength );
+	
+	length += size;
+	numRecords++;
+	numKeys++;
+	return MH_OK;
+}
+
+int SnapshotWriter::flush() {
+	// write current block with its header
+	if (!length) return MH_OK;
+	
+	SnapshotBlock block;
+	block.length = (uint32_t)length;
+	block.numRecords = numRecords;
+	block.checksum = Hash::hashBytes( buffer, length );
+	
+	if (!write( (void *)&block, sizeof(SnapshotBlock) ) || !write( (void *)buffer, length )) return MH_ERR;
+	
+	length = 0;
+	numRecords = 0;
+	return MH_OK;
+}
+
+int SnapshotWriter::close() {
+	// write the last block and end marker, sync to disk, and atomically replace the old snapshot (if any)
+	if (!flush()) return MH_ERR;
+	
+	SnapshotBlock block;
+	block.length = 0;
+	block.numRecords = 0;
+	block.checksum = numKeys;
+	if (!write( (void *)&block, sizeof(SnapshotBlock) )) return MH_ERR;
+
+#ifdef _WIN32
+	if (_commit(fd) != 0) return fail( "Failed to sync snapshot file", errno );
+	int result = _close( fd );
+#else
+	if (fsync(fd) != 0) return fail( "Failed to sync snapshot file", errno );
+	int result = ::close( fd );
+#endif
+	fd = -1;
+	if (result != 0) return fail( "Failed to write snapshot file", errno );
+
+#ifdef _WIN32
+	remove( path.c_str() );
+#endif
+	if (rename(tempPath.c_str(), path.c_str()) != 0) return fail( "Failed to rename snapshot file", errno );
+	
+	return MH_OK;
+}
+
+void SnapshotWriter::abort() {
+	// give up, and remove the temp file (the previous snapshot, if any, is untouched)
+	if (fd >= 0) {
+#ifdef _WIN32
+		_close( fd );
+		remove( tempPath.c_str() );
+#else
+		::close( fd );
+		unlink( tempPath.c_str() );
+#endif
+		fd = -1;
+	}
+}
+
+void SnapshotWriter::detach() {
+	// let go of the temp file without removing it, as a forked child is writing to its own copy of the descriptor
+	if (fd >= 0) {
+#ifdef _WIN32
+		_close( fd );
+#else
+		::close( fd );
+#endif
+		fd = -1;
+	}
+}
+
+std::string SnapshotWriter::describe(const char *msg, int code) {
+	// put together an error message (with the OS error code, if any), empty if there was no error
+	std::string error;
+	if (msg) error = msg;
+	if (msg && code) error = error + ": " + strerror(code);
+	return error;
+}
+
+int SnapshotWriter::grow(uint64_t size) {
+	// internal method: make room for one huge record (the block is always empty by then, so nothing is copied)
+	if (size > UINT32_MAX) return fail( "Value too large for snapshot" );
+#ifndef _WIN32
+	if (forked) {
+		// a forked child can't call malloc (another thread may have held its lock at the fork), so map fresh pages instead
+		void *pages = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+		if (pages == MAP_FAILED) return fail( "Out of memory" );
+		if (mapped) munmap( (void *)buffer, capacity );
+		buffer = (unsigned char *)pages;
+		capacity = size;
+		mapped = 1;
+		return MH_OK;
+	}
+#endif
+	unsigned char *newBuffer = (unsigned char *)realloc( (void *)buffer, size );
+	if (!newBuffer) return fail( "Out of memory" );
+	buffer = newBuffer;
+	capacity = size;
+	return MH_OK;
+}
+
+void SnapshotWriter::release() {
+	// internal method: free the block buffer
+	if (!buffer) return;
+#ifndef _WIN32
+	if (mapped) munmap( (void *)buffer, capacity );
+	else
+#endif
+	free( (void *)buffer );
+	buffer = NULL;
+}
+
+int SnapshotWriter::write(void *data, uint64_t size) {
+	// internal method: write all of it to the file (in pieces, if the OS takes less at a time), or fail
+	unsigned char *ptr = (unsigned char *)data;
+	while (size) {
+		uint32_t chunk = (uint32_t)MIN( size, (uint64_t)1 << 30 );
+#ifdef _WIN32
+		int count = _write( fd, (void *)ptr, chunk );
+#else
+		ssize_t count = ::write( fd, (void *)ptr, chunk );
+		if ((count < 0) && (errno == EINTR)) continue;
+#endif
+		if (count <= 0) return fail( "Failed to write snapshot file", errno );
+		ptr += count;
+		size -= count;
+		numBytes += count;
+	}
+	return MH_OK;
+}
+
+int SnapshotWriter::fail(const char *msg, int code) {
+	// internal method: record error (msg must be a static string), and the OS error code if any, return MH_ERR
+	// the message is only put together by errorString(), as that allocates
+	failure = msg;
+	failCode = code;
+	abort();
+	return MH_ERR;
+}
+
+int SnapshotReader::open(const char *path) {
+	// open snapshot file and check its header
+	fp = fopen( path, "rb" );
+	if (!fp) return fail( "Failed to open snapshot file", errno );
+	
+	SnapshotHeader header;
+	if (!read( (void *)&header, sizeof(SnapshotHeader) )) return MH_ERR;
+	if (memcmp(header.magic, MH_SNAP_MAGIC, 8) != 0) return fail( "Not a MegaCache snapshot" );
+	if (header.version != MH_SNAP_VERSION) return fail( "Unsupported snapshot version" );
+	
+	return MH_OK;
+}
+
+int SnapshotReader::next(SnapshotRecord *record) {
+	// read next record, return false at the end of the file or on error (check error to tell which)
+	while (!numRecords) {
+		if (offset != length) return fail( "Corrupt snapshot block" );
+		if (done || !error.empty() || !nextBlock()) return 0;
+	}
+	
+	// every length is checked against the block, as a checksum collision is not impossible
+	unsigned char *data = buffer + offset;
+	uint64_t left = length - offset;
+	if (left < MH_SNAP_RECORD_SIZE + MH_KLEN_SIZE) return fail( "Corrupt snapshot record" );
+	
+	record->flags = data[0];
+	memcpy( (void *)&record->expires, (void *)(data + 1), sizeof(uint32_t) );
+	memcpy( (void *)&record->keyLength, (void *)(data + MH_SNAP_RECORD_SIZE), MH_KLEN_SIZE );
+	
+	uint64_t size = MH_SNAP_RECORD_SIZE + MH_KLEN_SIZE + record->keyLength + MH_LEN_SIZE;
+	if (!record->keyLength || (left < size)) return fail( "Corrupt snapshot record" );
+	
+	record->key = data + MH_SNAP_RECORD_SIZE + MH_KLEN_SIZE;
+	memcpy( (void *)&record->contentLength, (void *)(record->key + record->keyLength), MH_LEN_SIZE );
+	
+	size += record->contentLength;
+	if (left < size) return fail( "Corrupt snapshot record" );
+	record->content = record->key + record->keyLength + MH_LEN_SIZE;
+	
+	offset += size;
+	numRecords--;
+	numKeys++;
+	return 1;
+}
+
+int SnapshotReader::nextBlock() {
+	// internal method: read and verify next block, return false at the end marker or on error
+	SnapshotBlock block;
+	if (!read( (void *)&block, sizeof(SnapshotBlock) )) return 0;
+	
+	if (!block.length) {
+		// end marker, make sure we got every key
+		if (block.numRecords || (block.checksum != numKeys)) return fail( "Corrupt snapshot end marker" );
+		done = 1;
+		return 0;
+	}
+	if (!block.numRecords) return fail( "Corrupt snapshot block" );
+	
+	if (block.length > capacity) {
+		unsigned char *newBuffer = (unsigned char *)realloc( (void *)buffer, block.length );
+		if (!newBuffer) return fail( "Out of memory" );
+		buffer = newBuffer;
+		capacity = block.length;
+	}
+	
+	if (!read( (void *)buffer, block.length )) return 0;
+	if (Hash::hashBytes(buffer, block.length) != block.checksum) return fail( "Snapshot checksum mismatch" );
+	
+	length = block.length;
+	offset = 0;
+	numRecords = block.numRecords;
+	return 1;
+}
+
+int SnapshotReader::read(void *data, uint64_t size) {
+	// internal method: read exactly size bytes, or fail
+	size_t count = fread( data, 1, size, fp );
+	numBytes += count;
+	if (count != size) {
+		if (ferror(fp)) return fail( "Failed to read snapshot file", errno );
+		return fail( "Snapshot file is truncated" );
+	}
+	return MH_OK;
+}
+
+int SnapshotReader::fail(const char *msg, int code) {
+	// internal method: record first error (with the OS error code, if any), return MH_ERR
+	if (error.empty()) {
+		error = msg;
+		if (code) error = error + ": " + strerror(code);
+	}
+	return MH_ERR;
+}
@@ -0,0 +1,186 @@
+// MegaCache v1.0
+// Copyright (c) 2023 Joseph Huckaby
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <chrono>
+#include "MegaCache.h"
+
+/** \name Snapshot file format:
+	A header, then blocks of records, then an empty block to mark the end.  All integers are in native byte order. */
+//@{
+/** Magic bytes at the start of every snapshot file. */
+#define MH_SNAP_MAGIC "MEGASNAP"
+/** Format version, bumped whenever the layout changes. */
+#define MH_SNAP_VERSION 1
+/** Target size of one block of records (a single record bigger than this gets a block of its own). */
+#define MH_SNAP_BLOCK_SIZE (1024 * 1024)
+/** Size of the record header: flags (1 byte) and expiration time (4 bytes), followed by the bucket blob. */
+#define MH_SNAP_RECORD_SIZE 5
+//@}
+
+class SnapshotHeader {
+public:
+	// start of the file, written once
+	char magic[8];
+	uint32_t version;
+	uint32_t blockSize;
+	uint64_t created; /**< Seconds since the epoch. */
+	uint64_t reserved;
+};
+
+class SnapshotBlock {
+public:
+	// header in front of every block of records
+	// the last block has zero length and no records, and its checksum field holds the total key count instead
+	uint32_t length; /**< Size of the record data that follows, in bytes. */
+	uint32_t numRecords;
+	uint64_t checksum; /**< Hash::hashBytes() of the record data. */
+};
+
+class SnapshotRecord {
+public:
+	// one key/value pair read back from a snapshot (pointers are into the reader's block buffer)
+	unsigned char flags;
+	uint32_t expires;
+	unsigned char *key;
+	MH_KLEN_T keyLength;
+	unsigned char *content;
+	MH_LEN_T contentLength;
+};
+
+class SnapshotResult {
+public:
+	// outcome of a save or load
+	unsigned char result; /**< MH_OK or MH_ERR. */
+	uint64_t numKeys; /**< Keys written or loaded. */
+	uint64_t numSkipped; /**< Keys left out: expired, or over the limits when loading. */
+	uint64_t numBytes; /**< Size of the snapshot file. */
+	uint64_t elapsed; /**< Total time, in nanoseconds. */
+	uint64_t pause; /**< Time the caller was blocked, in nanoseconds (all of it, unless saved in the background). */
+	std::string error;
+	
+	SnapshotResult() {
+		result = MH_ERR;
+		numKeys = 0;
+		numSkipped = 0;
+		numBytes = 0;
+		elapsed = 0;
+		pause = 0;
+	}
+};
+
+class SnapshotJob {
+public:
+	// background save in progress, started by ShardedHash::saveBegin() and finished by saveEnd(), then saveDone()
+	// on POSIX a forked child writes the file from its copy-on-write image of the cache, and reports back through a pipe
+	std::string path;
+	int pid;
+	int fd; /**< Read end of the pipe from the child. */
+	std::chrono::steady_clock::time_point start;
+	SnapshotResult result;
+	
+	SnapshotJob() {
+		pid = 0;
+		fd = -1;
+	}
+};
+
+class SnapshotWriter {
+public:
+	// streams buckets into a snapshot file, one checksummed block at a time
+	// writes to a temp file which close() renames into place, so a crash never leaves a partial snapshot behind
+	// after open(), only plain system calls are used (no stdio, and no malloc in a forked child), so a child forked
+	// from a multithreaded process can carry on with a writer its parent opened (see ShardedHash::saveBegin())
+	int fd;
+	std::string path;
+	std::string tempPath;
+	unsigned char *buffer;
+	uint64_t capacity;
+	uint64_t length;
+	uint32_t numRecords;
+	uint64_t numKeys;
+	uint64_t numBytes; /**< Total bytes written to the file so far. */
+	unsigned char forked; /**< Set in a forked child, so a huge record gets mapped pages instead of realloc(). */
+	unsigned char mapped; /**< Buffer was mapped, rather than allocated. */
+	const char *failure; /**< What went wrong (a static string), or NULL. */
+	int failCode; /**< OS error code that came with it, if any. */
+	
+	SnapshotWriter() {
+		fd = -1;
+		buffer = NULL;
+		capacity = 0;
+		length = 0;
+		numRecords = 0;
+		numKeys = 0;
+		numBytes = 0;
+		forked = 0;
+		mapped = 0;
+		failure = NULL;
+		failCode = 0;
+	}
+	
+	~SnapshotWriter() {
+		abort();
+		release();
+	}
+	
+	int open(const char *newPath);
+	int add(Hash *hash, Bucket *bucket);
+	int flush();
+	int close();
+	void abort();
+	void detach();
+	std::string errorString() { return describe( failure, failCode ); }
+	static std::string describe(const char *msg, int code);
+	
+	// internal methods:
+	int grow(uint64_t size);
+	void release();
+	int write(void *data, uint64_t size);
+	int fail(const char *msg, int code = 0);
+};
+
+class SnapshotReader {
+public:
+	// reads a snapshot back one record at a time, verifying each block checksum before handing out its records
+	FILE *fp;
+	unsigned char *buffer;
+	uint64_t capacity;
+	uint64_t length;
+	uint64_t offset;
+	uint32_t numRecords; /**< Records left in the current block. */
+	uint64_t numKeys;
+	uint64_t numBytes; /**< Total bytes read from the file so far. */
+	int done;
+	std::string error;
+	
+	SnapshotReader() {
+		fp = NULL;
+		buffer = NULL;
+		capacity = 0;
+		length = 0;
+		offset = 0;
+		numRecords = 0;
+		numKeys = 0;
+		numBytes = 0;
+		done = 0;
+	}
+	
+	~SnapshotReader() {
+		if (fp) fclose( fp );
+		if (buffer) free( (void *)buffer );
+	}
+	
+	int open(const char *path);
+	int next(SnapshotRecord *record);
+	
+	// internal methods:
+	int nextBlock();
+	int read(void *data, uint64_t size);
+	int fail(const char *msg, int code = 0);
+};
+
+#endif
@@ -0,0 +1,793 @@
+// Benchmarks for MegaCache
+// Copyright (c) 2023 Joseph Huckaby
+
+// Run via: npm run bench [-- NUM_KEYS]
+
+const MegaCache = require('./');
+const { Worker, isMainThread, parentPort, workerData } = require('worker_threads');
+
+if (!isMainThread) {
+	// worker thread for the threads benchmark: wait for the starting gun, then mix gets and sets
+	var cache = new MegaCache( 0, 0, { name: workerData.name } );
+	var gate = new Int32Array( workerData.gate );
+	var value = Buffer.alloc(64);
+	var numKeys = workerData.numKeys;
+	var seed = workerData.id + 1;
+	
+	Atomics.add( gate, 1, 1 );
+	parentPort.postMessage( 'ready' );
+	Atomics.wait( gate, 0, 0 );
+	
+	for (var idx = 0; idx < workerData.numOps; idx++) {
+		seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+		if ((idx % 100) < workerData.readPct) cache.get( "key" + (seed % numKeys) );
+		else cache.set( "key" + (seed % numKeys), value );
+	}
+	parentPort.postMessage( 'done' );
+	return;
+}
+
+var numKeys = parseInt( process.argv[2] || '1000000', 10 );
+
+// lookups in flight for interleaved lookups (MH_LOOKUP_GROUP)
+var MH_LOOKUP_GROUP = 16;
+
+function now() {
+	// high resolution time in seconds
+	var t = process.hrtime();
+	return t[0] + (t[1] / 1e9);
+}
+
+function report(name, count, elapsed) {
+	// print ops/sec for one benchmark
+	var opsSec = Math.floor( count / elapsed );
+	console.log( name + ": " + opsSec.toLocaleString() + " ops/sec (" + count.toLocaleString() + " ops in " + elapsed.toFixed(3) + " sec)" );
+}
+
+function bench(name, count, func) {
+	// run one benchmark function count times
+	var start = now();
+	for (var idx = 0; idx < count; idx++) func(idx);
+	report( name, count, now() - start );
+}
+
+function benchThreads(shards, numThreads, readPct) {
+	// run one multi-threaded benchmark, resolve when all threads are done
+	var name = "bench-threads-" + shards;
+	var cache = new MegaCache( 0, 0, { name: name, shards: shards } );
+	var value = Buffer.alloc(64);
+	for (var idx = 0; idx < numKeys; idx++) cache.set( "key" + idx, value );
+	
+	var gate = new Int32Array( new SharedArrayBuffer(8) );
+	var numOps = Math.floor( numKeys / numThreads );
+	var numReady = 0, numDone = 0, numExited = 0, start = 0;
+	
+	return new Promise( function(resolve) {
+		for (var idx = 0; idx < numThreads; idx++) {
+			var worker = new Worker( __filename, { workerData: { id: idx, name: name, gate: gate.buffer, numKeys: numKeys, numOps: numOps, readPct: readPct } } );
+			worker.on('message', function(msg) {
+				if ((msg == 'ready') && (++numReady == numThreads)) {
+					// all threads are waiting, fire the starting gun
+					start = now();
+					Atomics.store( gate, 0, 1 );
+					Atomics.notify( gate, 0 );
+				}
+				else if ((msg == 'done') && (++numDone == numThreads)) {
+					report( readPct + "% get, " + shards + " shard" + ((shards > 1) ? "s" : "") + ", " + numThreads + " thread" + ((numThreads > 1) ? "s" : ""), numOps * numThreads, now() - start );
+				}
+			});
+			worker.on('exit', function() {
+				if (++numExited == numThreads) { cache.clear(); resolve(); }
+			});
+		}
+	} );
+}
+
+function zipfTrace(numItems, skew, length) {
+	// generate array of item numbers (0 = most popular) following a Zipf distribution
+	var cdf = new Float64Array( numItems );
+	var total = 0;
+	for (var idx = 0; idx < numItems; idx++) {
+		total += 1 / Math.pow( idx + 1, skew );
+		cdf[idx] = total;
+	}
+	
+	var trace = new Uint32Array( length );
+	for (var idx = 0; idx < length; idx++) {
+		var target = Math.random() * total;
+		var low = 0, high = numItems - 1;
+		while (low < high) {
+			var mid = (low + high) >> 1;
+			if (cdf[mid] < target) low = mid + 1; else high = mid;
+		}
+		trace[idx] = low;
+	}
+	return trace;
+}
+
+function scanTrace(trace, numItems, scanLength, every) {
+	// mix one-time sequential scans into a trace: after every `every` items, scanLength new never-repeated items
+	var result = [];
+	var next = numItems;
+	for (var idx = 0; idx < trace.length; idx++) {
+		result.push( trace[idx] );
+		if ((idx + 1) % every == 0) {
+			for (var idy = 0; idy < scanLength; idy++) result.push( next++ );
+		}
+	}
+	return { trace: result, numItems: next };
+}
+
+function hitRatio(cache, keys, trace, value) {
+	// replay trace as a read-through cache: get, and set on miss, report hit ratio and ops/sec
+	var hits = 0;
+	var start = now();
+	for (var idx = 0, len = trace.length; idx < len; idx++) {
+		var key = keys[ trace[idx] ];
+		if (cache.get(key) !== undefined) hits++;
+		else cache.set( key, value );
+	}
+	var elapsed = now() - start;
+	return { hits: hits / trace.length, opsSec: Math.floor(trace.length / elapsed) };
+}
+
+var benchmarks = {
+	
+	basic: function() {
+		// insert, hit, miss and delete throughput, plus index shape
+		var cache = new MegaCache();
+		var value = Buffer.from("value here");
+		var keys = [];
+		for (var idx = 0; idx < numKeys; idx++) keys.push( Buffer.from("key" + idx) );
+		
+		bench( "insert", numKeys, function(idx) { cache.set( keys[idx], value ); } );
+		bench( "get hit", numKeys, function(idx) { cache.get( keys[idx] ); } );
+		bench( "get miss", numKeys, function(idx) { cache.has( "miss" + idx ); } );
+		
+		var stats = cache.stats();
+		console.log( "keys per index: " + (stats.numKeys / stats.numIndexes).toFixed(2) + ", overhead per key: " + ((stats.indexSize + stats.metaSize) / stats.numKeys).toFixed(2) + " bytes" );
+		console.log( JSON.stringify(stats) );
+		
+		bench( "delete", numKeys, function(idx) { cache.delete( keys[idx] ); } );
+	},
+	
+	overwrite: function() {
+		// replace existing keys with same-size values (reused in place)
+		var cache = new MegaCache();
+		var keys = [];
+		for (var idx = 0; idx < numKeys; idx++) {
+			keys.push( Buffer.from("key" + idx) );
+			cache.set( keys[idx], idx );
+		}
+		
+		bench( "overwrite number", numKeys, function(idx) { cache.set( keys[idx], idx + 1 ); } );
+		
+		var value = Buffer.alloc(100);
+		bench( "overwrite 100 bytes", numKeys, function(idx) { cache.set( keys[idx], value ); } );
+		bench( "overwrite 100 bytes again", numKeys, function(idx) { cache.set( keys[idx], value ); } );
+	},
+	
+	churn: function() {
+		// steady-state eviction at the maxBytes limit, with mixed value sizes
+		var maxBytes = 64 * 1024 * 1024;
+		var cache = new MegaCache( 0, maxBytes );
+		var values = [];
+		for (var idx = 0; idx < 64; idx++) values.push( Buffer.alloc(16 + (idx * 16)) );
+		
+		bench( "set at limit", numKeys, function(idx) { cache.set( "churn" + idx, values[idx % 64] ); } );
+		
+		var stats = cache.stats();
+		console.log( "evictions: " + stats.numEvictions + ", arenaSize: " + stats.arenaSize + ", fragmentation: " + (stats.fragmentation * 100).toFixed(1) + "%" );
+		
+		var start = now();
+		cache.clear();
+		console.log( "clear: " + ((now() - start) * 1000).toFixed(3) + " ms" );
+		
+		// the value size mix shifts, so memory freed in one size class has to make its way to others
+		[ [16, 1016], [16, 128], [2000, 8000], [16, 1016] ].forEach( function(range, phase) {
+			var mix = [];
+			for (var idx = 0; idx < 64; idx++) mix.push( Buffer.alloc(range[0] + Math.floor((range[1] - range[0]) * idx / 64)) );
+			
+			bench( "set at limit, " + range[0] + ".." + range[1] + " bytes", numKeys, function(idx) { cache.set( "phase" + phase + ":" + idx, mix[idx % 64] ); } );
+			stats = cache.stats();
+			console.log( "stored: " + ((stats.dataSize + stats.metaSize + stats.indexSize) / 1048576).toFixed(1) + " MB, arenaSize: " + (stats.arenaSize / 1048576).toFixed(1) + " MB" );
+		} );
+		cache.clear();
+		
+		// steady-state eviction at the maxKeys limit, with long keys
+		var maxKeys = Math.max( 1, Math.floor(numKeys / 10) );
+		cache = new MegaCache( maxKeys );
+		var prefix = "tenant:00000000-0000-0000-0000-000000000000:session:";
+		var value = Buffer.alloc(16);
+		for (var idx = 0; idx < maxKeys; idx++) cache.set( prefix + "fill" + idx, value );
+		
+		bench( "set at key limit", numKeys, function(idx) { cache.set( prefix + idx, value ); } );
+		console.log( "evictions: " + cache.stats().numEvictions );
+	},
+	
+	watermark: function() {
+		// set latency at the maxKeys limit, evicting one key per set vs. in batches
+		var maxKeys = Math.max( 1, Math.floor(numKeys / 10) );
+		var value = Buffer.alloc(64);
+		
+		[100, 99, 90].forEach( function(lowWater) {
+			var cache = new MegaCache( maxKeys, 0, { lowWater: lowWater } );
+			for (var idx = 0; idx < maxKeys; idx++) cache.set( "fill" + idx, value );
+			
+			var times = new Float64Array( numKeys );
+			var start = now();
+			for (var idx = 0; idx < numKeys; idx++) {
+				var t = process.hrtime.bigint();
+				cache.set( "key" + idx, value );
+				times[idx] = Number(process.hrtime.bigint() - t);
+			}
+			var elapsed = now() - start;
+			
+			times.sort();
+			var stats = cache.stats();
+			report( "set at lowWater " + lowWater, numKeys, elapsed );
+			console.log( "p50: " + times[ Math.floor(numKeys * 0.5) ] + " ns, p99: " + times[ Math.floor(numKeys * 0.99) ] + " ns, max: " + times[numKeys - 1] + " ns, batches: " + stats.evictionBatches + ", eviction time: " + stats.evictionTime.toFixed(1) + " ms" );
+		} );
+		
+		// set latency at the maxBytes limit, where 1 in 50 values is 32 KB, so storing one evicts a couple hundred small keys
+		// with deferEvict, that work moves out of set() and into evict() calls made in between (like on idle ticks)
+		var small = Buffer.alloc(100);
+		var large = Buffer.alloc(32768);
+		var maxBytes = Math.max( 1, Math.floor(numKeys / 10) ) * 1024;
+		
+		[ { lowWater: 100 }, { lowWater: 90 }, { lowWater: 90, deferEvict: true } ].forEach( function(opts) {
+			var cache = new MegaCache( 0, maxBytes, opts );
+			for (var idx = 0; idx < maxBytes / small.length; idx++) cache.set( "fill" + idx, small );
+			cache.evict();
+			
+			var times = new Float64Array( numKeys );
+			var evictTime = 0;
+			var start = now();
+			for (var idx = 0; idx < numKeys; idx++) {
+				var t = process.hrtime.bigint();
+				cache.set( "key" + idx, (idx % 50) ? small : large );
+				times[idx] = Number(process.hrtime.bigint() - t);
+				
+				if (opts.deferEvict && !(idx % 100)) {
+					t = process.hrtime.bigint();
+					cache.evict( 10000 );
+					evictTime += Number(process.hrtime.bigint() - t);
+				}
+			}
+			var elapsed = now() - start;
+			
+			times.sort();
+			var stats = cache.stats();
+			var name = "set at byte limit, lowWater " + opts.lowWater + (opts.deferEvict ? ", deferred" : "");
+			report( name, numKeys, elapsed );
+			console.log( "p50: " + times[ Math.floor(numKeys * 0.5) ] + " ns, p99: " + times[ Math.floor(numKeys * 0.99) ] + " ns, p99.9: " + times[ Math.floor(numKeys * 0.999) ] + " ns, max: " + times[numKeys - 1] + " ns, evictions: " + stats.numEvictions + (opts.deferEvict ? ", evict() calls: " + (evictTime / 1000000).toFixed(1) + " ms" : "") );
+		} );
+	},
+	
+	policy: function() {
+		// hit ratio and throughput of each eviction policy, on Zipfian traces (cache holds 10% of the keys)
+		// then the same traces with one-time scans mixed in (about 1/3 of all requests)
+		var maxKeys = Math.max( 1, Math.floor(numKeys / 10) );
+		var value = Buffer.alloc(64);
+		var policies = ['lru', 'clock', 'tinylfu'];
+		
+		[0.8, 0.99, 1.2].forEach( function(skew) {
+			var trace = zipfTrace( numKeys, skew, numKeys * 2 );
+			var scan = scanTrace( trace, numKeys, maxKeys, maxKeys * 2 );
+			
+			[ { name: "zipf " + skew, trace: trace, numItems: numKeys }, { name: "zipf " + skew + " + scans", trace: scan.trace, numItems: scan.numItems } ].forEach( function(run) {
+				var keys = [];
+				for (var idx = 0; idx < run.numItems; idx++) keys.push( "key" + idx );
+				
+				policies.forEach( function(policy) {
+					var result = hitRatio( new MegaCache( maxKeys, 0, { policy: policy } ), keys, run.trace, value );
+					console.log( run.name + ", " + policy + ": " + (result.hits * 100).toFixed(2) + "% hits, " + result.opsSec.toLocaleString() + " ops/sec" );
+				} );
+			} );
+		} );
+	},
+	
+	ttl: function() {
+		// set throughput with a TTL, then reap all keys once they expire, in bounded steps
+		var cache = new MegaCache();
+		var value = Buffer.alloc(64);
+		var keys = [];
+		for (var idx = 0; idx < numKeys; idx++) keys.push( Buffer.from("key" + idx) );
+		
+		var plain = new MegaCache();
+		bench( "set without ttl", numKeys, function(idx) { plain.set( keys[idx], value ); } );
+		plain.clear();
+		
+		bench( "set with ttl", numKeys, function(idx) { cache.set( keys[idx], value, 1 ); } );
+		console.log( "timerSize: " + cache.stats().timerSize + " bytes" );
+		
+		return new Promise( function(resolve) {
+			setTimeout( function() {
+				var budget = 10000, calls = 0, total = 0, worst = 0, start = now();
+				
+				while (cache.stats().numKeys) {
+					var t = now();
+					total += cache.expire( budget );
+					worst = Math.max( worst, now() - t );
+					calls++;
+				}
+				
+				report( "expire", total, now() - start );
+				console.log( calls + " calls of " + budget + ", slowest: " + (worst * 1000).toFixed(3) + " ms, expiredBytes: " + cache.stats().expiredBytes );
+				resolve();
+			}, 1100 );
+		} );
+	},
+	
+	batch: function() {
+		// per-key cost of getMany() / setMany() at batch sizes 1 to 1024, vs. one call per key (64 byte string values)
+		// once with a hot working set of 10,000 keys (all in CPU cache, so this is mostly call overhead), then across all keys
+		var cache = new MegaCache();
+		var value = "X".repeat(64);
+		var keys = [];
+		for (var idx = 0; idx < numKeys; idx++) {
+			keys.push( "key" + idx );
+			cache.set( keys[idx], value );
+		}
+		
+		[Math.min(10000, numKeys), numKeys].forEach( function(range) {
+			// random keys from the range, same sequence for every batch size
+			var numOps = Math.max( numKeys, 1000000 );
+			var trace = [];
+			for (var idx = 0; idx < numOps; idx++) trace.push( keys[ Math.floor(Math.random() * range) ] );
+			
+			var start = now();
+			for (var idx = 0; idx < numOps; idx++) cache.get( trace[idx] );
+			var getTime = (now() - start) / numOps;
+			
+			start = now();
+			for (var idx = 0; idx < numOps; idx++) cache.set( trace[idx], value );
+			var setTime = (now() - start) / numOps;
+			console.log( range.toLocaleString() + " keys, single calls: get " + (getTime * 1e9).toFixed(0) + " ns/key, set " + (setTime * 1e9).toFixed(0) + " ns/key" );
+			
+			[1, 4, 16, 64, 256, 1024].forEach( function(size) {
+				var batches = [];
+				for (var idx = 0; idx + size <= numOps; idx += size) batches.push( trace.slice(idx, idx + size) );
+				var entries = batches.map( function(batch) { return batch.map( function(key) { return [ key, value ]; } ); } );
+				var count = batches.length * size;
+				
+				var start = now();
+				for (var idx = 0; idx < batches.length; idx++) cache.getMany( batches[idx] );
+				var getTime = (now() - start) / count;
+				
+				start = now();
+				for (var idx = 0; idx < entries.length; idx++) cache.setMany( entries[idx] );
+				var setTime = (now() - start) / count;
+				console.log( range.toLocaleString() + " keys, batch " + size + ": getMany " + (getTime * 1e9).toFixed(0) + " ns/key, setMany " + (setTime * 1e9).toFixed(0) + " ns/key" );
+			} );
+		} );
+	},
+	
+	lookup: function() {
+		// native lookup cost only (no N-API crossing or copying): serial walk vs. interleaved lookups with N keys in flight
+		// nodes/lookup is the number of index nodes and buckets each lookup visits, i.e. its dependent loads,
+		// every one of which is a potential cache miss, taken one after another by the serial walk, but overlapped when interleaved
+		var cache = new MegaCache();
+		var value = "X".repeat(64);
+		for (var idx = 0; idx < numKeys; idx++) cache.set( "key" + idx, value );
+		
+		// random keys, packed up front in batches of 1024
+		var batches = [];
+		var numOps = Math.max( numKeys, 1000000 );
+		for (var idx = 0; idx < numOps; idx += 1024) {
+			var keys = [];
+			for (var num = 0; num < 1024; num++) keys.push( Buffer.from("key" + Math.floor(Math.random() * numKeys)) );
+			var packed = Buffer.alloc( keys.reduce( function(total, key) { return total + 4 + key.length; }, 0 ) );
+			var offset = 0;
+			keys.forEach( function(key) {
+				packed.writeUInt32LE( key.length, offset );
+				offset += 4 + key.copy( packed, offset + 4 );
+			} );
+			batches.push( packed );
+		}
+		var count = batches.length * 1024;
+		
+		[0, 1, 2, 4, 8, 16, 32].forEach( function(group) {
+			var elapsed = 0, steps = 0, found = 0;
+			batches.forEach( function(packed) {
+				var result = cache._benchLookups( packed, group );
+				elapsed += result[0];
+				steps += result[1];
+				found += result[2];
+			} );
+			if (found != count) throw new Error("Lookups missed: " + (count - found));
+			
+			var label = group ? ("interleaved, " + group + " in flight") : "serial walk";
+			var extra = group ? (", " + (steps / count).toFixed(2) + " nodes/lookup") : "";
+			console.log( label + ": " + (elapsed / count).toFixed(0) + " ns/lookup" + extra );
+		} );
+	},
+	
+	index: function() {
+		// index fan-out: depth, memory per key and lookup latency (serial walk and interleaved) for several layouts
+		// depth counts the index levels a lookup goes through, nodes adds the buckets it checks at the bottom
+		var layouts = [
+			{ rootFanout: 16, fanout: 16 },
+			{ rootFanout: 256, fanout: 16 },
+			{ rootFanout: 256, fanout: 32 },
+			{ rootFanout: 64, fanout: 64 },
+			{ rootFanout: 256, fanout: 64 },
+			{ rootFanout: 256, fanout: 256 }
+		];
+		var value = "X".repeat(64);
+		
+		// random keys, packed up front in batches of 1024
+		var batches = [];
+		var numOps = Math.min( numKeys, 1000000 );
+		for (var idx = 0; idx < numOps; idx += 1024) {
+			var keys = [];
+			for (var num = 0; num < 1024; num++) keys.push( Buffer.from("key" + Math.floor(Math.random() * numKeys)) );
+			var packed = Buffer.alloc( keys.reduce( function(total, key) { return total + 4 + key.length; }, 0 ) );
+			var offset = 0;
+			keys.forEach( function(key) {
+				packed.writeUInt32LE( key.length, offset );
+				offset += 4 + key.copy( packed, offset + 4 );
+			} );
+			batches.push( packed );
+		}
+		var count = batches.length * 1024;
+		
+		layouts.forEach( function(layout) {
+			var cache = new MegaCache( 0, 0, layout );
+			for (var idx = 0; idx < numKeys; idx++) cache.set( "key" + idx, value );
+			var stats = cache.stats();
+			
+			var times = {}, steps = 0, levels = 0;
+			[0, MH_LOOKUP_GROUP].forEach( function(group) {
+				var elapsed = 0;
+				batches.forEach( function(packed) {
+					var result = cache._benchLookups( packed, group );
+					elapsed += result[0];
+					if (group) {
+						steps += result[1];
+						levels += result[3];
+					}
+				} );
+				times[group] = elapsed / count;
+			} );
+			
+			console.log( layout.rootFanout + "/" + layout.fanout + " slots: " + 
+				"depth " + (levels / count).toFixed(2) + ", " + 
+				"nodes " + (steps / count).toFixed(2) + "/lookup, " + 
+				"index " + (stats.indexSize / numKeys).toFixed(1) + " bytes/key (" + stats.numIndexes.toLocaleString() + " indexes), " + 
+				"serial " + times[0].toFixed(0) + " ns, " + 
+				"interleaved " + times[MH_LOOKUP_GROUP].toFixed(0) + " ns" 
+			);
+			cache.close();
+		} );
+	},
+	
+	engine: function() {
+		// trie vs. flat table: insert, hit, miss, delete then reinsert (tombstones), and index memory per key
+		var value = "X".repeat(64);
+		var numOps = Math.min( numKeys, 1000000 );
+		
+		// random hit and miss keys, packed up front in batches of 1024
+		var hits = [], misses = [];
+		for (var idx = 0; idx < numOps; idx += 1024) {
+			[hits, misses].forEach( function(batches) {
+				var keys = [];
+				for (var num = 0; num < 1024; num++) {
+					var id = Math.floor(Math.random() * numKeys);
+					keys.push( Buffer.from((batches === hits) ? ("key" + id) : ("nokey" + id)) );
+				}
+				var packed = Buffer.alloc( keys.reduce( function(total, key) { return total + 4 + key.length; }, 0 ) );
+				var offset = 0;
+				keys.forEach( function(key) {
+					packed.writeUInt32LE( key.length, offset );
+					offset += 4 + key.copy( packed, offset + 4 );
+				} );
+				batches.push( packed );
+			} );
+		}
+		var count = hits.length * 1024;
+		
+		["trie", "table"].forEach( function(engine) {
+			var cache = new MegaCache( 0, 0, { engine: engine } );
+			var start = now();
+			for (var idx = 0; idx < numKeys; idx++) cache.set( "key" + idx, value );
+			var insert = (now() - start) / numKeys;
+			var stats = cache.stats();
+			
+			var times = [];
+			[hits, misses].forEach( function(batches) {
+				[0, MH_LOOKUP_GROUP].forEach( function(group) {
+					var elapsed = 0;
+					batches.forEach( function(packed) { elapsed += cache._benchLookups( packed, group )[0]; } );
+					times.push( elapsed / count );
+				} );
+			} );
+			
+			start = now();
+			for (idx = 0; idx < numKeys; idx += 2) cache.delete( "key" + idx );
+			for (idx = 0; idx < numKeys; idx += 2) cache.set( "key" + idx, value );
+			var churn = (now() - start) / numKeys;
+			
+			console.log( engine + ": " +
+				"index " + (stats.indexSize / numKeys).toFixed(1) + " bytes/key, " +
+				"insert " + (insert * 1e9).toFixed(0) + " ns, " +
+				"hit " + times[0].toFixed(0) + "/" + times[1].toFixed(0) + " ns, " +
+				"miss " + times[2].toFixed(0) + "/" + times[3].toFixed(0) + " ns (serial/interleaved), " +
+				"delete+reinsert " + (churn * 1e9).toFixed(0) + " ns, " +
+				"rebuilds " + cache.stats().numRebuilds
+			);
+			cache.close();
+		} );
+	},
+	
+	small: function() {
+		// memory per key for tiny values (8 to 64 bytes, with 10 to 13 byte keys), and get/set speed
+		[8, 16, 32, 64].forEach( function(size) {
+			var cache = new MegaCache();
+			var value = Buffer.alloc(size);
+			for (var idx = 0; idx < numKeys; idx++) cache.set( "key" + (1000000 + idx), value );
+			
+			var stats = cache.stats();
+			console.log( size + " byte values: " +
+				"meta " + (stats.metaSize / numKeys).toFixed(1) + " bytes/key, " +
+				"arena " + (stats.arenaUsed / numKeys).toFixed(1) + " bytes/key used, " +
+				(stats.arenaSize / numKeys).toFixed(1) + " bytes/key resident"
+			);
+			bench( "get " + size + " bytes", numKeys, function(idx) { cache.get( "key" + (1000000 + idx) ); } );
+			bench( "overwrite " + size + " bytes", numKeys, function(idx) { cache.set( "key" + (1000000 + idx), value ); } );
+			cache.clear();
+		} );
+	},
+	
+	accounting: function() {
+		// how far the real footprint goes past maxBytes with each accounting mode (64 MB limit, 1 to 64 byte values)
+		var maxBytes = 64 * 1024 * 1024;
+		var values = [];
+		for (var idx = 0; idx < 64; idx++) values.push( Buffer.alloc(idx + 1) );
+		
+		["data", "arena"].forEach( function(accounting) {
+			var cache = new MegaCache( 0, maxBytes, { accounting: accounting } );
+			for (var idx = 0; idx < numKeys; idx++) cache.set( "key" + idx, values[idx % 64] );
+			
+			var stats = cache.stats();
+			console.log( accounting + ": " + stats.numKeys.toLocaleString() + " keys, " +
+				"used " + (stats.arenaUsed / 1048576).toFixed(1) + " MB, " +
+				"resident " + (stats.arenaSize / 1048576).toFixed(1) + " MB " +
+				"(" + (((stats.arenaSize / maxBytes) - 1) * 100).toFixed(1) + "% over maxBytes)"
+			);
+			cache.clear();
+		} );
+		
+		// shrinking at runtime, timing the longest pause between event loop turns
+		var cache = new MegaCache();
+		for (var idx = 0; idx < numKeys; idx++) cache.set( "key" + idx, values[idx % 64] );
+		
+		var last = now(), lag = 0, start = now();
+		var timer = setInterval( function() {
+			lag = Math.max( lag, now() - last );
+			last = now();
+		}, 1 );
+		
+		return cache.setLimits( Math.floor(numKeys / 10) ).then( function(count) {
+			clearInterval( timer );
+			console.log( "setLimits: " + count.toLocaleString() + " keys evicted in " + (now() - start).toFixed(3) + " sec, max event loop lag: " + (lag * 1000).toFixed(3) + " ms" );
+		} );
+	},
+	
+	clear: function() {
+		// pause for clearing a full cache (100 byte values, half with a TTL), all at once, in 256 slices, and with clearAsync()
+		var value = Buffer.alloc(100);
+		var cache = new MegaCache();
+		var fill = function() {
+			for (var idx = 0; idx < numKeys; idx++) cache.set( "key" + idx, value, (idx % 2) ? 3600 : 0 );
+		};
+		
+		fill();
+		var start = now();
+		cache.clear();
+		console.log( "clear: " + ((now() - start) * 1000).toFixed(3) + " ms" );
+		
+		fill();
+		var longest = 0;
+		start = now();
+		for (var slice = 0; slice < 256; slice++) {
+			var sliceStart = now();
+			cache.clear( slice );
+			longest = Math.max( longest, now() - sliceStart );
+		}
+		console.log( "clear(slice) x 256: " + ((now() - start) * 1000).toFixed(3) + " ms, longest slice: " + (longest * 1000).toFixed(3) + " ms" );
+		
+		fill();
+		var last = now(), lag = 0;
+		var timer = setInterval( function() {
+			lag = Math.max( lag, now() - last );
+			last = now();
+		}, 1 );
+		
+		return cache.clearAsync().then( function(info) {
+			clearInterval( timer );
+			console.log( "clearAsync: " + info.numKeys.toLocaleString() + " keys, " + (info.numBytes / 1048576).toFixed(1) + " MB freed in " + info.elapsed.toFixed(3) + " ms, pause: " + info.pause.toFixed(3) + " ms, max event loop lag: " + (lag * 1000).toFixed(3) + " ms" );
+		} );
+	},
+	
+	deleteWhere: function() {
+		// invalidate one tenant out of 100 (100 byte values), with nextKey() + delete() vs. deleteWhere()
+		var value = Buffer.alloc(100);
+		var cache = new MegaCache();
+		var fill = function() {
+			for (var idx = 0; idx < numKeys; idx++) cache.set( "tenant" + (idx % 100) + ":" + idx, value );
+		};
+		
+		fill();
+		var start = now();
+		var matches = [];
+		for (var key = cache.nextKey(); key !== undefined; key = cache.nextKey(key)) {
+			if (key.startsWith("tenant42:")) matches.push( key );
+		}
+		matches.forEach( function(key) { cache.delete( key ); } );
+		console.log( "nextKey + delete: " + matches.length.toLocaleString() + " keys in " + ((now() - start) * 1000).toFixed(3) + " ms (blocking)" );
+		
+		cache.clear();
+		fill();
+		var last = now(), lag = 0;
+		var timer = setInterval( function() {
+			lag = Math.max( lag, now() - last );
+			last = now();
+		}, 1 );
+		
+		return cache.deleteWhere({ prefix: "tenant42:" }).then( function(info) {
+			clearInterval( timer );
+			console.log( "deleteWhere: " + info.numKeys.toLocaleString() + " keys, " + (info.numBytes / 1048576).toFixed(1) + " MB in " + info.elapsed.toFixed(3) + " ms, max event loop lag: " + (lag * 1000).toFixed(3) + " ms" );
+		} );
+	},
+	
+	iterate: function() {
+		// full scan in LRU order (16 byte values): nextKey() vs. the batched iterator, keys only and with values
+		var cache = new MegaCache();
+		var value = Buffer.alloc(16);
+		for (var idx = 0; idx < numKeys; idx++) cache.set( "key" + idx, value );
+		
+		var start = now();
+		var count = 0;
+		for (var key = cache.nextKey(); key !== undefined; key = cache.nextKey(key)) count++;
+		report( "nextKey", count, now() - start );
+		
+		start = now();
+		count = 0;
+		for (key of cache.iterator()) count++;
+		report( "iterator (keys)", count, now() - start );
+		
+		start = now();
+		count = 0;
+		for (var pair of cache.iterator({ values: true })) count++;
+		report( "iterator (keys + values)", count, now() - start );
+		cache.close();
+	},
+	
+	instrument: function() {
+		// cost of instrument() on get/set (64 byte values), off vs. sampled vs. timing every op, then the stats it gathered
+		var cache = new MegaCache();
+		var value = Buffer.alloc(64);
+		for (var idx = 0; idx < numKeys; idx++) cache.set( "key" + idx, value );
+		
+		[ false, true, { sample: 1 } ].forEach( function(opts) {
+			cache.instrument( opts );
+			var label = (opts === false) ? "off" : ((opts === true) ? "sampled" : "every op");
+			bench( "get (" + label + ")", numKeys, function(idx) { cache.get( "key" + idx ); } );
+			bench( "set (" + label + ")", numKeys, function(idx) { cache.set( "key" + idx, value ); } );
+		} );
+		
+		var stats = cache.stats();
+		[ 'get', 'set' ].forEach( function(op) {
+			var info = stats.latency[op];
+			console.log( op + " latency: p50 " + info.p50.toFixed(3) + " µs, p99 " + info.p99.toFixed(3) + " µs, p99.9 " + info.p999.toFixed(3) + " µs, max " + info.max.toFixed(3) + " µs" );
+		} );
+		
+		var start = now();
+		var shape = cache.stats({ shape: true }).shape;
+		console.log( "shape: depths " + JSON.stringify(shape.depths) + ", max chain " + shape.maxChain + ", in " + ((now() - start) * 1000).toFixed(3) + " ms" );
+		cache.close();
+	},
+	
+	view: function() {
+		// get() vs. zero-copy getView() across value sizes (at most 256 MB of values, and 4 GB read per run)
+		[1024, 4096, 16384, 65536, 1048576, 4194304].forEach( function(size) {
+			var cache = new MegaCache();
+			var value = Buffer.alloc(size);
+			var numValues = Math.min( numKeys, Math.floor((256 * 1048576) / size) );
+			var numOps = Math.min( numKeys, Math.floor((4096 * 1048576) / size) );
+			for (var idx = 0; idx < numValues; idx++) cache.set( "key" + idx, value );
+			
+			var label = (size >= 1048576) ? ((size / 1048576) + " MB") : ((size / 1024) + " KB");
+			bench( "get " + label, numOps, function(idx) { cache.get( "key" + (idx % numValues) ); } );
+			bench( "getView " + label, numOps, function(idx) { cache.getView( "key" + (idx % numValues) ); } );
+		} );
+	},
+	
+	snapshot: function() {
+		// save a full cache to disk, then load it into an empty one (100 byte values)
+		// then save it again in the background, while timing the event loop
+		var file = require('path').join( require('os').tmpdir(), 'megacache-bench.snap' );
+		var cache = new MegaCache();
+		var value = Buffer.alloc(100);
+		for (var idx = 0; idx < numKeys; idx++) cache.set( "key" + idx, value );
+		
+		var info = cache.save( file );
+		var mb = info.numBytes / (1024 * 1024);
+		console.log( "save: " + info.numKeys.toLocaleString() + " keys, " + mb.toFixed(1) + " MB in " + (info.elapsed / 1000).toFixed(3) + " sec (" + (mb / (info.elapsed / 1000)).toFixed(1) + " MB/sec)" );
+		
+		var copy = new MegaCache();
+		info = copy.load( file );
+		console.log( "load: " + info.numKeys.toLocaleString() + " keys, " + mb.toFixed(1) + " MB in " + (info.elapsed / 1000).toFixed(3) + " sec (" + (mb / (info.elapsed / 1000)).toFixed(1) + " MB/sec)" );
+		copy.clear();
+		
+		var last = now(), lag = 0;
+		var timer = setInterval( function() {
+			lag = Math.max( lag, now() - last );
+			last = now();
+		}, 1 );
+		
+		return cache.saveAsync( file ).then( function(info) {
+			clearInterval( timer );
+			console.log( "saveAsync: " + info.numKeys.toLocaleString() + " keys, " + mb.toFixed(1) + " MB in " + (info.elapsed / 1000).toFixed(3) + " sec, pause: " + info.pause.toFixed(3) + " ms, max event loop lag: " + (lag * 1000).toFixed(3) + " ms" );
+			require('fs').unlinkSync( file );
+		} );
+	},
+	
+	persist: function() {
+		// fill a cache file, close it, then time the reopen and the first few reads (100 byte values)
+		// the file is still in the page cache here, so this is a warm restart
+		var file = require('path').join( require('os').tmpdir(), 'megacache-bench.cache' );
+		var value = Buffer.alloc(100);
+		var cache = new MegaCache( 0, 0, { file: file } );
+		for (var idx = 0; idx < numKeys; idx++) cache.set( "key" + idx, value );
+		
+		var mb = cache.stats().fileSize / (1024 * 1024);
+		var start = now();
+		cache.close();
+		console.log( "close: " + mb.toFixed(1) + " MB file synced in " + (now() - start).toFixed(3) + " sec" );
+		
+		start = now();
+		cache = new MegaCache( 0, 0, { file: file } );
+		var elapsed = now() - start;
+		console.log( "open: " + cache.stats().numKeys.toLocaleString() + " keys restored in " + (elapsed * 1000).toFixed(3) + " ms" );
+		
+		start = now();
+		for (idx = 0; idx < 1000; idx++) cache.get( "key" + Math.floor(Math.random() * numKeys) );
+		elapsed = now() - start;
+		console.log( "first 1,000 gets: " + ((elapsed / 1000) * 1000000).toFixed(3) + " µs/get" );
+		
+		cache.close();
+		require('fs').unlinkSync( file );
+	},
+	
+	threads: function() {
+		// aggregate throughput of 1 to 32 worker threads sharing one cache (80% get + 20% set, then all gets)
+		var runs = [];
+		[80, 100].forEach( function(readPct) {
+			[1, 64].forEach( function(shards) {
+				[1, 2, 4, 8, 16, 32].forEach( function(numThreads) { runs.push({ shards: shards, numThreads: numThreads, readPct: readPct }); } );
+			} );
+		} );
+		
+		return runs.reduce( function(promise, run) {
+			return promise.then( function() { return benchThreads( run.shards, run.numThreads, run.readPct ); } );
+		}, Promise.resolve() );
+	}
+
+};
+
+var only = process.argv[3];
+var names = Object.keys(benchmarks).filter( function(name) { return !only || (name == only); } );
+
+function runNext() {
+	// run benchmarks in order, some of them are async
+	var name = names.shift();
+	if (!name) return;
+	
+	console.log( "\n== " + name + " (" + numKeys.toLocaleString() + " keys) ==" );
+	var promise = benchmarks[name]();
+	if (promise) promise.then( runNext );
+	else runNext();
+}
+runNext();
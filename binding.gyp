@@ -4,7 +4,7 @@
       "target_name": "megacache",
       "cflags": [ "-O3", "-fno-exceptions" ],
       "cflags_cc": [ "-O3", "-fno-exceptions" ],
-      "sources": [ "main.cc", "cache.cc", "MegaCache.cpp" ],
+      "sources": [ "main.cc", "cache.cc", "ShardedHash.cpp", "Snapshot.cpp", "MapRegion.cpp", "MegaCache.cpp" ],
       "include_dirs": [
         "<!@(node -p \"require('node-addon-api').include\")"
       ],
@@ -2,11 +2,11 @@
 // Copyright (c) 2023 Joseph Huckaby
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <math.h>
 #include "cache.h"
 
-Napi::FunctionReference MegaCache::constructor;
-
 Napi::Object MegaCache::Init(Napi::Env env, Napi::Object exports) {
 	// initialize class
 	Napi::HandleScope scope(env);
@@ -15,48 +15,175 @@ Napi::Object MegaCache::Init(Napi::Env env, Napi::Object exports) {
 		InstanceMethod("_set", &MegaCache::Set),
 		InstanceMethod("_get", &MegaCache::Get),
 		InstanceMethod("_peek", &MegaCache::Peek),
+		InstanceMethod("_getView", &MegaCache::GetView),
+		InstanceMethod("_getMany", &MegaCache::GetMany),
+		InstanceMethod("_setMany", &MegaCache::SetMany),
+		InstanceMethod("_benchLookups", &MegaCache::BenchLookups),
 		InstanceMethod("_has", &MegaCache::Has),
 		InstanceMethod("_remove", &MegaCache::Remove),
 		InstanceMethod("clear", &MegaCache::Clear),
+		InstanceMethod("clearAsync", &MegaCache::ClearAsync),
 		InstanceMethod("stats", &MegaCache::Stats),
+		InstanceMethod("_instrument", &MegaCache::Instrument),
+		InstanceMethod("evict", &MegaCache::Evict),
+		InstanceMethod("expire", &MegaCache::Expire),
+		InstanceMethod("_setLimits", &MegaCache::SetLimits),
+		InstanceMethod("_deleteWhere", &MegaCache::DeleteWhere),
+		InstanceMethod("save", &MegaCache::Save),
+		InstanceMethod("load", &MegaCache::Load),
+		InstanceMethod("saveAsync", &MegaCache::SaveAsync),
+		InstanceMethod("close", &MegaCache::Close),
 		InstanceMethod("_firstKey", &MegaCache::FirstKey),
 		InstanceMethod("_nextKey", &MegaCache::NextKey),
 		InstanceMethod("_lastKey", &MegaCache::LastKey),
-		InstanceMethod("_prevKey", &MegaCache::PrevKey)
+		InstanceMethod("_prevKey", &MegaCache::PrevKey),
+		InstanceMethod("_openCursor", &MegaCache::OpenCursor),
+		InstanceMethod("_readCursor", &MegaCache::ReadCursor),
+		InstanceMethod("_closeCursor", &MegaCache::CloseCursor)
 	});
 	
-	constructor = Napi::Persistent(func);
- 	constructor.SuppressDestruct();
- 	
+	// one constructor per environment, as the addon may be loaded into several worker threads
+	Napi::FunctionReference *constructor = new Napi::FunctionReference();
+	*constructor = Napi::Persistent(func);
+	env.SetInstanceData( constructor );
+	
 	exports.Set("MegaCache", func);
 	return exports;
 }
 
+static int ParseFanout(Napi::Env env, Napi::Value arg, const char *name, unsigned char *bits) {
+	// convert index fan-out option (slots per index) to bits, throw unless it is a power of 2 in range
+	uint32_t value = arg.As<Napi::Number>().Uint32Value();
+	for (unsigned char num = MH_INDEX_MIN_BITS; num <= MH_INDEX_MAX_BITS; num++) {
+		if (value == ((uint32_t)1 << num)) {
+			*bits = num;
+			return 1;
+		}
+	}
+	Napi::TypeError::New(env, std::string(name) + " must be 16, 32, 64, 128 or 256").ThrowAsJavaScriptException();
+	return 0;
+}
+
+static uint64_t LimitFromArg(Napi::Value arg) {
+	// convert maxKeys or maxBytes to 64 bits (numbers are exact up to 2^53, which is plenty), anything not positive means no limit
+	double value = arg.As<Napi::Number>().DoubleValue();
+	if (!(value > 0)) return 0;
+	if (value >= 18446744073709551615.0) return UINT64_MAX;
+	return (uint64_t)value;
+}
+
 MegaCache::MegaCache(const Napi::CallbackInfo& info) : Napi::ObjectWrap<MegaCache>(info) {
 	// construct new hash table
 	Napi::Env env = info.Env();
 	Napi::HandleScope scope(env);
 	
-	// 8 buckets per list with 16 scatter is about the perfect balance of speed and memory
-	// FUTURE: Make this configurable from Node.js side?
-	this->hash = new Hash( 8, 16 );
+	ShardOptions settings;
+	std::string name;
+	this->cache = NULL;
+	this->nextCursorId = 1;
 	
 	// allow maxKeys and maxBytes to be passed in as ctor args
 	if (info.Length() > 0) {
-		this->hash->maxKeys = (uint64_t)info[0].As<Napi::Number>().Uint32Value();
+		settings.maxKeys = LimitFromArg( info[0] );
 	}
 	if (info.Length() > 1) {
-		this->hash->maxBytes = (uint64_t)info[1].As<Napi::Number>().Uint32Value();
+		settings.maxBytes = LimitFromArg( info[1] );
+	}
+	
+	// optional eviction and sharing settings
+	if ((info.Length() > 2) && info[2].IsObject()) {
+		Napi::Object opts = info[2].As<Napi::Object>();
+		
+		if (opts.Has("lowWater")) {
+			uint32_t value = opts.Get("lowWater").As<Napi::Number>().Uint32Value();
+			settings.lowWater = (unsigned char)MAX( 1, MIN(value, 100) );
+		}
+		if (opts.Has("deferEvict")) {
+			settings.deferEvict = opts.Get("deferEvict").ToBoolean().Value() ? 1 : 0;
+		}
+		if (opts.Has("accounting")) {
+			std::string accounting = opts.Get("accounting").As<Napi::String>().Utf8Value();
+			if (accounting == "data") settings.accounting = MH_ACCOUNT_DATA;
+			else if (accounting == "arena") settings.accounting = MH_ACCOUNT_ARENA;
+			else {
+				Napi::TypeError::New(env, "Unknown accounting mode: " + accounting).ThrowAsJavaScriptException();
+				return;
+			}
+		}
+		if (opts.Has("policy")) {
+			std::string policy = opts.Get("policy").As<Napi::String>().Utf8Value();
+			if (policy == "clock") settings.policy = MH_POLICY_CLOCK;
+			else if (policy == "lru") settings.policy = MH_POLICY_LRU;
+			else if (policy == "tinylfu") settings.policy = MH_POLICY_TINYLFU;
+			else {
+				Napi::TypeError::New(env, "Unknown eviction policy: " + policy).ThrowAsJavaScriptException();
+				return;
+			}
+		}
+		if (opts.Has("engine")) {
+			std::string engine = opts.Get("engine").As<Napi::String>().Utf8Value();
+			if (engine == "trie") settings.engine = MH_ENGINE_TRIE;
+			else if (engine == "table") settings.engine = MH_ENGINE_TABLE;
+			else {
+				Napi::TypeError::New(env, "Unknown storage engine: " + engine).ThrowAsJavaScriptException();
+				return;
+			}
+		}
+		if (opts.Has("fanout") && !ParseFanout(env, opts.Get("fanout"), "fanout", &settings.indexBits)) return;
+		if (opts.Has("rootFanout") && !ParseFanout(env, opts.Get("rootFanout"), "rootFanout", &settings.rootBits)) return;
+		if (opts.Has("shards")) {
+			settings.numShards = opts.Get("shards").As<Napi::Number>().Uint32Value();
+		}
+		if (opts.Has("name")) {
+			name = opts.Get("name").As<Napi::String>().Utf8Value();
+		}
+		if (opts.Has("file")) {
+			settings.file = opts.Get("file").As<Napi::String>().Utf8Value();
+		}
+	}
+	
+	// named caches are shared with every other MegaCache of the same name, in any thread
+	this->cache = ShardedHash::open( name.c_str(), settings );
+	
+	if (!this->cache->error.empty()) {
+		Napi::Error::New(env, "Failed to open cache file: " + this->cache->error).ThrowAsJavaScriptException();
+		ShardedHash::release( this->cache );
+		this->cache = NULL;
 	}
 }
 
 MegaCache::~MegaCache() {
-	// cleanup and free memory
-	delete this->hash;
+	// detach from cache, free memory if we were the last user
+	this->CloseCursors();
+	if (this->cache) ShardedHash::release( this->cache );
+}
+
+static uint32_t ExpiresFromTTL(Napi::Value arg) {
+	// convert TTL in seconds to absolute expiration time (0 = never)
+	// TTL is rounded up to whole seconds
+	if (!arg.IsNumber()) return 0;
+	double ttl = ceil( arg.As<Napi::Number>().DoubleValue() );
+	uint32_t now = mhNow();
+	if (ttl <= 0) return 0;
+	return (ttl < (double)(UINT32_MAX - now)) ? (now + (uint32_t)ttl) : UINT32_MAX;
+}
+
+static uint32_t ReadLength(unsigned char *ptr) {
+	// read 32-bit little endian length from a packed batch
+	return (uint32_t)ptr[0] | ((uint32_t)ptr[1] << 8) | ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+static void WriteLength(unsigned char *ptr, uint32_t length) {
+	// write 32-bit little endian length into a packed batch
+	ptr[0] = (unsigned char)length;
+	ptr[1] = (unsigned char)(length >> 8);
+	ptr[2] = (unsigned char)(length >> 16);
+	ptr[3] = (unsigned char)(length >> 24);
 }
 
 Napi::Value MegaCache::Set(const Napi::CallbackInfo& info) {
-	// store key/value pair, no return value
+	// store key/value pair, with optional TTL in seconds
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
 	Napi::Env env = info.Env();
 	
 	Napi::Buffer<unsigned char> keyBuf = info[0].As<Napi::Buffer<unsigned char>>();
@@ -72,39 +199,68 @@ Napi::Value MegaCache::Set(const Napi::CallbackInfo& info) {
 		flags = (unsigned char)info[2].As<Napi::Number>().Uint32Value();
 	}
 	
-	Response resp = this->hash->store( key, keyLength, value, valueLength, flags );
+	uint32_t expires = (info.Length() > 3) ? ExpiresFromTTL( info[3] ) : 0;
+	Response resp = this->cache->store( key, keyLength, value, valueLength, flags, expires );
 	return Napi::Number::New(env, (double)resp.result);
 }
 
 Napi::Value MegaCache::Get(const Napi::CallbackInfo& info) {
 	// fetch value given key
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
 	Napi::Env env = info.Env();
 	
 	Napi::Buffer<unsigned char> keyBuf = info[0].As<Napi::Buffer<unsigned char>>();
 	unsigned char *key = keyBuf.Data();
 	MH_KLEN_T keyLength = (MH_KLEN_T)keyBuf.Length();
 	
-	Response resp = this->hash->fetch( key, keyLength );
+	uint64_t hash = Hash::hashKey( key, keyLength );
+	Shard *shard = this->cache->shardFor( hash );
+	Napi::Value result = env.Undefined();
+	int drain = 0;
 	
-	if (resp.result == MH_OK) {
-		Napi::Buffer<unsigned char> valueBuf = Napi::Buffer<unsigned char>::Copy( env, resp.content, resp.contentLength );
-		if (!valueBuf) return env.Undefined();
+	{
+		// readers share the lock, and log the LRU promotion instead of moving the bucket
+		// copy value out while we still hold the shard lock
+		std::shared_lock<std::shared_mutex> guard( shard->lock );
+		Metrics *metrics = shard->hash->metrics;
+		uint64_t started = metrics ? metrics->start() : 0;
+		Response resp = shard->hash->peek( hash, key, keyLength );
+		if (metrics) metrics->recordGet( started, resp.result );
 		
-		if (resp.flags) valueBuf.Set( "flags", (double)resp.flags );
-		return valueBuf;
+		if (resp.result == MH_OK) {
+			Napi::Buffer<unsigned char> valueBuf = Napi::Buffer<unsigned char>::Copy( env, resp.content, resp.contentLength );
+			if (!valueBuf) return env.Undefined();
+			
+			if (resp.flags) valueBuf.Set( "flags", (double)resp.flags );
+			result = valueBuf;
+			drain = shard->recordRead( resp.bucket );
+		}
 	}
-	else return env.Undefined();
+	
+	// buffer is full, so apply the promotions now if the shard is idle
+	if (drain) shard->tryDrainReads();
+	
+	return result;
 }
 
 Napi::Value MegaCache::Peek(const Napi::CallbackInfo& info) {
 	// fetch value given key, do not promote
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
 	Napi::Env env = info.Env();
 	
 	Napi::Buffer<unsigned char> keyBuf = info[0].As<Napi::Buffer<unsigned char>>();
 	unsigned char *key = keyBuf.Data();
 	MH_KLEN_T keyLength = (MH_KLEN_T)keyBuf.Length();
 	
-	Response resp = this->hash->peek( key, keyLength );
+	uint64_t hash = Hash::hashKey( key, keyLength );
+	Shard *shard = this->cache->shardFor( hash );
+	std::shared_lock<std::shared_mutex> guard( shard->lock );
+	
+	// copy value out while we still hold the shard lock
+	Metrics *metrics = shard->hash->metrics;
+	uint64_t started = metrics ? metrics->start() : 0;
+	Response resp = shard->hash->peek( hash, key, keyLength );
+	if (metrics) metrics->recordGet( started, resp.result );
 	
 	if (resp.result == MH_OK) {
 		Napi::Buffer<unsigned char> valueBuf = Napi::Buffer<unsigned char>::Copy( env, resp.content, resp.contentLength );
@@ -116,32 +272,297 @@ Napi::Value MegaCache::Peek(const Napi::CallbackInfo& info) {
 	else return env.Undefined();
 }
 
+Napi::Value MegaCache::GetView(const Napi::CallbackInfo& info) {
+	// fetch value given key, without copying it: the buffer points straight at the value inside the cache
+	// the bucket is pinned until the buffer is garbage collected, so it never moves or changes under it
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
+	Napi::Env env = info.Env();
+	
+	Napi::Buffer<unsigned char> keyBuf = info[0].As<Napi::Buffer<unsigned char>>();
+	unsigned char *key = keyBuf.Data();
+	MH_KLEN_T keyLength = (MH_KLEN_T)keyBuf.Length();
+	
+	Response resp = this->cache->fetchView( key, keyLength );
+	if (resp.result != MH_OK) return env.Undefined();
+	
+	// the buffer holds its own reference to the cache, as it may outlive this object
+	ShardedHash *cache = this->cache;
+	Bucket *bucket = resp.bucket;
+	ShardedHash::retain( cache );
+	
+	Napi::Buffer<unsigned char> valueBuf = Napi::Buffer<unsigned char>::New( env, resp.content, resp.contentLength, [cache, bucket](Napi::Env /*env*/, unsigned char * /*data*/) {
+		cache->unpin( bucket );
+		ShardedHash::release( cache );
+	} );
+	if (!valueBuf) {
+		cache->unpin( bucket );
+		ShardedHash::release( cache );
+		return env.Undefined();
+	}
+	
+	if (resp.flags) valueBuf.Set( "flags", (double)resp.flags );
+	return valueBuf;
+}
+
+Napi::Value MegaCache::GetMany(const Napi::CallbackInfo& info) {
+	// fetch values for a packed batch of keys, return all of them packed into one buffer, in the same order
+	// consecutive keys in the same shard share one lock, and are looked up interleaved (see Hash::peekMany)
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
+	Napi::Env env = info.Env();
+	
+	std::vector<BatchItem> batch;
+	if (!this->ParseBatch(env, info[0], 0, batch)) return env.Undefined();
+	size_t count = batch.size();
+	
+	// every result has a header, values are added as we go
+	uint64_t capacity = (count * MH_BATCH_RESULT_SIZE) + 1024;
+	uint64_t length = 0;
+	unsigned char *out = (unsigned char *)malloc( capacity );
+	Lookup lookups[MH_BATCH_CHUNK];
+	size_t idx = 0;
+	
+	while (out && (idx < count)) {
+		// next chunk of consecutive keys in the same shard, looked up together under one lock
+		Shard *shard = batch[idx].shard;
+		size_t numLookups = 0;
+		while ((idx + numLookups < count) && (numLookups < MH_BATCH_CHUNK) && (batch[idx + numLookups].shard == shard)) {
+			BatchItem *item = &batch[idx + numLookups];
+			lookups[numLookups].hash = item->hash;
+			lookups[numLookups].key = item->key;
+			lookups[numLookups].keyLength = item->keyLength;
+			numLookups++;
+		}
+		
+		// values must be copied out before the lock is released
+		int drain = 0;
+		shard->lock.lock_shared();
+		Metrics *metrics = shard->hash->metrics;
+		uint64_t started = metrics ? metrics->start() : 0;
+		shard->hash->peekMany( lookups, (uint32_t)numLookups );
+		
+		if (metrics) {
+			// the batch is timed as a whole, and counts as that many lookups of the average time
+			metrics->finish( MH_OP_GET, started, numLookups );
+			for (size_t num = 0; num < numLookups; num++) metrics->recordGet( 0, lookups[num].resp.result );
+		}
+		
+		for (size_t num = 0; out && (num < numLookups); num++) {
+			Response *resp = &lookups[num].resp;
+			MH_LEN_T contentLength = (resp->result == MH_OK) ? resp->contentLength : 0;
+			
+			if (length + MH_BATCH_RESULT_SIZE + contentLength > capacity) {
+				capacity = MAX( capacity * 2, length + MH_BATCH_RESULT_SIZE + contentLength );
+				unsigned char *newOut = (unsigned char *)realloc( (void *)out, capacity );
+				if (!newOut) free( (void *)out );
+				out = newOut;
+				if (!out) break;
+			}
+			
+			out[length] = (resp->result == MH_OK) ? resp->flags : MH_BATCH_MISSING;
+			WriteLength( out + length + 1, contentLength );
+			if (contentLength) memcpy( (void *)(out + length + MH_BATCH_RESULT_SIZE), (void *)resp->content, contentLength );
+			length += MH_BATCH_RESULT_SIZE + contentLength;
+			
+			if ((resp->result == MH_OK) && shard->recordRead(resp->bucket)) drain = 1;
+		}
+		shard->lock.unlock_shared();
+		
+		// read buffer is full, so apply the promotions before carrying on
+		if (drain) shard->tryDrainReads();
+		idx += numLookups;
+	}
+	
+	if (!out) {
+		Napi::Error::New(env, "Out of memory").ThrowAsJavaScriptException();
+		return env.Undefined();
+	}
+	
+	// small results are cheaper to copy, big ones are handed over to JS as is (which costs a finalizer)
+	if (length > MH_BATCH_COPY_MAX) {
+		return Napi::Buffer<unsigned char>::New( env, out, length, [](Napi::Env /*env*/, unsigned char *data) {
+			free( (void *)data );
+		} );
+	}
+	
+	Napi::Buffer<unsigned char> result = Napi::Buffer<unsigned char>::Copy( env, out, length );
+	free( (void *)out );
+	return result;
+}
+
+Napi::Value MegaCache::SetMany(const Napi::CallbackInfo& info) {
+	// store a packed batch of key/value pairs, with an optional TTL for all of them, return the number stored
+	// consecutive keys in the same shard share one lock, and the index is prefetched a few keys ahead
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
+	Napi::Env env = info.Env();
+	
+	std::vector<BatchItem> batch;
+	if (!this->ParseBatch(env, info[0], 1, batch)) return env.Undefined();
+	size_t count = batch.size();
+	
+	uint32_t expires = (info.Length() > 1) ? ExpiresFromTTL( info[1] ) : 0;
+	uint64_t numStored = 0;
+	Shard *locked = NULL;
+	
+	for (size_t idx = 0; idx < count; idx++) {
+		BatchItem *item = &batch[idx];
+		Shard *shard = item->shard;
+		if (shard != locked) {
+			if (locked) locked->lock.unlock();
+			shard->lock.lock();
+			shard->drainReads();
+			locked = shard;
+		}
+		
+		if ((idx + MH_BATCH_PREFETCH < count) && (batch[idx + MH_BATCH_PREFETCH].shard == shard)) {
+			shard->hash->prefetch( batch[idx + MH_BATCH_PREFETCH].hash );
+		}
+		
+		Metrics *metrics = shard->hash->metrics;
+		uint64_t started = metrics ? metrics->start() : 0;
+		Response resp = shard->hash->store( item->hash, item->key, item->keyLength, item->content, item->contentLength, item->flags, expires );
+		if (metrics) metrics->recordSet( started, resp.result );
+		if (resp.result != MH_ERR) numStored++;
+	}
+	if (locked) locked->lock.unlock();
+	
+	return Napi::Number::New(env, (double)numStored);
+}
+
+Napi::Value MegaCache::BenchLookups(const Napi::CallbackInfo& info) {
+	// time lookups for a packed batch of keys, without promoting or copying anything (for bench.js)
+	// group 0 calls peek() for each key (the serial walk), otherwise Hash::peekMany() runs with that many lookups in flight
+	// return [ elapsed nanoseconds, nodes visited, keys found, index levels visited ] (nodes and levels are counted by peekMany only)
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
+	Napi::Env env = info.Env();
+	
+	std::vector<BatchItem> batch;
+	if (!this->ParseBatch(env, info[0], 0, batch)) return env.Undefined();
+	size_t count = batch.size();
+	uint32_t group = info[1].As<Napi::Number>().Uint32Value();
+	
+	uint64_t numSteps = 0;
+	uint64_t numFound = 0;
+	uint64_t numLevels = 0;
+	Lookup lookups[MH_BATCH_CHUNK];
+	size_t idx = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	
+	while (idx < count) {
+		Shard *shard = batch[idx].shard;
+		size_t numLookups = 0;
+		while ((idx + numLookups < count) && (numLookups < MH_BATCH_CHUNK) && (batch[idx + numLookups].shard == shard)) {
+			BatchItem *item = &batch[idx + numLookups];
+			lookups[numLookups].hash = item->hash;
+			lookups[numLookups].key = item->key;
+			lookups[numLookups].keyLength = item->keyLength;
+			numLookups++;
+		}
+		
+		shard->lock.lock_shared();
+		if (group) {
+			numSteps += shard->hash->peekMany( lookups, (uint32_t)numLookups, group );
+		}
+		else {
+			for (size_t num = 0; num < numLookups; num++) {
+				lookups[num].resp = shard->hash->peek( lookups[num].hash, lookups[num].key, lookups[num].keyLength );
+			}
+		}
+		shard->lock.unlock_shared();
+		
+		for (size_t num = 0; num < numLookups; num++) {
+			if (lookups[num].resp.result == MH_OK) numFound++;
+			if (group) numLevels += lookups[num].digestIndex + 1;
+		}
+		idx += numLookups;
+	}
+	
+	uint64_t elapsed = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+	
+	Napi::Array result = Napi::Array::New(env, 4);
+	result.Set( (uint32_t)0, Napi::Number::New(env, (double)elapsed) );
+	result.Set( (uint32_t)1, Napi::Number::New(env, (double)numSteps) );
+	result.Set( (uint32_t)2, Napi::Number::New(env, (double)numFound) );
+	result.Set( (uint32_t)3, Napi::Number::New(env, (double)numLevels) );
+	return result;
+}
+
+int MegaCache::ParseBatch(Napi::Env env, Napi::Value arg, int withValues, std::vector<BatchItem> &batch) {
+	// unpack batch of keys (and values), and hash every key up front, throw if the buffer is malformed
+	Napi::Buffer<unsigned char> buf = arg.As<Napi::Buffer<unsigned char>>();
+	unsigned char *data = buf.Data();
+	uint64_t length = buf.Length();
+	uint64_t offset = 0;
+	int valid = 1;
+	
+	while (valid && (offset < length)) {
+		BatchItem item;
+		item.key = data + offset + MH_BATCH_LENGTH_SIZE;
+		item.keyLength = 0;
+		item.content = NULL;
+		item.contentLength = 0;
+		item.flags = 0;
+		
+		uint32_t keyLength = (length - offset >= MH_BATCH_LENGTH_SIZE) ? ReadLength( data + offset ) : 0;
+		if (!keyLength || (keyLength > 0xFFFF) || (length - offset - MH_BATCH_LENGTH_SIZE < keyLength)) valid = 0;
+		else {
+			item.keyLength = (MH_KLEN_T)keyLength;
+			offset += MH_BATCH_LENGTH_SIZE + keyLength;
+		}
+		
+		if (valid && withValues) {
+			if (length - offset < MH_BATCH_LENGTH_SIZE + 1) valid = 0;
+			else {
+				item.contentLength = ReadLength( data + offset );
+				item.flags = data[ offset + MH_BATCH_LENGTH_SIZE ];
+				item.content = data + offset + MH_BATCH_LENGTH_SIZE + 1;
+				offset += MH_BATCH_LENGTH_SIZE + 1;
+				if (length - offset < item.contentLength) valid = 0;
+				else offset += item.contentLength;
+			}
+		}
+		
+		if (valid) {
+			item.hash = Hash::hashKey( item.key, item.keyLength );
+			item.shard = this->cache->shardFor( item.hash );
+			batch.push_back( item );
+		}
+	}
+	
+	if (!valid) {
+		Napi::Error::New(env, "Malformed batch").ThrowAsJavaScriptException();
+		return 0;
+	}
+	return 1;
+}
+
 Napi::Value MegaCache::Has(const Napi::CallbackInfo& info) {
 	// see if a key exists, return boolean true/value
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
 	Napi::Env env = info.Env();
 	
 	Napi::Buffer<unsigned char> keyBuf = info[0].As<Napi::Buffer<unsigned char>>();
 	unsigned char *key = keyBuf.Data();
 	MH_KLEN_T keyLength = (MH_KLEN_T)keyBuf.Length();
 	
-	Response resp = this->hash->peek( key, keyLength );
-	return Napi::Boolean::New(env, (resp.result == MH_OK));
+	return Napi::Boolean::New(env, this->cache->has( key, keyLength ));
 }
 
 Napi::Value MegaCache::Remove(const Napi::CallbackInfo& info) {
 	// remove key/value pair, free up memory
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
 	Napi::Env env = info.Env();
 	
 	Napi::Buffer<unsigned char> keyBuf = info[0].As<Napi::Buffer<unsigned char>>();
 	unsigned char *key = keyBuf.Data();
 	MH_KLEN_T keyLength = (MH_KLEN_T)keyBuf.Length();
 	
-	Response resp = this->hash->remove( key, keyLength );
+	Response resp = this->cache->remove( key, keyLength );
 	return Napi::Boolean::New(env, (resp.result == MH_OK));
 }
 
 Napi::Value MegaCache::Clear(const Napi::CallbackInfo& info) {
 	// delete some or all keys/values from hash, free all memory
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
 	unsigned char slice1 = 0;
 	unsigned char slice2 = 0;
 	
@@ -149,84 +570,555 @@ Napi::Value MegaCache::Clear(const Napi::CallbackInfo& info) {
 		// clear thin slice
 		slice1 = (unsigned char)info[0].As<Napi::Number>().Uint32Value();
 		slice2 = (unsigned char)info[1].As<Napi::Number>().Uint32Value();
-		this->hash->clear( slice1, slice2 );
+		this->cache->clear( slice1, slice2 );
 	}
 	else if (info.Length() == 1) {
 		// clear thick slice
 		slice1 = (unsigned char)info[0].As<Napi::Number>().Uint32Value();
-		this->hash->clear( slice1 );
+		this->cache->clear( slice1 );
 	}
 	else {
 		// clear all
-		this->hash->clear();
+		this->cache->clear();
 	}
 	
 	return info.Env().Undefined();
 }
 
+class ClearWorker : public Napi::AsyncWorker {
+public:
+	// frees the memory of a cleared cache on a libuv thread, then resolves the promise
+	// holds a reference to the cache, so a cache file stays open until its slabs are all given back
+	ShardedHash *cache;
+	ClearJob *job;
+	Napi::Promise::Deferred deferred;
+	
+	ClearWorker(Napi::Env env, ShardedHash *newCache, ClearJob *newJob) : Napi::AsyncWorker(env, "MegaCache.clearAsync"), deferred(Napi::Promise::Deferred::New(env)) {
+		cache = newCache;
+		job = newJob;
+		ShardedHash::retain( cache );
+	}
+	
+	~ClearWorker() {
+		ShardedHash::release( cache );
+		delete job;
+	}
+	
+	void Execute() {
+		cache->clearEnd( job );
+	}
+	
+	void OnOK() {
+		// clear stats as node object, times in milliseconds
+		Napi::Object obj = Napi::Object::New(Env());
+		obj.Set(Napi::String::New(Env(), "numKeys"), (double)job->numKeys);
+		obj.Set(Napi::String::New(Env(), "numBytes"), (double)job->numBytes);
+		obj.Set(Napi::String::New(Env(), "elapsed"), (double)job->elapsed / 1000000.0);
+		obj.Set(Napi::String::New(Env(), "pause"), (double)job->pause / 1000000.0);
+		deferred.Resolve( obj );
+	}
+	
+	void OnError(const Napi::Error& err) {
+		deferred.Reject( err.Value() );
+	}
+};
+
+Napi::Value MegaCache::ClearAsync(const Napi::CallbackInfo& info) {
+	// delete all keys right away, but free the memory in the background, return promise which resolves when done
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
+	ClearJob *job = new ClearJob();
+	this->cache->clearBegin( job );
+	
+	ClearWorker *worker = new ClearWorker( info.Env(), this->cache, job );
+	worker->Queue();
+	return worker->deferred.Promise();
+}
+
+static Napi::Object LatencyObject(Napi::Env env, Histogram *hist, double tickRate) {
+	// convert latency histogram to node object, times in microseconds
+	double scale = 1.0 / (tickRate * 1000.0);
+	uint64_t count = hist->numValues.load( std::memory_order_relaxed );
+	
+	Napi::Object obj = Napi::Object::New(env);
+	obj.Set(Napi::String::New(env, "count"), (double)count);
+	obj.Set(Napi::String::New(env, "mean"), count ? ((double)hist->total.load(std::memory_order_relaxed) / (double)count) * scale : 0.0);
+	obj.Set(Napi::String::New(env, "p50"), (double)hist->percentile(50) * scale);
+	obj.Set(Napi::String::New(env, "p90"), (double)hist->percentile(90) * scale);
+	obj.Set(Napi::String::New(env, "p99"), (double)hist->percentile(99) * scale);
+	obj.Set(Napi::String::New(env, "p999"), (double)hist->percentile(99.9) * scale);
+	obj.Set(Napi::String::New(env, "max"), (double)hist->max.load(std::memory_order_relaxed) * scale);
+	return obj;
+}
+
 Napi::Value MegaCache::Stats(const Napi::CallbackInfo& info) {
-	// return stats as node object
+	// return stats as node object, with counters and latencies if instrumented, and the key layout if asked for (opts.shape)
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
 	Napi::Env env = info.Env();
 	
+	// sum up all shards
+	::Stats stats;
+	uint64_t numSlabs, arenaSize, arenaUsed, sketchSize, timerSize;
+	this->cache->getStats( &stats, &numSlabs, &arenaSize, &arenaUsed, &sketchSize, &timerSize );
+	
 	Napi::Object obj = Napi::Object::New(env);
-	obj.Set(Napi::String::New(env, "indexSize"), (double)this->hash->stats->indexSize);
-	obj.Set(Napi::String::New(env, "metaSize"), (double)this->hash->stats->metaSize);
-	obj.Set(Napi::String::New(env, "dataSize"), (double)this->hash->stats->dataSize);
-	obj.Set(Napi::String::New(env, "numKeys"), (double)this->hash->stats->numKeys);
-	obj.Set(Napi::String::New(env, "numIndexes"), (double)(this->hash->stats->indexSize / (int)sizeof(Index)));
-	obj.Set(Napi::String::New(env, "numEvictions"), (double)this->hash->stats->numEvictions);
+	obj.Set(Napi::String::New(env, "indexSize"), (double)stats.indexSize);
+	obj.Set(Napi::String::New(env, "metaSize"), (double)stats.metaSize);
+	obj.Set(Napi::String::New(env, "dataSize"), (double)stats.dataSize);
+	obj.Set(Napi::String::New(env, "numKeys"), (double)stats.numKeys);
+	obj.Set(Napi::String::New(env, "numIndexes"), (double)stats.numIndexes);
+	obj.Set(Napi::String::New(env, "numEvictions"), (double)stats.numEvictions);
+	obj.Set(Napi::String::New(env, "evictionBatches"), (double)stats.evictionBatches);
+	obj.Set(Napi::String::New(env, "evictionTime"), (double)stats.evictionTime / 1000000.0);
+	obj.Set(Napi::String::New(env, "numShards"), (double)this->cache->numShards);
+	obj.Set(Napi::String::New(env, "readsDropped"), (double)this->cache->readsDropped());
+	obj.Set(Napi::String::New(env, "numPinned"), (double)this->cache->numPinned());
+	obj.Set(Napi::String::New(env, "numAdmitted"), (double)stats.numAdmitted);
+	obj.Set(Napi::String::New(env, "numRejected"), (double)stats.numRejected);
+	obj.Set(Napi::String::New(env, "sketchSize"), (double)sketchSize);
+	obj.Set(Napi::String::New(env, "numExpired"), (double)stats.numExpired);
+	obj.Set(Napi::String::New(env, "expiredBytes"), (double)stats.expiredBytes);
+	obj.Set(Napi::String::New(env, "timerSize"), (double)timerSize);
+	obj.Set(Napi::String::New(env, "numRebuilds"), (double)stats.numRebuilds);
+	
+	// persistent cache file
+	MapRegion *region = this->cache->region;
+	obj.Set(Napi::String::New(env, "fileSize"), region ? (double)region->getFileSize() : 0.0);
+	obj.Set(Napi::String::New(env, "generation"), region ? (double)region->header->generation : 0.0);
+	obj.Set(Napi::String::New(env, "restored"), Napi::Boolean::New(env, region && region->restored));
+	
+	// slab arena stats: real memory footprint and how much of it is wasted
+	uint64_t liveSize = stats.indexSize + stats.metaSize + stats.dataSize;
+	obj.Set(Napi::String::New(env, "numSlabs"), (double)numSlabs);
+	obj.Set(Napi::String::New(env, "arenaSize"), (double)arenaSize);
+	obj.Set(Napi::String::New(env, "arenaUsed"), (double)arenaUsed);
+	obj.Set(Napi::String::New(env, "fragmentation"), arenaSize ? (double)(arenaSize - liveSize) / (double)arenaSize : 0.0);
+	
+	// operation counters and latency histograms (see instrument() in main.js)
+	Metrics *metrics = new Metrics();
+	int instrumented = this->cache->getMetrics( metrics );
+	obj.Set(Napi::String::New(env, "instrumented"), Napi::Boolean::New(env, instrumented ? true : false));
+	
+	if (instrumented) {
+		uint64_t hits = metrics->hits.load( std::memory_order_relaxed );
+		uint64_t misses = metrics->misses.load( std::memory_order_relaxed );
+		obj.Set(Napi::String::New(env, "hits"), (double)hits);
+		obj.Set(Napi::String::New(env, "misses"), (double)misses);
+		obj.Set(Napi::String::New(env, "hitRatio"), (hits + misses) ? (double)hits / (double)(hits + misses) : 0.0);
+		obj.Set(Napi::String::New(env, "adds"), (double)metrics->adds.load(std::memory_order_relaxed));
+		obj.Set(Napi::String::New(env, "replaces"), (double)metrics->replaces.load(std::memory_order_relaxed));
+		obj.Set(Napi::String::New(env, "removes"), (double)metrics->removes.load(std::memory_order_relaxed));
+		obj.Set(Napi::String::New(env, "sample"), (double)metrics->sample);
+		
+		double tickRate = mhTickRate();
+		Napi::Object latency = Napi::Object::New(env);
+		latency.Set(Napi::String::New(env, "get"), LatencyObject( env, &metrics->latency[MH_OP_GET], tickRate ));
+		latency.Set(Napi::String::New(env, "set"), LatencyObject( env, &metrics->latency[MH_OP_SET], tickRate ));
+		latency.Set(Napi::String::New(env, "delete"), LatencyObject( env, &metrics->latency[MH_OP_DELETE], tickRate ));
+		obj.Set(Napi::String::New(env, "latency"), latency);
+	}
+	delete metrics;
+	
+	// key layout, from a walk over every key (slow on big caches, so only on request)
+	if ((info.Length() > 0) && info[0].IsObject() && info[0].As<Napi::Object>().Get("shape").ToBoolean()) {
+		::Shape shape;
+		this->cache->getShape( &shape );
+		
+		uint32_t numDepths = MH_DIGEST_SIZE;
+		while (numDepths && !shape.depths[numDepths - 1]) numDepths--;
+		
+		uint64_t numKeys = 0;
+		Napi::Array depths = Napi::Array::New(env, numDepths);
+		for (uint32_t idx = 0; idx < numDepths; idx++) {
+			depths.Set(idx, (double)shape.depths[idx]);
+			numKeys += shape.depths[idx];
+		}
+		
+		Napi::Object shapeObj = Napi::Object::New(env);
+		shapeObj.Set(Napi::String::New(env, "depths"), depths);
+		shapeObj.Set(Napi::String::New(env, "maxChain"), (double)shape.maxChain);
+		shapeObj.Set(Napi::String::New(env, "avgChain"), shape.numChains ? (double)numKeys / (double)shape.numChains : 0.0);
+		obj.Set(Napi::String::New(env, "shape"), shapeObj);
+	}
 	
 	return obj;
 }
 
-Napi::Value MegaCache::FirstKey(const Napi::CallbackInfo& info) {
-	// return first key in hash (in descending popular order)
+Napi::Value MegaCache::Instrument(const Napi::CallbackInfo& info) {
+	// turn operation counters and latency histograms on, timing one in sample operations, or off with 0 (which resets them)
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
+	uint32_t sample = info[0].As<Napi::Number>().Uint32Value();
+	
+	this->cache->setMetrics( sample );
+	return info.Env().Undefined();
+}
+
+Napi::Value MegaCache::Evict(const Napi::CallbackInfo& info) {
+	// evict keys down to the low watermark, optionally capped at budget keys, return number evicted
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
 	Napi::Env env = info.Env();
+	uint64_t budget = 0;
 	
-	Response resp = this->hash->firstKey();
-	if (resp.result == MH_OK) {
-		return Napi::Buffer<unsigned char>::Copy( env, resp.content, resp.contentLength );
+	if (info.Length() > 0) {
+		budget = (uint64_t)info[0].As<Napi::Number>().Int64Value();
 	}
-	else return env.Undefined();
+	
+	return Napi::Number::New(env, (double)this->cache->evict( budget ));
+}
+
+Napi::Value MegaCache::SetLimits(const Napi::CallbackInfo& info) {
+	// change maxKeys and maxBytes, return true if the cache is now over them (see setLimits() in main.js for the rest)
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
+	Napi::Env env = info.Env();
+	uint64_t maxKeys = (info.Length() > 0) ? LimitFromArg( info[0] ) : 0;
+	uint64_t maxBytes = (info.Length() > 1) ? LimitFromArg( info[1] ) : 0;
+	
+	return Napi::Boolean::New(env, this->cache->setLimits( maxKeys, maxBytes ) ? true : false);
+}
+
+Napi::Value MegaCache::Expire(const Napi::CallbackInfo& info) {
+	// reap keys whose TTL ran out, optionally capped at budget timers, return number reaped
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
+	Napi::Env env = info.Env();
+	uint64_t budget = 0;
+	
+	if (info.Length() > 0) {
+		budget = (uint64_t)info[0].As<Napi::Number>().Int64Value();
+	}
+	
+	return Napi::Number::New(env, (double)this->cache->expire( budget ));
+}
+
+Napi::Value MegaCache::DeleteWhere(const Napi::CallbackInfo& info) {
+	// delete keys matching a prefix buffer (or null) and a value type mask (or 0), from one run of thin slices
+	// return [ next cursor, keys deleted, bytes deleted ], the cursor is MH_THIN_SLICES when the whole cache is done
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
+	Napi::Env env = info.Env();
+	Filter filter;
+	
+	if (info[0].IsBuffer()) {
+		Napi::Buffer<unsigned char> buf = info[0].As<Napi::Buffer<unsigned char>>();
+		filter.prefix = buf.Data();
+		filter.prefixLength = (uint32_t)buf.Length();
+	}
+	filter.typeMask = info[1].As<Napi::Number>().Uint32Value();
+	uint32_t cursor = info[2].As<Napi::Number>().Uint32Value();
+	uint64_t budget = (uint64_t)info[3].As<Napi::Number>().Uint32Value();
+	
+	cursor = this->cache->deleteWhere( &filter, cursor, budget );
+	
+	Napi::Array result = Napi::Array::New(env, 3);
+	result.Set( (uint32_t)0, Napi::Number::New(env, (double)cursor) );
+	result.Set( (uint32_t)1, Napi::Number::New(env, (double)filter.numKeys) );
+	result.Set( (uint32_t)2, Napi::Number::New(env, (double)filter.numBytes) );
+	return result;
+}
+
+static Napi::Object SnapshotObject(Napi::Env env, SnapshotResult &res) {
+	// snapshot stats as node object, times in milliseconds
+	Napi::Object obj = Napi::Object::New(env);
+	obj.Set(Napi::String::New(env, "numKeys"), (double)res.numKeys);
+	obj.Set(Napi::String::New(env, "numSkipped"), (double)res.numSkipped);
+	obj.Set(Napi::String::New(env, "numBytes"), (double)res.numBytes);
+	obj.Set(Napi::String::New(env, "elapsed"), (double)res.elapsed / 1000000.0);
+	obj.Set(Napi::String::New(env, "pause"), (double)res.pause / 1000000.0);
+	return obj;
+}
+
+class SaveWorker : public Napi::AsyncWorker {
+public:
+	// waits for a background save on a libuv thread, then settles the promise
+	// holds a reference to the cache, so it survives even if the MegaCache object is collected first
+	ShardedHash *cache;
+	SnapshotJob *job;
+	Napi::Promise::Deferred deferred;
+	
+	SaveWorker(Napi::Env env, ShardedHash *newCache, SnapshotJob *newJob) : Napi::AsyncWorker(env, "MegaCache.saveAsync"), deferred(Napi::Promise::Deferred::New(env)) {
+		cache = newCache;
+		job = newJob;
+		ShardedHash::retain( cache );
+	}
+	
+	~SaveWorker() {
+		// this runs on the JS thread once the promise is settled, so only then can the next save start
+		cache->saveDone();
+		ShardedHash::release( cache );
+		delete job;
+	}
+	
+	void Execute() {
+		cache->saveEnd( job );
+		if (job->result.result != MH_OK) SetError( "Failed to save snapshot: " + job->result.error );
+	}
+	
+	void OnOK() {
+		deferred.Resolve( SnapshotObject(Env(), job->result) );
+	}
+	
+	void OnError(const Napi::Error& err) {
+		deferred.Reject( err.Value() );
+	}
+};
+
+Napi::Value MegaCache::Save(const Napi::CallbackInfo& info) {
+	// write snapshot of all keys to file, in LRU order (blocks until done)
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
+	std::string path = info[0].As<Napi::String>().Utf8Value();
+	SnapshotResult res;
+	
+	this->cache->save( path.c_str(), &res );
+	return this->SnapshotInfo( info.Env(), res, "Failed to save snapshot: " );
+}
+
+Napi::Value MegaCache::Load(const Napi::CallbackInfo& info) {
+	// load keys from snapshot file, on top of any keys already in the cache (blocks until done)
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
+	std::string path = info[0].As<Napi::String>().Utf8Value();
+	SnapshotResult res;
+	
+	this->cache->load( path.c_str(), &res );
+	return this->SnapshotInfo( info.Env(), res, "Failed to load snapshot: " );
+}
+
+Napi::Value MegaCache::SnapshotInfo(Napi::Env env, SnapshotResult &res, const char *msg) {
+	// convert snapshot result to node object, or throw
+	if (res.result != MH_OK) {
+		Napi::Error::New(env, msg + res.error).ThrowAsJavaScriptException();
+		return env.Undefined();
+	}
+	return SnapshotObject( env, res );
+}
+
+Napi::Value MegaCache::SaveAsync(const Napi::CallbackInfo& info) {
+	// save snapshot in the background, return promise which resolves with the stats when the file is complete
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
+	Napi::Env env = info.Env();
+	std::string path = info[0].As<Napi::String>().Utf8Value();
+	
+	SnapshotJob *job = new SnapshotJob();
+	if (!this->cache->saveBegin(path.c_str(), job)) {
+		Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+		deferred.Reject( Napi::Error::New(env, "Failed to save snapshot: " + job->result.error).Value() );
+		delete job;
+		return deferred.Promise();
+	}
+	
+	SaveWorker *worker = new SaveWorker( env, this->cache, job );
+	worker->Queue();
+	return worker->deferred.Promise();
+}
+
+Napi::Value MegaCache::Close(const Napi::CallbackInfo& info) {
+	// detach from cache now, rather than when garbage collected (for a persistent cache, this syncs and closes the file)
+	// a cache shared by name (or with a background save running) stays open until the last user is done with it
+	this->CloseCursors();
+	if (this->cache) ShardedHash::release( this->cache );
+	this->cache = NULL;
+	return info.Env().Undefined();
+}
+
+int MegaCache::IsClosed(Napi::Env env) {
+	// throw if close() was already called
+	if (this->cache) return 0;
+	Napi::Error::New(env, "Cache is closed").ThrowAsJavaScriptException();
+	return 1;
+}
+
+Napi::Value MegaCache::FirstKey(const Napi::CallbackInfo& info) {
+	// return first key in hash (in descending popular order)
+	// iteration drains the read buffers, so it sees the same order as eviction would
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
+	return this->EdgeKey( info.Env(), 0, 1 );
 }
 
 Napi::Value MegaCache::NextKey(const Napi::CallbackInfo& info) {
 	// return next key in hash given any key (in descending popular order)
+	// continues with the next shard when we reach the end of this one
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
 	Napi::Env env = info.Env();
 	
 	Napi::Buffer<unsigned char> keyBuf = info[0].As<Napi::Buffer<unsigned char>>();
 	unsigned char *key = keyBuf.Data();
 	MH_KLEN_T keyLength = (MH_KLEN_T)keyBuf.Length();
 	
-	Response resp = this->hash->nextKey( key, keyLength );
-	if (resp.result == MH_OK) {
-		return Napi::Buffer<unsigned char>::Copy( env, resp.content, resp.contentLength );
+	uint64_t hash = Hash::hashKey( key, keyLength );
+	Shard *shard = this->cache->shardFor( hash );
+	{
+		std::lock_guard<std::shared_mutex> guard( shard->lock );
+		shard->drainReads();
+		Response resp = shard->hash->peek( hash, key, keyLength );
+		if (resp.result != MH_OK) return env.Undefined();
+		
+		Bucket *bucket = resp.bucket->cacheNext;
+		if (bucket) {
+			return Napi::Buffer<unsigned char>::Copy( env, shard->hash->bucketGetKey(bucket), shard->hash->bucketGetKeyLength(bucket) );
+		}
 	}
-	else return env.Undefined();
+	
+	return this->EdgeKey( env, (shard - this->cache->shards) + 1, 1 );
 }
 
 Napi::Value MegaCache::LastKey(const Napi::CallbackInfo& info) {
 	// return last key in hash (in asending popular order)
-	Napi::Env env = info.Env();
-	
-	Response resp = this->hash->lastKey();
-	if (resp.result == MH_OK) {
-		return Napi::Buffer<unsigned char>::Copy( env, resp.content, resp.contentLength );
-	}
-	else return env.Undefined();
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
+	return this->EdgeKey( info.Env(), (int64_t)this->cache->numShards - 1, -1 );
 }
 
 Napi::Value MegaCache::PrevKey(const Napi::CallbackInfo& info) {
 	// return previous key in hash given any key (in ascending popular order)
+	// continues with the previous shard when we reach the start of this one
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
 	Napi::Env env = info.Env();
 	
 	Napi::Buffer<unsigned char> keyBuf = info[0].As<Napi::Buffer<unsigned char>>();
 	unsigned char *key = keyBuf.Data();
 	MH_KLEN_T keyLength = (MH_KLEN_T)keyBuf.Length();
 	
-	Response resp = this->hash->prevKey( key, keyLength );
-	if (resp.result == MH_OK) {
-		return Napi::Buffer<unsigned char>::Copy( env, resp.content, resp.contentLength );
+	uint64_t hash = Hash::hashKey( key, keyLength );
+	Shard *shard = this->cache->shardFor( hash );
+	{
+		std::lock_guard<std::shared_mutex> guard( shard->lock );
+		shard->drainReads();
+		Response resp = shard->hash->peek( hash, key, keyLength );
+		if (resp.result != MH_OK) return env.Undefined();
+		
+		Bucket *bucket = resp.bucket->cachePrev;
+		if (bucket) {
+			return Napi::Buffer<unsigned char>::Copy( env, shard->hash->bucketGetKey(bucket), shard->hash->bucketGetKeyLength(bucket) );
+		}
 	}
-	else return env.Undefined();
+	
+	return this->EdgeKey( env, (shard - this->cache->shards) - 1, -1 );
+}
+
+Napi::Value MegaCache::EdgeKey(Napi::Env env, int64_t idx, int dir) {
+	// return LRU head of first non-empty shard from idx forward (dir 1), or LRU tail from idx backward (dir -1)
+	for (; (idx >= 0) && (idx < (int64_t)this->cache->numShards); idx += dir) {
+		Shard *shard = &this->cache->shards[idx];
+		std::lock_guard<std::shared_mutex> guard( shard->lock );
+		shard->drainReads();
+		
+		Bucket *bucket = (dir > 0) ? shard->hash->cacheFirst : shard->hash->cacheLast;
+		if (bucket) {
+			return Napi::Buffer<unsigned char>::Copy( env, shard->hash->bucketGetKey(bucket), shard->hash->bucketGetKeyLength(bucket) );
+		}
+	}
+	
+	return env.Undefined();
+}
+
+Napi::Value MegaCache::OpenCursor(const Napi::CallbackInfo& info) {
+	// start iterating in LRU order (most popular first, or least popular first if reverse is true), return iterator id
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
+	int dir = info[0].ToBoolean().Value() ? -1 : 1;
+	
+	Cursor *cursor = new Cursor();
+	this->cache->openCursor( cursor, dir );
+	uint32_t id = this->nextCursorId++;
+	this->cursors[id] = cursor;
+	return Napi::Number::New(info.Env(), (double)id);
+}
+
+Napi::Value MegaCache::ReadCursor(const Napi::CallbackInfo& info) {
+	// return the next batch of up to maxKeys keys (and values, if withValues is true) packed into one buffer
+	// the iterator is closed automatically once it has passed the last shard, and after that an empty buffer comes back
+	if (this->IsClosed(info.Env())) return info.Env().Undefined();
+	Napi::Env env = info.Env();
+	
+	uint32_t id = info[0].As<Napi::Number>().Uint32Value();
+	uint32_t maxKeys = info[1].As<Napi::Number>().Uint32Value();
+	if (!maxKeys) maxKeys = MH_ITER_BATCH;
+	int withValues = info[2].ToBoolean().Value() ? 1 : 0;
+	
+	auto iter = this->cursors.find( id );
+	if (iter == this->cursors.end()) return Napi::Buffer<unsigned char>::New( env, 0 );
+	Cursor *cursor = iter->second;
+	
+	uint64_t capacity = 65536;
+	uint64_t length = 0;
+	uint32_t count = 0;
+	unsigned char *out = (unsigned char *)malloc( capacity );
+	
+	while (out && (count < maxKeys) && (length < MH_ITER_BATCH_BYTES) && (cursor->shard < this->cache->numShards)) {
+		// copy keys out of one shard under its lock, then move on to the next shard if this one ran out
+		Shard *shard = &this->cache->shards[ cursor->shard ];
+		Bucket *bucket = NULL;
+		{
+			std::lock_guard<std::shared_mutex> guard( shard->lock );
+			shard->drainReads();
+			Hash *hash = shard->hash;
+			
+			while ((count < maxKeys) && (length < MH_ITER_BATCH_BYTES) && (bucket = hash->stepCursor(cursor))) {
+				MH_KLEN_T keyLength = hash->bucketGetKeyLength( bucket );
+				MH_LEN_T contentLength = withValues ? hash->bucketGetContentLength( bucket ) : 0;
+				uint64_t size = MH_BATCH_LENGTH_SIZE + keyLength + (withValues ? (MH_BATCH_RESULT_SIZE + contentLength) : 0);
+				
+				if (length + size > capacity) {
+					capacity = MAX( capacity * 2, length + size );
+					unsigned char *newOut = (unsigned char *)realloc( (void *)out, capacity );
+					if (!newOut) free( (void *)out );
+					out = newOut;
+					if (!out) break;
+				}
+				
+				WriteLength( out + length, keyLength );
+				memcpy( (void *)(out + length + MH_BATCH_LENGTH_SIZE), (void *)hash->bucketGetKey(bucket), keyLength );
+				length += MH_BATCH_LENGTH_SIZE + keyLength;
+				
+				if (withValues) {
+					out[length] = bucket->flags;
+					WriteLength( out + length + 1, contentLength );
+					if (contentLength) memcpy( (void *)(out + length + MH_BATCH_RESULT_SIZE), (void *)hash->bucketGetContent(bucket), contentLength );
+					length += MH_BATCH_RESULT_SIZE + contentLength;
+				}
+				count++;
+			}
+		}
+		if (out && !bucket) this->cache->nextShard( cursor );
+	}
+	
+	if (!out) {
+		Napi::Error::New(env, "Out of memory").ThrowAsJavaScriptException();
+		return env.Undefined();
+	}
+	
+	if (cursor->shard >= this->cache->numShards) {
+		// done, forget the iterator
+		this->cache->closeCursor( cursor );
+		delete cursor;
+		this->cursors.erase( iter );
+	}
+	
+	// small results are cheaper to copy, big ones are handed over to JS as is (which costs a finalizer)
+	if (length > MH_BATCH_COPY_MAX) {
+		return Napi::Buffer<unsigned char>::New( env, out, length, [](Napi::Env /*env*/, unsigned char *data) {
+			free( (void *)data );
+		} );
+	}
+	
+	Napi::Buffer<unsigned char> result = Napi::Buffer<unsigned char>::Copy( env, out, length );
+	free( (void *)out );
+	return result;
+}
+
+Napi::Value MegaCache::CloseCursor(const Napi::CallbackInfo& info) {
+	// stop iterating before the end (does nothing if the iterator is already done)
+	if (!this->cache) return info.Env().Undefined();
+	uint32_t id = info[0].As<Napi::Number>().Uint32Value();
+	
+	auto iter = this->cursors.find( id );
+	if (iter != this->cursors.end()) {
+		this->cache->closeCursor( iter->second );
+		delete iter->second;
+		this->cursors.erase( iter );
+	}
+	return info.Env().Undefined();
+}
+
+void MegaCache::CloseCursors() {
+	// close all open iterators, before letting go of the cache
+	for (auto iter = this->cursors.begin(); iter != this->cursors.end(); iter++) {
+		this->cache->closeCursor( iter->second );
+		delete iter->second;
+	}
+	this->cursors.clear();
 }
@@ -5,7 +5,44 @@
 #define MEGACACHE_H
 
 #include <napi.h>
-#include "MegaCache.h"
+#include <vector>
+#include <map>
+#include "ShardedHash.h"
+
+/** \name Packed batches for getMany() and setMany():
+	Every length is a 32-bit little endian integer, records are packed back to back. */
+//@{
+/** Key record: length, then the key.  Entry record (setMany): key record, value length, flags (1 byte), then the value. */
+#define MH_BATCH_LENGTH_SIZE 4
+/** Result record header (getMany): flags (1 byte), then value length, then the value. */
+#define MH_BATCH_RESULT_SIZE 5
+/** Result flags for a key which was not found. */
+#define MH_BATCH_MISSING 0xFF
+/** Results up to this size are copied into a new buffer, bigger ones are handed over without copying. */
+#define MH_BATCH_COPY_MAX 65536
+/** How many keys ahead to prefetch index nodes (setMany). */
+#define MH_BATCH_PREFETCH 4
+/** Most keys looked up under one lock (getMany), no more than MH_READ_BUFFER_SIZE, so one chunk can't overflow the read buffer on its own. */
+#define MH_BATCH_CHUNK 64
+//@}
+
+/** Iteration batches (iterator()) hold key records, each followed by a result record if values were asked for.
+	A batch is cut off once it holds this many bytes (it always gets at least one key). */
+#define MH_ITER_BATCH_BYTES (1024 * 1024)
+/** Keys per batch when the caller doesn't say (must match MH_ITER_BATCH in main.js). */
+#define MH_ITER_BATCH 1000
+
+class BatchItem {
+public:
+	// one key (and value) unpacked from a batch, pointers are into the caller's buffer
+	unsigned char *key;
+	MH_KLEN_T keyLength;
+	unsigned char *content;
+	MH_LEN_T contentLength;
+	unsigned char flags;
+	uint64_t hash;
+	Shard *shard;
+};
 
 class MegaCache : public Napi::ObjectWrap<MegaCache> {
 public:
@@ -14,21 +51,43 @@ public:
 	~MegaCache();
 
 private:
-	static Napi::FunctionReference constructor;
-
 	Napi::Value Set(const Napi::CallbackInfo& info);
 	Napi::Value Get(const Napi::CallbackInfo& info);
 	Napi::Value Peek(const Napi::CallbackInfo& info);
+	Napi::Value GetView(const Napi::CallbackInfo& info);
+	Napi::Value GetMany(const Napi::CallbackInfo& info);
+	Napi::Value SetMany(const Napi::CallbackInfo& info);
+	Napi::Value BenchLookups(const Napi::CallbackInfo& info);
 	Napi::Value Has(const Napi::CallbackInfo& info);
 	Napi::Value Remove(const Napi::CallbackInfo& info);
 	Napi::Value Clear(const Napi::CallbackInfo& info);
+	Napi::Value ClearAsync(const Napi::CallbackInfo& info);
 	Napi::Value Stats(const Napi::CallbackInfo& info);
+	Napi::Value Instrument(const Napi::CallbackInfo& info);
+	Napi::Value Evict(const Napi::CallbackInfo& info);
+	Napi::Value Expire(const Napi::CallbackInfo& info);
+	Napi::Value SetLimits(const Napi::CallbackInfo& info);
+	Napi::Value DeleteWhere(const Napi::CallbackInfo& info);
+	Napi::Value Save(const Napi::CallbackInfo& info);
+	Napi::Value Load(const Napi::CallbackInfo& info);
+	Napi::Value SaveAsync(const Napi::CallbackInfo& info);
+	Napi::Value Close(const Napi::CallbackInfo& info);
 	Napi::Value FirstKey(const Napi::CallbackInfo& info);
 	Napi::Value NextKey(const Napi::CallbackInfo& info);
 	Napi::Value LastKey(const Napi::CallbackInfo& info);
 	Napi::Value PrevKey(const Napi::CallbackInfo& info);
-
-	Hash *hash;
+	Napi::Value EdgeKey(Napi::Env env, int64_t idx, int dir);
+	Napi::Value OpenCursor(const Napi::CallbackInfo& info);
+	Napi::Value ReadCursor(const Napi::CallbackInfo& info);
+	Napi::Value CloseCursor(const Napi::CallbackInfo& info);
+	void CloseCursors();
+	int IsClosed(Napi::Env env);
+	int ParseBatch(Napi::Env env, Napi::Value arg, int withValues, std::vector<BatchItem> &batch);
+	Napi::Value SnapshotInfo(Napi::Env env, SnapshotResult &res, const char *msg);
+	
+	ShardedHash *cache;
+	std::map<uint32_t, Cursor *> cursors; /**< Open iterators, by id. */
+	uint32_t nextCursorId;
 };
 
 #endif
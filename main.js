@@ -11,44 +11,102 @@ const MH_TYPE_OBJECT = 4;
 const MH_TYPE_BIGINT = 5;
 const MH_TYPE_NULL = 6;
 
-MegaCache.prototype.set = function(key, value) {
+// getMany() results for keys which were not found
+const MH_BATCH_MISSING = 0xFF;
+
+// keys evicted per event loop turn while working off a lowered limit (MH_SHRINK_BUDGET)
+const MH_SHRINK_BUDGET = 1024;
+
+// keys looked at per event loop turn by deleteWhere() (MH_DELETE_BUDGET), and the number of hash slices it works through
+const MH_DELETE_BUDGET = 10000;
+const MH_THIN_SLICES = 65536;
+
+// keys per native call for iterator() (MH_ITER_BATCH)
+const MH_ITER_BATCH = 1000;
+
+// instrument() times one in this many operations by default (MH_METRICS_SAMPLE)
+const MH_METRICS_SAMPLE = 8;
+
+// value type names for deleteWhere()
+const MH_TYPE_NAMES = {
+	buffer: MH_TYPE_BUFFER,
+	string: MH_TYPE_STRING,
+	number: MH_TYPE_NUMBER,
+	boolean: MH_TYPE_BOOLEAN,
+	object: MH_TYPE_OBJECT,
+	bigint: MH_TYPE_BIGINT,
+	null: MH_TYPE_NULL
+};
+
+function encodeValue(value) {
+	// convert value to buffer for storage, return [ buffer, type flags ]
+	if (Buffer.isBuffer(value)) return [ value, MH_TYPE_BUFFER ];
+	if (value === null) return [ Buffer.alloc(0), MH_TYPE_NULL ];
+	
+	var buf;
+	switch (typeof(value)) {
+		case 'object':
+			return [ Buffer.from( JSON.stringify(value) ), MH_TYPE_OBJECT ];
+		
+		case 'number':
+			buf = Buffer.alloc(8);
+			buf.writeDoubleBE( value );
+			return [ buf, MH_TYPE_NUMBER ];
+		
+		case 'bigint':
+			buf = Buffer.alloc(8);
+			buf.writeBigInt64BE( value );
+			return [ buf, MH_TYPE_BIGINT ];
+		
+		case 'boolean':
+			buf = Buffer.alloc(1);
+			buf.writeUInt8( value ? 1 : 0 );
+			return [ buf, MH_TYPE_BOOLEAN ];
+	}
+	
+	return [ Buffer.from(''+value, 'utf8'), MH_TYPE_STRING ];
+}
+
+function decodeValue(value, flags) {
+	// convert stored buffer back to its original format
+	switch (flags) {
+		case MH_TYPE_NULL: return null;
+		case MH_TYPE_OBJECT: return JSON.parse( value.toString() );
+		case MH_TYPE_NUMBER: return value.readDoubleBE();
+		case MH_TYPE_BIGINT: return value.readBigInt64BE();
+		case MH_TYPE_BOOLEAN: return (value.readUInt8() == 1) ? true : false;
+		case MH_TYPE_STRING: return value.toString();
+	}
+	return value;
+}
+
+function packKey(packed, offset, key) {
+	// write length-prefixed key into packed batch, return new offset
+	if (Buffer.isBuffer(key)) {
+		packed.writeUInt32LE( key.length, offset );
+		key.copy( packed, offset + 4 );
+		return offset + 4 + key.length;
+	}
+	var length = packed.write( key, offset + 4, 'utf8' );
+	packed.writeUInt32LE( length, offset );
+	return offset + 4 + length;
+}
+
+function keyLength(key) {
+	// byte length of key (strings are UTF-8), which must not be empty
+	var length = Buffer.isBuffer(key) ? key.length : Buffer.byteLength(key, 'utf8');
+	if (!length) throw new Error("Key must have length");
+	return length;
+}
+
+MegaCache.prototype.set = function(key, value, ttl) {
 	// store key/value in hash, auto-convert format to buffer
-	var flags = MH_TYPE_BUFFER;
+	// optional ttl is in seconds (omit or 0 for no expiration)
 	var keyBuf = Buffer.isBuffer(key) ? key : Buffer.from(''+key, 'utf8');
 	if (!keyBuf.length) throw new Error("Key must have length");
-	var valueBuf = value;
-	
-	if (!Buffer.isBuffer(valueBuf)) {
-		if (valueBuf === null) {
-			valueBuf = Buffer.alloc(0);
-			flags = MH_TYPE_NULL;
-		}
-		else if (typeof(valueBuf) == 'object') {
-			valueBuf = Buffer.from( JSON.stringify(value) );
-			flags = MH_TYPE_OBJECT;
-		}
-		else if (typeof(valueBuf) == 'number') {
-			valueBuf = Buffer.alloc(8);
-			valueBuf.writeDoubleBE( value );
-			flags = MH_TYPE_NUMBER;
-		}
-		else if (typeof(valueBuf) == 'bigint') {
-			valueBuf = Buffer.alloc(8);
-			valueBuf.writeBigInt64BE( value );
-			flags = MH_TYPE_BIGINT;
-		}
-		else if (typeof(valueBuf) == 'boolean') {
-			valueBuf = Buffer.alloc(1);
-			valueBuf.writeUInt8( value ? 1 : 0 );
-			flags = MH_TYPE_BOOLEAN;
-		}
-		else {
-			valueBuf = Buffer.from(''+value, 'utf8');
-			flags = MH_TYPE_STRING;
-		}
-	}
 	
-	return this._set(keyBuf, valueBuf, flags);
+	var encoded = encodeValue( value );
+	return this._set(keyBuf, encoded[0], encoded[1], ttl || 0);
 };
 
 MegaCache.prototype.get = function(key) {
@@ -58,34 +116,7 @@ MegaCache.prototype.get = function(key) {
 	
 	var value = this._get( keyBuf );
 	if (!value || !value.flags) return value;
-	
-	switch (value.flags) {
-		case MH_TYPE_NULL:
-			value = null;
-		break;
-		
-		case MH_TYPE_OBJECT: 
-			value = JSON.parse( value.toString() ); 
-		break;
-		
-		case MH_TYPE_NUMBER:
-			value = value.readDoubleBE();
-		break;
-		
-		case MH_TYPE_BIGINT:
-			value = value.readBigInt64BE();
-		break;
-		
-		case MH_TYPE_BOOLEAN:
-			value = (value.readUInt8() == 1) ? true : false;
-		break;
-		
-		case MH_TYPE_STRING:
-			value = value.toString();
-		break;
-	}
-	
-	return value;
+	return decodeValue( value, value.flags );
 };
 
 MegaCache.prototype.peek = function(key) {
@@ -95,34 +126,89 @@ MegaCache.prototype.peek = function(key) {
 	
 	var value = this._peek( keyBuf );
 	if (!value || !value.flags) return value;
+	return decodeValue( value, value.flags );
+};
+
+MegaCache.prototype.getMany = function(keys) {
+	// fetch values for array of keys in one native call, return array of values in the same order
+	// missing keys are undefined, buffer values are slices of one shared buffer
+	var idx, total = 0;
+	var list = new Array( keys.length );
+	for (idx = 0; idx < keys.length; idx++) {
+		list[idx] = Buffer.isBuffer(keys[idx]) ? keys[idx] : (''+keys[idx]);
+		total += 4 + keyLength( list[idx] );
+	}
 	
-	switch (value.flags) {
-		case MH_TYPE_NULL:
-			value = null;
-		break;
-		
-		case MH_TYPE_OBJECT: 
-			value = JSON.parse( value.toString() ); 
-		break;
-		
-		case MH_TYPE_NUMBER:
-			value = value.readDoubleBE();
-		break;
-		
-		case MH_TYPE_BIGINT:
-			value = value.readBigInt64BE();
-		break;
+	var packed = Buffer.allocUnsafe( total );
+	var offset = 0;
+	for (idx = 0; idx < list.length; idx++) offset = packKey( packed, offset, list[idx] );
+	
+	var results = this._getMany( packed );
+	var values = new Array( keys.length );
+	offset = 0;
+	
+	for (idx = 0; idx < keys.length; idx++) {
+		var flags = results[offset];
+		var length = results.readUInt32LE( offset + 1 );
+		offset += 5;
 		
-		case MH_TYPE_BOOLEAN:
-			value = (value.readUInt8() == 1) ? true : false;
-		break;
+		// strings are by far the most common, and can be decoded without a slice
+		if (flags == MH_TYPE_STRING) values[idx] = results.toString( 'utf8', offset, offset + length );
+		else if (flags != MH_BATCH_MISSING) values[idx] = decodeValue( results.subarray(offset, offset + length), flags );
+		offset += length;
+	}
+	
+	return values;
+};
+
+MegaCache.prototype.setMany = function(entries, ttl) {
+	// store array of [key, value] pairs (or a Map) in one native call, with optional ttl for all of them
+	// return number of keys stored (fewer than given means some failed, i.e. out of memory)
+	if (!Array.isArray(entries)) entries = Array.from( entries );
+	var idx, total = 0;
+	var keys = new Array( entries.length );
+	var values = new Array( entries.length );
+	var types = new Uint8Array( entries.length );
+	
+	for (idx = 0; idx < entries.length; idx++) {
+		var key = entries[idx][0];
+		var value = entries[idx][1];
+		keys[idx] = Buffer.isBuffer(key) ? key : (''+key);
+		total += 4 + keyLength( keys[idx] ) + 5;
 		
-		case MH_TYPE_STRING:
-			value = value.toString();
-		break;
+		// strings are written straight into the batch, everything else is converted to a buffer first
+		if (typeof(value) == 'string') {
+			values[idx] = value;
+			types[idx] = MH_TYPE_STRING;
+			total += Buffer.byteLength( value, 'utf8' );
+		}
+		else {
+			var encoded = encodeValue( value );
+			values[idx] = encoded[0];
+			types[idx] = encoded[1];
+			total += encoded[0].length;
+		}
 	}
 	
-	return value;
+	var packed = Buffer.allocUnsafe( total );
+	var offset = 0;
+	for (idx = 0; idx < entries.length; idx++) {
+		offset = packKey( packed, offset, keys[idx] );
+		var length = (types[idx] == MH_TYPE_STRING) ? packed.write( values[idx], offset + 5, 'utf8' ) : values[idx].copy( packed, offset + 5 );
+		packed.writeUInt32LE( length, offset );
+		packed[offset + 4] = types[idx];
+		offset += 5 + length;
+	}
+	
+	return this._setMany( packed, ttl || 0 );
+};
+
+MegaCache.prototype.getView = function(key) {
+	// fetch value given key without copying it, always returns a buffer (pointing into the cache, so do not modify it)
+	var keyBuf = Buffer.isBuffer(key) ? key : Buffer.from(''+key, 'utf8');
+	if (!keyBuf.length) throw new Error("Key must have length");
+	
+	return this._getView( keyBuf );
 };
 
 MegaCache.prototype.has = function(key) {
@@ -167,6 +253,146 @@ MegaCache.prototype.prevKey = function(key) {
 	}
 };
 
+function CacheIterator(cache, opts) {
+	// walks the cache in LRU order with a native cursor, fetching keys (and values) a packed batch at a time
+	// the cursor survives deletes and evictions, and is closed at the end, by close(), or by breaking out of a for...of loop
+	this.cache = cache;
+	this.values = !!opts.values;
+	this.keyBuffers = !!opts.keyBuffers;
+	this.batchSize = opts.batchSize || MH_ITER_BATCH;
+	this.id = cache._openCursor( !!opts.reverse );
+	this.batch = null;
+	this.pos = 0;
+}
+
+CacheIterator.prototype.nextBatch = function() {
+	// return array of the next keys (or [key, value] pairs), or null when done
+	if (!this.id) return null;
+	var packed = this.cache._readCursor( this.id, this.batchSize, this.values );
+	if (!packed.length) {
+		this.id = 0;
+		return null;
+	}
+	
+	var batch = [];
+	var offset = 0;
+	while (offset < packed.length) {
+		var length = packed.readUInt32LE( offset );
+		var key = this.keyBuffers ? packed.subarray( offset + 4, offset + 4 + length ) : packed.toString( 'utf8', offset + 4, offset + 4 + length );
+		offset += 4 + length;
+		
+		if (this.values) {
+			var flags = packed[offset];
+			length = packed.readUInt32LE( offset + 1 );
+			offset += 5;
+			batch.push([ key, (flags == MH_TYPE_STRING) ? packed.toString('utf8', offset, offset + length) : decodeValue(packed.subarray(offset, offset + length), flags) ]);
+			offset += length;
+		}
+		else batch.push( key );
+	}
+	return batch;
+};
+
+CacheIterator.prototype.next = function() {
+	// iterator protocol: one key (or [key, value] pair) at a time, out of the current batch
+	if (!this.batch || (this.pos >= this.batch.length)) {
+		this.batch = this.nextBatch();
+		this.pos = 0;
+		if (!this.batch) return { done: true, value: undefined };
+	}
+	return { done: false, value: this.batch[ this.pos++ ] };
+};
+
+CacheIterator.prototype.close = CacheIterator.prototype.return = function() {
+	// stop early and release the cursor (called automatically by for...of on break)
+	if (this.id) this.cache._closeCursor( this.id );
+	this.id = 0;
+	this.batch = null;
+	return { done: true, value: undefined };
+};
+
+CacheIterator.prototype[Symbol.iterator] = function() {
+	return this;
+};
+
+MegaCache.prototype.iterator = function(opts) {
+	// iterate over keys in LRU order (most popular first), see CacheIterator
+	return new CacheIterator( this, opts || {} );
+};
+
+MegaCache.prototype[Symbol.iterator] = function() {
+	// for...of over the cache yields [key, value] pairs, like a Map
+	return this.iterator({ values: true });
+};
+
+MegaCache.prototype.setLimits = function(maxKeys, maxBytes) {
+	// change maxKeys and maxBytes at runtime, resolve with the number of keys evicted to get under the new limits
+	// a lower limit is worked off a batch at a time, yielding to the event loop in between
+	var self = this;
+	var total = 0;
+	var over = this._setLimits( maxKeys || 0, maxBytes || 0 );
+	
+	return new Promise( function(resolve) {
+		function shrink() {
+			var count = 0;
+			try { count = self.evict( MH_SHRINK_BUDGET ); }
+			catch (err) { count = 0; } // closed in the meantime
+			total += count;
+			if (count) setImmediate( shrink );
+			else resolve( total );
+		}
+		if (over) setImmediate( shrink );
+		else resolve( 0 );
+	} );
+};
+
+MegaCache.prototype.deleteWhere = function(opts) {
+	// delete all keys starting with opts.prefix and/or holding one of opts.types, resolve with { numKeys, numBytes, elapsed }
+	// the hash is worked through a slice at a time, yielding to the event loop in between
+	var self = this;
+	if (!opts) opts = {};
+	var prefix = null;
+	var typeMask = 0;
+	
+	if (typeof(opts.prefix) != 'undefined') {
+		prefix = Buffer.isBuffer(opts.prefix) ? opts.prefix : Buffer.from(''+opts.prefix, 'utf8');
+	}
+	[].concat( opts.types || [] ).forEach( function(name) {
+		if (!(name in MH_TYPE_NAMES)) throw new TypeError("Unknown value type: " + name);
+		typeMask |= (1 << MH_TYPE_NAMES[name]);
+	} );
+	
+	var result = { numKeys: 0, numBytes: 0, elapsed: 0 };
+	var cursor = 0;
+	var start = process.hrtime.bigint();
+	
+	return new Promise( function(resolve, reject) {
+		function step() {
+			var info;
+			try { info = self._deleteWhere( prefix, typeMask, cursor, MH_DELETE_BUDGET ); }
+			catch (err) { return reject(err); } // closed in the meantime
+			
+			cursor = info[0];
+			result.numKeys += info[1];
+			result.numBytes += info[2];
+			if (cursor < MH_THIN_SLICES) return setImmediate( step );
+			
+			result.elapsed = Number( process.hrtime.bigint() - start ) / 1000000;
+			resolve( result );
+		}
+		step();
+	} );
+};
+
+MegaCache.prototype.instrument = function(opts) {
+	// turn operation counters and latency histograms on (true, or { sample }) or off (false), see stats()
+	// turning them off throws away everything counted so far
+	var sample = 0;
+	if (opts === true) sample = MH_METRICS_SAMPLE;
+	else if (opts && (typeof(opts) == 'object')) sample = Math.max( 1, Math.floor(opts.sample || MH_METRICS_SAMPLE) );
+	this._instrument( sample );
+};
+
 MegaCache.prototype.length = function() {
 	// shortcut for numKeys
 	return this.stats().numKeys;
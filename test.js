@@ -3,6 +3,9 @@
 
 // Run via: npm test
 
+const fs = require('fs');
+const os = require('os');
+const Path = require('path');
 const MegaCache = require('./');
 
 module.exports = {
@@ -210,6 +213,33 @@ module.exports = {
 			test.done();
 		},
 		
+		function testReplaceInPlace(test) {
+			// same-size replacements reuse the existing allocation
+			var hash = new MegaCache();
+			hash.set("counter", 1);
+			hash.set("other", "value");
+			var before = hash.stats();
+			
+			for (var idx = 2; idx <= 100; idx++) {
+				test.ok( hash.set("counter", idx) === 2, "Replace returns 2" );
+			}
+			
+			var stats = hash.stats();
+			test.ok( hash.get("counter") === 100, "Replaced value is correct: " + hash.get("counter") );
+			test.ok( stats.numKeys === 2, '2 keys in stats' );
+			test.ok( stats.dataSize === before.dataSize, 'Data size unchanged: ' + stats.dataSize );
+			test.ok( stats.arenaUsed === before.arenaUsed, 'Arena usage unchanged: ' + stats.arenaUsed );
+			
+			// shorter and longer values still work, and replace promotes to LRU head
+			hash.set("other", "value that is quite a bit longer than the original one");
+			test.ok( hash.get("other") === "value that is quite a bit longer than the original one", "Longer value is correct" );
+			hash.set("counter", "x");
+			test.ok( hash.peek("counter") === "x", "Shorter value is correct" );
+			test.ok( hash.nextKey() === "counter", "Replaced key is at LRU head" );
+			test.ok( hash.stats().dataSize === ("counter".length + 1 + "other".length + 54), "Data size is correct after resize: " + hash.stats().dataSize );
+			test.done();
+		},
+		
 		function testSetReturnValue(test) {
 			// make sure set() returns the expected return values
 			var hash = new MegaCache();
@@ -310,6 +340,437 @@ module.exports = {
 			test.done();
 		},
 		
+		function testClearAsync(test) {
+			// the cache is empty as soon as clearAsync() returns, and the memory is freed in the background
+			var idx;
+			var hash = new MegaCache( 0, 0, { shards: 4, policy: 'tinylfu' } );
+			for (idx = 0; idx < 10000; idx++) {
+				hash.set( "key" + idx, "value here " + idx, (idx % 2) ? 3600 : 0 );
+			}
+			
+			var promise = hash.clearAsync();
+			var stats = hash.stats();
+			test.ok( stats.numKeys === 0, '0 keys in stats: ' + stats.numKeys );
+			test.ok( stats.dataSize === 0, '0 bytes in data store: ' + stats.dataSize );
+			test.ok( stats.numIndexes === 4, '1 index per shard: ' + stats.numIndexes );
+			test.ok( hash.get("key5") === undefined, "Key is gone right away" );
+			
+			// the cache is usable while the old memory is being freed
+			hash.set( "after", "still works" );
+			
+			var table = new MegaCache( 0, 0, { engine: 'table' } );
+			for (idx = 0; idx < 1000; idx++) table.set( "key" + idx, "value here " + idx );
+			
+			promise.then( function(info) {
+				test.ok( info.numKeys === 10000, "clearAsync() reports keys removed: " + info.numKeys );
+				test.ok( info.numBytes > 0, "clearAsync() reports bytes freed: " + info.numBytes );
+				test.ok( info.pause <= info.elapsed, "pause is part of elapsed: " + info.pause + " vs " + info.elapsed );
+				test.ok( hash.get("after") === "still works", "Key stored after clearAsync() survived" );
+				test.ok( hash.stats().numKeys === 1, "1 key in stats: " + hash.stats().numKeys );
+				
+				// the timer wheel was swapped out too, so reaping finds nothing stale
+				test.ok( hash.expire() === 0, "No timers left over" );
+				return table.clearAsync();
+			} ).then( function(info) {
+				test.ok( info.numKeys === 1000, "Table engine cleared: " + info.numKeys );
+				test.ok( table.stats().numKeys === 0, "Table engine is empty" );
+				table.set( "again", "value" );
+				test.ok( table.get("again") === "value", "Table engine works after clearAsync()" );
+				
+				// with a view holding a bucket, this falls back to a regular clear
+				var pinned = new MegaCache();
+				pinned.set( "big", Buffer.alloc(100000, 1) );
+				pinned.set( "small", "value" );
+				var view = pinned.getView( "big" );
+				var result = pinned.clearAsync();
+				test.ok( pinned.stats().numKeys === 0, "Pinned cache is empty" );
+				test.ok( view[99999] === 1, "View still readable" );
+				return result;
+			} ).then( function(info) {
+				test.ok( info.numKeys === 2, "Pinned fallback reports keys removed: " + info.numKeys );
+				
+				// closing the cache right away still lets the free finish
+				var closed = new MegaCache();
+				closed.set( "key", "value" );
+				var result = closed.clearAsync();
+				closed.close();
+				return result;
+			} ).then( function(info) {
+				test.ok( info.numKeys === 1, "Clear finished after close(): " + info.numKeys );
+				test.done();
+			} );
+		},
+		
+		function testDeleteWhere(test) {
+			// delete by key prefix and value type, over several event loop turns
+			var idx;
+			var hash = new MegaCache( 0, 0, { shards: 4 } );
+			var table = new MegaCache( 0, 0, { engine: 'table' } );
+			[hash, table].forEach( function(cache) {
+				for (idx = 0; idx < 30000; idx++) {
+					cache.set( "tenant" + (idx % 3) + ":" + idx, (idx % 2) ? { num: idx } : "value here " + idx );
+				}
+			} );
+			var before = hash.stats();
+			
+			var promise = hash.deleteWhere({ prefix: "tenant1:" });
+			
+			// the cache is usable while it runs
+			hash.set( "tenant2:late", "late value" );
+			var late = new MegaCache();
+			late.set( "tenant2:late", "late value" );
+			var lateBytes = late.stats().dataSize + late.stats().metaSize;
+			
+			promise.then( function(info) {
+				var stats = hash.stats();
+				test.ok( info.numKeys === 10000, "deleteWhere() reports keys deleted: " + info.numKeys );
+				test.ok( stats.numKeys === 20001, "Other keys are left: " + stats.numKeys );
+				test.ok( info.numBytes === (before.dataSize + before.metaSize + lateBytes) - (stats.dataSize + stats.metaSize), "numBytes matches the stats: " + info.numBytes );
+				test.ok( info.elapsed >= 0, "deleteWhere() reports elapsed time" );
+				test.ok( !hash.has("tenant1:1") && !hash.has("tenant1:29998"), "Matching keys are gone" );
+				test.ok( hash.get("tenant0:0") === "value here 0", "Other keys are intact" );
+				test.ok( hash.get("tenant2:late") === "late value", "Other key stored during the scan is intact" );
+				
+				// only objects, within one prefix
+				return table.deleteWhere({ prefix: "tenant0:", types: ["object"] });
+			} ).then( function(info) {
+				test.ok( info.numKeys === 5000, "Table engine deleted objects under the prefix: " + info.numKeys );
+				test.ok( table.get("tenant0:3") === undefined, "Object under the prefix is gone" );
+				test.ok( table.get("tenant0:0") === "value here 0", "String under the prefix is intact" );
+				test.ok( table.get("tenant1:1").num === 1, "Object under another prefix is intact" );
+				
+				// no prefix matches everything, and several types can be given
+				return table.deleteWhere({ types: ["string", "object"] });
+			} ).then( function(info) {
+				test.ok( info.numKeys === 25000, "Deleted all strings and objects: " + info.numKeys );
+				test.ok( table.stats().numKeys === 0, "Table is empty: " + table.stats().numKeys );
+				
+				var err = null;
+				try { table.deleteWhere({ types: ["date"] }); }
+				catch (e) { err = e; }
+				test.ok( !!err, "deleteWhere() threw on unknown type" );
+				
+				// walking empty slices costs budget too, so one call on an empty cache still stops early
+				var empty = new MegaCache( 0, 0, { shards: 4 } );
+				var cursor = empty._deleteWhere( null, 0, 0, 1000 )[0];
+				test.ok( (cursor > 0) && (cursor < 1000), "Empty cache stopped early: " + cursor );
+				test.done();
+			} );
+		},
+		
+		function testArenaStats(test) {
+			// all buckets and indexes live in slabs, clear() releases them wholesale
+			var hash = new MegaCache();
+			for (var idx = 0; idx < 10000; idx++) {
+				hash.set( "key" + idx, "value here " + idx );
+			}
+			
+			var stats = hash.stats();
+			test.ok(stats.numSlabs > 0, 'Slabs in use: ' + stats.numSlabs);
+			test.ok(stats.arenaUsed >= stats.indexSize + stats.metaSize + stats.dataSize, 'Arena covers all data: ' + stats.arenaUsed);
+			test.ok(stats.arenaSize >= stats.arenaUsed, 'Arena size covers used bytes: ' + stats.arenaSize);
+			test.ok(stats.fragmentation >= 0 && stats.fragmentation < 1, 'Fragmentation is a ratio: ' + stats.fragmentation);
+			
+			// emptying a size class gives its memory back, even from the last slab, which is kept
+			var big = Buffer.alloc( 1000 );
+			for (idx = 0; idx < 1000; idx++) hash.set( "big" + idx, big );
+			var before = hash.stats().arenaSize;
+			for (idx = 0; idx < 1000; idx++) hash.delete( "big" + idx );
+			stats = hash.stats();
+			test.ok(before - stats.arenaSize > 900000, 'Emptied size class was given back: ' + (before - stats.arenaSize));
+			
+			hash.clear();
+			stats = hash.stats();
+			test.ok(stats.numSlabs === 1, 'Only root index slab remains after clear: ' + stats.numSlabs);
+			test.ok(stats.numIndexes === 1, '1 index in stats');
+			
+			hash.set( "hello", "there" );
+			test.ok(hash.get("hello") === "there", 'Cache still usable after clear');
+			test.done();
+		},
+		
+		function testInstrumentation(test) {
+			// counters and latencies show up in stats() only while turned on
+			var idx;
+			var hash = new MegaCache( 0, 0, { shards: 4 } );
+			hash.set( "before", 1 );
+			test.ok( hash.stats().instrumented === false, "Off by default" );
+			test.ok( !("hits" in hash.stats()), "No counters while off" );
+			
+			hash.instrument({ sample: 1 });
+			for (idx = 0; idx < 1000; idx++) hash.set( "key" + idx, "value here " + idx );
+			for (idx = 0; idx < 500; idx++) hash.set( "key" + idx, "new value " + idx );
+			for (idx = 0; idx < 1500; idx++) hash.get( "key" + idx );
+			test.ok( hash.has("key1") && !hash.has("nope"), "has() still works" );
+			for (idx = 0; idx < 100; idx++) hash.delete( "key" + idx );
+			hash.delete( "nope" );
+			hash.getMany([ "key100", "key101", "missing" ]);
+			hash.setMany([ [ "key2000", 1 ] ]);
+			
+			var stats = hash.stats();
+			test.ok( stats.instrumented === true, "Turned on" );
+			test.ok( stats.adds == 1001, "Adds: " + stats.adds );
+			test.ok( stats.replaces == 500, "Replaces: " + stats.replaces );
+			test.ok( stats.hits == 1000 + 1 + 2, "Hits: " + stats.hits );
+			test.ok( stats.misses == 500 + 1 + 1, "Misses: " + stats.misses );
+			test.ok( Math.abs(stats.hitRatio - (1003 / 1505)) < 0.0001, "Hit ratio: " + stats.hitRatio );
+			test.ok( stats.removes == 100, "Removes (missing key not counted): " + stats.removes );
+			test.ok( stats.sample == 1, "Sample rate: " + stats.sample );
+			
+			// every operation timed, and the percentiles are in order
+			var lat = stats.latency;
+			test.ok( lat.get.count == 1505 && lat.set.count == 1501 && lat.delete.count == 101, "Timed every op: " + lat.get.count + ", " + lat.set.count + ", " + lat.delete.count );
+			[ 'get', 'set', 'delete' ].forEach( function(op) {
+				var info = lat[op];
+				test.ok( info.p50 > 0 && info.p50 <= info.p90 && info.p90 <= info.p99 && info.p99 <= info.p999 && info.p999 <= info.max, op + " percentiles in order: " + JSON.stringify(info) );
+				test.ok( info.mean > 0 && info.mean <= info.max, op + " mean within range" );
+				test.ok( info.max < 1000000, op + " max under a second" );
+			} );
+			
+			// sampling only thins out the timing, counters still see everything
+			hash.instrument({ sample: 10 });
+			for (idx = 0; idx < 1000; idx++) hash.get( "key" + idx );
+			stats = hash.stats();
+			test.ok( stats.hits == 1003 + 900, "Counts kept when changing the sample rate: " + stats.hits );
+			test.ok( stats.latency.get.count > 1505 && stats.latency.get.count <= 1505 + 101, "Sampled timing: " + stats.latency.get.count );
+			
+			// off throws it all away, back on starts from zero
+			hash.instrument(false);
+			stats = hash.stats();
+			test.ok( stats.instrumented === false && !stats.latency, "Turned off" );
+			hash.instrument(true);
+			hash.get( "key500" );
+			stats = hash.stats();
+			test.ok( stats.hits == 1 && stats.misses == 0 && stats.adds == 0, "Fresh counters: " + stats.hits );
+			test.ok( stats.sample == 8, "Default sample rate: " + stats.sample );
+			
+			// key layout on request, for both engines
+			test.ok( !hash.stats().shape, "No shape unless asked for" );
+			var shape = hash.stats({ shape: true }).shape;
+			var total = shape.depths.reduce( function(a, b) { return a + b; }, 0 );
+			test.ok( total == hash.stats().numKeys, "Depths cover every key: " + total );
+			test.ok( shape.depths.length > 1, "Keys spread over index levels: " + JSON.stringify(shape.depths) );
+			test.ok( shape.maxChain >= 1 && shape.maxChain <= 32, "Max chain length: " + shape.maxChain );
+			test.ok( shape.avgChain >= 1 && shape.avgChain <= shape.maxChain, "Avg chain length: " + shape.avgChain );
+			hash.close();
+			
+			var table = new MegaCache( 0, 0, { engine: 'table' } );
+			for (idx = 0; idx < 5000; idx++) table.set( "key" + idx, idx );
+			shape = table.stats({ shape: true }).shape;
+			total = shape.depths.reduce( function(a, b) { return a + b; }, 0 );
+			test.ok( total == 5000, "Table depths cover every key: " + total );
+			test.ok( shape.depths[0] > 4000, "Most keys in their home group: " + shape.depths[0] );
+			test.ok( shape.maxChain >= 1, "Longest probe: " + shape.maxChain );
+			test.done();
+		},
+		
+		function testShards(test) {
+			// keys are spread across shards, but it all still looks like one cache
+			var idx, key, count;
+			var hash = new MegaCache( 0, 0, { shards: 16 } );
+			for (idx = 0; idx < 1000; idx++) {
+				hash.set( "key" + idx, "value here " + idx );
+			}
+			
+			var stats = hash.stats();
+			test.ok(stats.numShards === 16, '16 shards in stats: ' + stats.numShards);
+			test.ok(stats.numKeys === 1000, '1000 keys in stats: ' + stats.numKeys);
+			test.ok(stats.numIndexes >= 16, 'At least one index per shard: ' + stats.numIndexes);
+			
+			for (idx = 0; idx < 1000; idx++) {
+				if (hash.get("key" + idx) !== "value here " + idx) test.ok(false, 'Incorrect value for key' + idx);
+			}
+			
+			// iteration crosses shard boundaries in both directions
+			for (count = 0, key = hash.nextKey(); key; key = hash.nextKey(key)) count++;
+			test.ok(count === 1000, 'Iterated forward 1000 times: ' + count);
+			
+			for (count = 0, key = hash.prevKey(); key; key = hash.prevKey(key)) count++;
+			test.ok(count === 1000, 'Iterated backward 1000 times: ' + count);
+			
+			test.ok(hash.delete("key500"), 'Deleted key from its shard');
+			test.ok(!hash.has("key500"), 'Deleted key is gone');
+			
+			hash.clear();
+			test.ok(hash.stats().numKeys === 0, 'All shards cleared');
+			
+			// limits are split across shards
+			hash = new MegaCache( 1600, 0, { shards: 16 } );
+			for (idx = 0; idx < 10000; idx++) {
+				hash.set( "key" + idx, "value here " + idx );
+			}
+			stats = hash.stats();
+			test.ok(stats.numKeys <= 1600 && stats.numKeys > 1400, 'numKeys near maxKeys: ' + stats.numKeys);
+			test.ok(stats.numEvictions === 10000 - stats.numKeys, 'numEvictions is correct: ' + stats.numEvictions);
+			
+			test.done();
+		},
+		
+		function testBadPolicy(test) {
+			// unknown policy names are rejected
+			var err = null;
+			try { new MegaCache( 0, 0, { policy: 'random' } ); }
+			catch (e) { err = e; }
+			test.ok( !!err, "Constructor threw on unknown policy" );
+			test.done();
+		},
+		
+		function testIndexFanout(test) {
+			// wider index levels, same keys, and slices still follow the key hash exactly
+			var idx, slice;
+			var narrow = new MegaCache( 0, 0, { shards: 4 } );
+			var wide = new MegaCache( 0, 0, { shards: 4, rootFanout: 256, fanout: 64 } );
+			for (idx = 0; idx < 20000; idx++) {
+				narrow.set( "key" + idx, "value here " + idx );
+				wide.set( "key" + idx, "value here " + idx );
+			}
+			
+			var stats = wide.stats();
+			test.ok(stats.numKeys === 20000, '20000 keys in stats: ' + stats.numKeys);
+			test.ok(stats.numIndexes < narrow.stats().numIndexes, 'Fewer indexes with wider fan-out: ' + stats.numIndexes);
+			
+			for (idx = 0; idx < 20000; idx++) {
+				if (wide.get("key" + idx) !== "value here " + idx) test.ok(false, 'Incorrect value for key' + idx);
+			}
+			
+			for (slice = 0; slice < 256; slice++) {
+				narrow.clear(slice);
+				wide.clear(slice);
+				if (wide.stats().numKeys !== narrow.stats().numKeys) {
+					test.ok(false, 'Slice ' + slice + ' cleared different keys: ' + wide.stats().numKeys + ' vs ' + narrow.stats().numKeys);
+					break;
+				}
+			}
+			test.ok(wide.stats().numKeys === 0, '0 keys after clearing every slice: ' + wide.stats().numKeys);
+			test.ok(wide.stats().numIndexes === 4, 'One index per shard after clear: ' + wide.stats().numIndexes);
+			
+			var err = null;
+			try { new MegaCache( 0, 0, { fanout: 100 } ); }
+			catch (e) { err = e; }
+			test.ok( !!err, "Constructor threw on bad fanout" );
+			test.done();
+		},
+		
+		function testTableEngine(test) {
+			// flat table engine, grown from empty, deletes leave tombstones, and slices match the trie
+			var idx, slice;
+			var trie = new MegaCache( 0, 0, { shards: 4 } );
+			var table = new MegaCache( 0, 0, { shards: 4, engine: 'table' } );
+			for (idx = 0; idx < 50000; idx++) {
+				trie.set( "key" + idx, "value here " + idx );
+				table.set( "key" + idx, "value here " + idx );
+			}
+			
+			var stats = table.stats();
+			test.ok(stats.numKeys === 50000, '50000 keys in stats: ' + stats.numKeys);
+			test.ok(stats.numRebuilds > 0, 'Table was grown: ' + stats.numRebuilds);
+			
+			for (idx = 0; idx < 50000; idx += 2) {
+				table.delete( "key" + idx );
+				trie.delete( "key" + idx );
+			}
+			test.ok(table.stats().numKeys === 25000, '25000 keys after delete: ' + table.stats().numKeys);
+			
+			for (idx = 0; idx < 50000; idx++) {
+				var value = table.get("key" + idx);
+				if (value !== ((idx % 2) ? "value here " + idx : undefined)) test.ok(false, 'Incorrect value for key' + idx + ': ' + value);
+			}
+			
+			var values = table.getMany([ "key1", "key2", "key3", "nope" ]);
+			test.ok(values[0] === "value here 1", 'getMany found key1: ' + values[0]);
+			test.ok(values[1] === undefined, 'getMany missed deleted key2: ' + values[1]);
+			test.ok(values[3] === undefined, 'getMany missed unknown key: ' + values[3]);
+			
+			for (slice = 0; slice < 256; slice++) {
+				trie.clear(slice);
+				table.clear(slice);
+				if (table.stats().numKeys !== trie.stats().numKeys) {
+					test.ok(false, 'Slice ' + slice + ' cleared different keys: ' + table.stats().numKeys + ' vs ' + trie.stats().numKeys);
+					break;
+				}
+			}
+			test.ok(table.stats().numKeys === 0, '0 keys after clearing every slice: ' + table.stats().numKeys);
+			
+			table.set( "again", "still works" );
+			table.clear();
+			test.ok(table.get("again") === undefined, 'Key gone after full clear');
+			test.ok(table.stats().numIndexes === 4, 'One table per shard after clear: ' + table.stats().numIndexes);
+			
+			var err = null;
+			try { new MegaCache( 0, 0, { engine: 'btree' } ); }
+			catch (e) { err = e; }
+			test.ok( !!err, "Constructor threw on unknown engine" );
+			test.done();
+		},
+		
+		function testSmallBuckets(test) {
+			// small keys and values get 1 byte lengths, and switch formats as values grow and shrink
+			var cache = new MegaCache();
+			var big = "B".repeat(300);
+			
+			cache.set( "small", "tiny" );
+			test.ok( cache.stats().metaSize == 41, "Small format metaSize: " + cache.stats().metaSize );
+			
+			cache.set( "small", big );
+			test.ok( cache.get("small") === big, "Value grew into the full format" );
+			test.ok( cache.stats().metaSize == 45, "Full format metaSize: " + cache.stats().metaSize );
+			
+			cache.set( "small", "tiny again" );
+			test.ok( cache.get("small") === "tiny again", "Value shrank back into the small format" );
+			test.ok( cache.stats().metaSize == 41, "Small format metaSize again: " + cache.stats().metaSize );
+			
+			var longKey = "K".repeat(256);
+			cache.set( longKey, "tiny" );
+			test.ok( cache.get(longKey) === "tiny", "Long key with small value" );
+			test.ok( cache.stats().metaSize == 41 + 45, "Long key uses the full format: " + cache.stats().metaSize );
+			
+			cache.set( "empty", "" );
+			test.ok( cache.get("empty") === "", "Empty value in the small format" );
+			
+			cache.delete( "small" );
+			cache.delete( longKey );
+			cache.delete( "empty" );
+			test.ok( cache.stats().metaSize == 0, "metaSize is zero after delete: " + cache.stats().metaSize );
+			test.ok( cache.stats().dataSize == 0, "dataSize is zero after delete: " + cache.stats().dataSize );
+			test.done();
+		},
+		
+		function testSharedWorkers(test) {
+			// share a named cache with worker threads, all writing at once
+			var Worker = require('worker_threads').Worker;
+			var hash = new MegaCache( 0, 0, { name: 'testSharedWorkers', shards: 4 } );
+			hash.set( "from_main", "hello" );
+			
+			var code = [
+				"const { parentPort, workerData } = require('worker_threads');",
+				"const MegaCache = require(" + JSON.stringify(__dirname) + ");",
+				"var hash = new MegaCache( 0, 0, { name: 'testSharedWorkers' } );",
+				"for (var idx = 0; idx < 10000; idx++) hash.set( 'worker' + workerData + '_' + idx, idx );",
+				"parentPort.postMessage( hash.get('from_main') );"
+			].join("\n");
+			
+			var numRunning = 2;
+			for (var idx = 0; idx < 2; idx++) {
+				var worker = new Worker( code, { eval: true, workerData: idx } );
+				worker.on('message', function(msg) {
+					test.ok(msg === "hello", 'Worker can see key from main thread: ' + msg);
+				});
+				worker.on('exit', function() {
+					if (--numRunning) return;
+					
+					var stats = hash.stats();
+					test.ok(stats.numShards === 4, 'Attached to the existing cache: ' + stats.numShards);
+					test.ok(stats.numKeys === 20001, 'Keys from both workers are here: ' + stats.numKeys);
+					test.ok(hash.get("worker0_5000") === 5000, 'Key from worker 0 is correct');
+					test.ok(hash.get("worker1_9999") === 9999, 'Key from worker 1 is correct');
+					test.done();
+				});
+			}
+			
+			// read while the workers are writing
+			for (var idx = 0; idx < 10000; idx++) hash.get( "worker0_" + idx );
+		},
+		
 		function testKeyIteration(test) {
 			var hash = new MegaCache();
 			hash.set("key1", "value1");
@@ -424,6 +885,79 @@ module.exports = {
 			test.done();
 		},
 		
+		function testIterator(test) {
+			// native cursor yields the same order as nextKey(), in batches
+			var idx;
+			var hash = new MegaCache( 0, 0, { shards: 4 } );
+			for (idx = 0; idx < 5000; idx++) {
+				hash.set( "key" + idx, (idx % 2) ? { num: idx } : "value here " + idx );
+			}
+			
+			var expected = [];
+			for (var key = hash.nextKey(); key; key = hash.nextKey(key)) expected.push( key );
+			
+			var keys = [];
+			for (key of hash.iterator({ batchSize: 64 })) keys.push( key );
+			test.ok( keys.length == 5000, "Iterated all keys: " + keys.length );
+			test.ok( keys.join(',') == expected.join(','), "Same order as nextKey()" );
+			
+			var reversed = Array.from( hash.iterator({ reverse: true }) );
+			test.ok( reversed.join(',') == expected.slice().reverse().join(','), "Reverse order matches prevKey() direction" );
+			
+			var count = 0;
+			for (var pair of hash) {
+				idx = parseInt( pair[0].substring(3), 10 );
+				if (idx % 2) test.ok( pair[1].num === idx, "Object value decoded" );
+				else test.ok( pair[1] === "value here " + idx, "String value decoded" );
+				count++;
+			}
+			test.ok( count == 5000, "for...of over the cache yields all pairs: " + count );
+			
+			// deleting the keys just ahead of the cursor moves it along, instead of losing its place
+			var iter = hash.iterator({ batchSize: 10 });
+			var seen = iter.nextBatch();
+			for (idx = 10; idx < 20; idx++) hash.delete( expected[idx] );
+			seen = seen.concat( iter.nextBatch() );
+			test.ok( seen[10] === expected[20], "Cursor skipped past deleted keys: " + seen[10] );
+			
+			// deleting every key as we go
+			var numSeen = seen.length;
+			for (key of iter) {
+				hash.delete( key );
+				numSeen++;
+			}
+			test.ok( numSeen == 4990, "Saw every remaining key while deleting them: " + numSeen );
+			test.ok( hash.stats().numKeys == 20, "Only keys from the first batches are left: " + hash.stats().numKeys );
+			
+			// clear() ends an iterator, and break closes it
+			iter = hash.iterator({ batchSize: 5 });
+			test.ok( iter.nextBatch().length == 5, "First batch" );
+			hash.clear();
+			test.ok( iter.nextBatch() === null, "Iterator done after clear()" );
+			
+			hash.set( "a", 1 );
+			hash.set( "b", 2 );
+			for (key of hash.iterator()) break;
+			test.ok( Array.from(hash.iterator()).length == 2, "New iterator after break" );
+			
+			// binary keys come back as stored with keyBuffers, and a batch size of 0 means the default
+			var binKey = Buffer.from([ 0xFF, 0x00, 0xC3 ]);
+			var bin = new MegaCache();
+			bin.set( binKey, "value" );
+			keys = Array.from( bin.iterator({ keyBuffers: true }) );
+			test.ok( (keys.length == 1) && Buffer.isBuffer(keys[0]) && keys[0].equals(binKey), "Binary key is intact" );
+			
+			var id = bin._openCursor( false );
+			test.ok( bin._readCursor(id, 0, false).length == 7, "Batch size 0 still reads keys" );
+			test.ok( bin._readCursor(id, 0, false).length == 0, "Then the iterator is done" );
+			
+			// closing the cache with iterators still open
+			iter = hash.iterator({ batchSize: 1 });
+			iter.next();
+			hash.close();
+			test.done();
+		},
+		
 		function testKeyIterationEmpty(test) {
 			var hash = new MegaCache();
 			
@@ -638,10 +1172,646 @@ module.exports = {
 			test.done();
 		},
 		
+		function LRU_overflowMany(test) {
+			// evict thousands of keys from deep indexes, then verify the survivors
+			var idx, value;
+			var cache = new MegaCache( 1000 );
+			
+			for (idx = 0; idx < 20000; idx++) {
+				cache.set( 'key' + idx, 'value' + idx );
+			}
+			
+			var stats = cache.stats();
+			test.ok( stats.numKeys == 1000, "numKeys incorrect after overflow: " + stats.numKeys );
+			test.ok( stats.numEvictions == 19000, "numEvictions incorrect after overflow: " + stats.numEvictions );
+			test.ok( stats.dataSize > 0, "dataSize is non-zero" );
+			
+			for (idx = 19000; idx < 20000; idx++) {
+				value = cache.get( 'key' + idx );
+				if (value !== 'value' + idx) test.ok( false, "Cache key key" + idx + " has incorrect value: " + value );
+			}
+			for (idx = 0; idx < 19000; idx += 100) {
+				test.ok( !cache.has('key' + idx), "Evicted key is still present: key" + idx );
+			}
+			
+			test.done();
+		},
+		
+		function LRU_readBuffer(test) {
+			// promotions from get() are buffered, but must all land before anything is evicted
+			var idx;
+			var cache = new MegaCache( 100 );
+			for (idx = 0; idx < 100; idx++) cache.set( 'key' + idx, 'value' + idx );
+			
+			// read everything a few times over, far more reads than the buffer holds
+			for (var pass = 0; pass < 3; pass++) {
+				for (idx = 0; idx < 100; idx++) {
+					if (idx != 5) cache.get( 'key' + idx );
+				}
+			}
+			cache.get( 'key5' );
+			test.ok( cache.nextKey() === 'key5', "Most recently read key is first: " + cache.nextKey() );
+			test.ok( cache.prevKey() === 'key0', "Least recently read key is last: " + cache.prevKey() );
+			
+			cache.get( 'key0' );
+			cache.set( 'new', 'value' );
+			test.ok( cache.has('key0'), "Recently read key survived eviction" );
+			test.ok( !cache.has('key1'), "Least recently read key was evicted" );
+			test.ok( cache.stats().readsDropped === 0, "No promotions dropped in a single thread" );
+			
+			test.done();
+		},
+		
+		function CLOCK_secondChance(test) {
+			// reads only set the reference bit, eviction sweeps past referenced keys once
+			var cache = new MegaCache( 3, 0, { policy: 'clock' } );
+			cache.set( 'a', 1 );
+			cache.set( 'b', 2 );
+			cache.set( 'c', 3 );
+			
+			// reading does not reorder keys
+			cache.get( 'a' );
+			test.ok( cache.prevKey() === 'a', "Read key is still at the tail: " + cache.prevKey() );
+			
+			// a gets a second chance, so b goes
+			cache.set( 'd', 4 );
+			test.ok( cache.has('a'), "Referenced key survived" );
+			test.ok( !cache.has('b'), "Unreferenced key was evicted" );
+			test.ok( cache.has('c') && cache.has('d'), "Other keys are still here" );
+			
+			// with every old key referenced, the hand goes all the way around,
+			// and the new key (which starts unreferenced) goes first (LRU would evict a)
+			cache.get( 'a' );
+			cache.get( 'd' );
+			cache.get( 'c' );
+			cache.set( 'e', 5 );
+			test.ok( !cache.has('e'), "Unreferenced new key was evicted after a full sweep" );
+			test.ok( cache.has('a') && cache.has('c') && cache.has('d'), "Referenced keys are still here" );
+			test.ok( cache.stats().numEvictions == 2, "numEvictions is correct: " + cache.stats().numEvictions );
+			
+			test.done();
+		},
+		
+		function TinyLFU_scanResistant(test) {
+			// a one-time scan of many keys does not flush out popular keys
+			var idx;
+			var caches = { tinylfu: new MegaCache( 1000, 0, { policy: 'tinylfu' } ), lru: new MegaCache( 1000 ) };
+			
+			for (var policy in caches) {
+				var cache = caches[policy];
+				for (idx = 0; idx < 100; idx++) {
+					cache.set( 'hot' + idx, idx );
+					for (var idy = 0; idy < 5; idy++) cache.get( 'hot' + idx );
+				}
+				for (idx = 0; idx < 5000; idx++) cache.set( 'scan' + idx, idx );
+				test.ok( cache.stats().numKeys == 1000, policy + " numKeys is at the limit: " + cache.stats().numKeys );
+			}
+			
+			var numHot = 0;
+			for (idx = 0; idx < 100; idx++) {
+				if (caches.tinylfu.get('hot' + idx) === idx) numHot++;
+				test.ok( !caches.lru.has('hot' + idx), "LRU evicted hot key: " + idx );
+			}
+			test.ok( numHot == 100, "TinyLFU kept all hot keys: " + numHot );
+			
+			var stats = caches.tinylfu.stats();
+			test.ok( stats.numRejected > 0, "Scan keys were rejected: " + stats.numRejected );
+			test.ok( stats.sketchSize == 8192, "Sketch has one word per key, rounded up: " + stats.sketchSize );
+			test.ok( caches.lru.stats().sketchSize == 0, "No sketch for LRU" );
+			
+			// segments survive clear
+			caches.tinylfu.clear();
+			for (idx = 0; idx < 2000; idx++) caches.tinylfu.set( 'key' + idx, idx );
+			test.ok( caches.tinylfu.stats().numKeys == 1000, "numKeys is at the limit after clear" );
+			test.done();
+		},
+		
+		function TinyLFU_emptyProbation(test) {
+			// with only the window filled, its keys are rejected (not admitted and then evicted anyway)
+			var cache = new MegaCache( 1, 0, { policy: 'tinylfu' } );
+			cache.set( 'a', 1 );
+			cache.set( 'b', 2 );
+			var stats = cache.stats();
+			test.ok( stats.numKeys == 1 && cache.has('b'), "Oldest window key evicted" );
+			test.ok( stats.numAdmitted == 0, "Nothing admitted: " + stats.numAdmitted );
+			test.ok( stats.numRejected == 1, "Window key rejected: " + stats.numRejected );
+			
+			// main area all protected, nothing on probation: a popular window key can't trade places with anyone
+			var idx;
+			cache = new MegaCache( 10, 0, { policy: 'tinylfu', deferEvict: true } );
+			for (idx = 0; idx < 10; idx++) cache.set( 'k' + idx, idx );
+			for (idx = 0; idx < 9; idx++) cache.get( 'k' + idx );
+			for (idx = 0; idx < 3; idx++) cache.get( 'k9' );
+			cache.delete( 'k0' );
+			cache.delete( 'k1' ); // the two demoted back to probation
+			cache._setLimits( 5, 0 );
+			cache.set( 'n0', 0 );
+			
+			test.ok( cache.evict(1) == 1, "Evicted one key" );
+			stats = cache.stats();
+			test.ok( stats.numAdmitted == 0, "Nothing admitted: " + stats.numAdmitted );
+			test.ok( stats.numRejected == 1, "Window key rejected: " + stats.numRejected );
+			test.ok( !cache.has('k9') && cache.has('n0'), "Oldest window key evicted" );
+			for (idx = 2; idx < 9; idx++) test.ok( cache.has('k' + idx), "Protected key kept: k" + idx );
+			test.done();
+		},
+		
+		function TTL_expire(test) {
+			// keys with a TTL vanish once it runs out, and are reaped by expire() or eviction
+			var cache = new MegaCache();
+			cache.set( 'short', 'value1', 1 );
+			cache.set( 'long', 'value2', 3600 );
+			cache.set( 'forever', 'value3' );
+			cache.set( 'cleared', 'value4', 1 );
+			cache.set( 'cleared', 'value4' );
+			test.ok( cache.get('short') === 'value1', "Key with TTL is there at first" );
+			
+			var lru = new MegaCache( 3 );
+			lru.set( 'short', 'value1', 1 );
+			lru.set( 'old', 'value2' );
+			lru.set( 'new', 'value3' );
+			
+			var bulk = new MegaCache( 1000 );
+			for (var idx = 0; idx < 1000; idx++) bulk.set( 'key' + idx, idx, (idx < 500) ? 1 : 0 );
+			
+			var trie = new MegaCache();
+			var table = new MegaCache( 0, 0, { engine: 'table' } );
+			[trie, table].forEach( function(c) { c.set( 'a', 'v', 1 ); c.set( 'b', 'v', 1 ); } );
+			
+			setTimeout( function() {
+				// storing over an expired key adds it, and counts the old value as expired (in place, and with a bigger value)
+				[trie, table].forEach( function(c) {
+					test.ok( c.set('a', 'z') === 1, "Storing over an expired key returns 1" );
+					test.ok( c.set('b', 'x'.repeat(500)) === 1, "Storing a bigger value over an expired key returns 1" );
+					test.ok( c.set('a', 'y') === 2, "Storing over the live key returns 2" );
+					test.ok( c.get('a') === 'y' && c.get('b').length == 500, "New values are there" );
+					test.ok( c.stats().numKeys == 2, "numKeys is correct" );
+					test.ok( c.stats().numExpired == 2, "Old values count as expired: " + c.stats().numExpired );
+				} );
+				
+				test.ok( cache.get('short') === undefined, "Expired key is not found" );
+				test.ok( !cache.has('short'), "Expired key does not exist" );
+				test.ok( cache.peek('short') === undefined, "Expired key cannot be peeked" );
+				test.ok( cache.get('long') === 'value2', "Key with long TTL is still there" );
+				test.ok( cache.get('forever') === 'value3', "Key without TTL is still there" );
+				test.ok( cache.get('cleared') === 'value4', "Overwriting without TTL removed the TTL" );
+				test.ok( cache.stats().numKeys == 4, "Expired key is still in memory until reaped" );
+				
+				test.ok( cache.expire() == 1, "expire() reaped one key" );
+				var stats = cache.stats();
+				test.ok( stats.numKeys == 3, "numKeys is correct after expire: " + stats.numKeys );
+				test.ok( stats.numExpired == 1, "numExpired is correct: " + stats.numExpired );
+				test.ok( stats.expiredBytes == 41 + 5 + 6, "expiredBytes is correct: " + stats.expiredBytes );
+				test.ok( stats.timerSize > 0, "timerSize is reported" );
+				test.ok( cache.expire() == 0, "Nothing left to expire" );
+				
+				// at the limit, expired keys go before live ones
+				lru.set( 'newer', 'value4' );
+				test.ok( lru.get('old') === 'value2', "Live key was not evicted" );
+				test.ok( lru.stats().numExpired == 1, "Expired key was reaped instead" );
+				test.ok( lru.stats().numEvictions == 0, "Reaping is not an eviction" );
+				
+				// a store only reaps a few due timers, the rest is left to expire()
+				bulk.set( 'one more', 1 );
+				test.ok( bulk.stats().numExpired == 64, "One store reaped a capped number of keys: " + bulk.stats().numExpired );
+				test.ok( bulk.expire() == 436, "expire() reaped the rest" );
+				test.done();
+			}, 1100 );
+		},
+		
+		function getMany_setMany(test) {
+			// batch calls store and fetch every type, keep the order, and report missing keys as undefined
+			var cache = new MegaCache( 0, 0, { shards: 4 } );
+			var entries = [];
+			for (var idx = 0; idx < 500; idx++) entries.push([ 'key' + idx, 'value' + idx ]);
+			entries.push([ 'buf', Buffer.from('ABC') ]);
+			entries.push([ 'num', 1.5 ]);
+			entries.push([ 'obj', { foo: 'bar' } ]);
+			entries.push([ 'nul', null ]);
+			entries.push([ 'bool', false ]);
+			entries.push([ Buffer.from('bufkey'), 'empty' ]);
+			entries.push([ 'empty', '' ]);
+			entries.push([ 'big', Buffer.alloc(100000, 'x') ]);
+			
+			test.ok( cache.setMany(entries) == 508, "setMany() stored all keys" );
+			test.ok( cache.stats().numKeys == 508, "numKeys is correct" );
+			test.ok( cache.get('key250') === 'value250', "get() sees keys from setMany()" );
+			
+			var values = cache.getMany([ 'key0', 'nope', 'key499', 'buf', 'num', 'obj', 'nul', 'bool', Buffer.from('bufkey'), 'empty', 'big' ]);
+			test.ok( values.length == 11, "One result per key" );
+			test.ok( values[0] === 'value0' && values[2] === 'value499', "String values are correct" );
+			test.ok( values[1] === undefined, "Missing key is undefined" );
+			test.ok( values[3].toString() === 'ABC', "Buffer value is correct" );
+			test.ok( values[4] === 1.5, "Number value is correct" );
+			test.ok( values[5].foo === 'bar', "Object value is correct" );
+			test.ok( values[6] === null, "Null value is correct" );
+			test.ok( values[7] === false, "Boolean value is correct" );
+			test.ok( values[8] === 'empty', "Buffer key works" );
+			test.ok( values[9] === '', "Empty value is correct" );
+			test.ok( values[10].length == 100000 && values[10][99999] == 120, "Large value is correct" );
+			test.ok( cache.getMany([]).length == 0, "Empty batch" );
+			
+			// a Map works too, and the TTL applies to all of it
+			test.ok( cache.setMany(new Map([ ['m1', 1], ['m2', 2] ]), 3600) == 2, "setMany() takes a Map" );
+			test.ok( cache.stats().timerSize > 0, "TTL is set" );
+			
+			// promotes like get()
+			var lru = new MegaCache( 3 );
+			lru.setMany([ ['a', 1], ['b', 2], ['c', 3] ]);
+			lru.getMany([ 'a' ]);
+			lru.set( 'd', 4 );
+			test.ok( lru.has('a') && !lru.has('b'), "getMany() promotes keys" );
+			
+			try {
+				cache.getMany([ 'ok', '' ]);
+				test.ok( false, "Empty key throws" );
+			}
+			catch (err) {
+				test.ok( /Key must have length/.test(err.message), "Empty key throws: " + err.message );
+			}
+			
+			try {
+				cache._getMany( Buffer.from([ 5, 0, 0, 0, 65 ]) );
+				test.ok( false, "Malformed batch throws" );
+			}
+			catch (err) {
+				test.ok( /Malformed/.test(err.message), "Malformed batch throws: " + err.message );
+			}
+			test.done();
+		},
+		
+		function getMany_interleaved(test) {
+			// interleaved lookups find exactly what single lookups find, in a deep index with long bucket lists
+			var cache = new MegaCache( 0, 0, { shards: 1 } );
+			var keys = [];
+			for (var idx = 0; idx < 20000; idx++) {
+				cache.set( 'key' + idx, 'value' + idx );
+				keys.push( 'key' + idx, 'nope' + idx );
+			}
+			
+			var values = cache.getMany( keys );
+			var bad = 0;
+			for (var idx = 0; idx < keys.length; idx++) {
+				if (values[idx] !== cache.peek(keys[idx])) bad++;
+			}
+			test.ok( bad == 0, "getMany() matches peek() for every key: " + bad );
+			
+			var packed = Buffer.concat( keys.map( function(key) {
+				var buf = Buffer.alloc( 4 + key.length );
+				buf.writeUInt32LE( key.length, 0 );
+				buf.write( key, 4 );
+				return buf;
+			} ) );
+			[0, 1, 3, 16, 32, 1000].forEach( function(group) {
+				var result = cache._benchLookups( packed, group );
+				test.ok( result[2] == 20000, "Found all keys with group " + group + ": " + result[2] );
+			} );
+			test.done();
+		},
+		
+		function getView(test) {
+			// zero-copy view stays intact while the key is replaced, deleted or cleared, and is unpinned by garbage collection
+			var cache = new MegaCache();
+			cache.set( 'big', Buffer.alloc(100000, 'a') );
+			cache.set( 'str', 'hello' );
+			
+			var view = cache.getView( 'big' );
+			test.ok( Buffer.isBuffer(view), "getView() returns a buffer" );
+			test.ok( view.length == 100000 && view[0] == 97 && view[99999] == 97, "View has the right content" );
+			test.ok( cache.getView('str').toString() === 'hello', "Strings come back as buffers" );
+			test.ok( cache.getView('nope') === undefined, "Missing key is undefined" );
+			test.ok( cache.stats().numPinned == 2, "Values are pinned: " + cache.stats().numPinned );
+			
+			// same size, so this would normally overwrite in place
+			cache.set( 'big', Buffer.alloc(100000, 'b') );
+			test.ok( cache.get('big')[0] == 98, "Key has the new value" );
+			test.ok( view[0] == 97 && view[99999] == 97, "View still has the old value after replace" );
+			
+			var view2 = cache.getView( 'big' );
+			cache.delete( 'big' );
+			cache.set( 'other', Buffer.alloc(100000, 'c') );
+			test.ok( view2[0] == 98 && view2[99999] == 98, "View still has the old value after delete" );
+			
+			cache.set( 'small', 'value' );
+			var view3 = cache.getView( 'small' );
+			cache.clear();
+			for (var idx = 0; idx < 1000; idx++) cache.set( 'key' + idx, 'XXXXX' );
+			test.ok( view3.toString() === 'value', "View still has the old value after clear" );
+			test.ok( view[50000] == 97 && view2[50000] == 98, "Older views are still intact" );
+			
+			// views are unpinned when they are garbage collected (run in a child with --expose-gc)
+			var output = require('child_process').execFileSync( process.execPath, ['--expose-gc', '-e', [
+				"var MegaCache = require(" + JSON.stringify(__dirname) + ");",
+				"var cache = new MegaCache();",
+				"cache.set( 'key', Buffer.alloc(1000) );",
+				"var view = cache.getView( 'key' );",
+				"cache.delete( 'key' );",
+				"var before = cache.stats().numPinned;",
+				"view = null;",
+				"setTimeout( function() { global.gc(); setTimeout( function() { console.log( before + ',' + cache.stats().numPinned ); }, 10 ); }, 10 );"
+			].join("\n")] ).toString().trim();
+			test.ok( output === '1,0', "View is unpinned when collected: " + output );
+			test.done();
+		},
+		
+		function Snapshot_saveLoad(test) {
+			// snapshot round trip keeps values, types, TTLs and LRU order, and a smaller cache keeps the most recent keys
+			var idx;
+			var file = Path.join( os.tmpdir(), 'megacache-test-' + process.pid + '.snap' );
+			var cache = new MegaCache();
+			for (idx = 0; idx < 1000; idx++) cache.set( 'key' + idx, 'value' + idx );
+			cache.set( 'buf', Buffer.from('ABC') );
+			cache.set( 'num', 1.5 );
+			cache.set( 'obj', { foo: 'bar' } );
+			cache.set( 'nul', null );
+			cache.set( 'ttl', 'value', 3600 );
+			cache.get( 'key0' );
+			
+			var order = [];
+			for (var key = cache.nextKey(); key; key = cache.nextKey(key)) order.push( key );
+			
+			var info = cache.save( file );
+			test.ok( info.numKeys == 1005, "save() wrote all keys: " + info.numKeys );
+			test.ok( info.numBytes == fs.statSync(file).size, "numBytes is the file size" );
+			test.ok( !fs.existsSync(file + '.tmp'), "No temp file left behind" );
+			
+			var copy = new MegaCache();
+			info = copy.load( file );
+			test.ok( info.numKeys == 1005, "load() read all keys: " + info.numKeys );
+			test.ok( info.numSkipped == 0, "Nothing skipped" );
+			test.ok( copy.stats().numKeys == 1005, "numKeys is correct after load" );
+			
+			var loaded = [];
+			for (var key = copy.nextKey(); key; key = copy.nextKey(key)) loaded.push( key );
+			test.ok( loaded.join(',') === order.join(','), "LRU order is preserved" );
+			
+			test.ok( copy.peek('key500') === 'value500', "String value is correct" );
+			test.ok( copy.peek('buf').toString() === 'ABC', "Buffer value is correct" );
+			test.ok( copy.peek('num') === 1.5, "Number value is correct" );
+			test.ok( copy.peek('obj').foo === 'bar', "Object value is correct" );
+			test.ok( copy.peek('nul') === null, "Null value is correct" );
+			test.ok( copy.stats().timerSize > 0, "TTL is preserved" );
+			
+			// the least recently used keys are the ones left out
+			var small = new MegaCache( 100 );
+			info = small.load( file );
+			test.ok( info.numKeys == 100, "Loaded up to maxKeys: " + info.numKeys );
+			test.ok( info.numSkipped == 905, "The rest were skipped: " + info.numSkipped );
+			test.ok( small.has('key0'), "Most recent key was loaded" );
+			test.ok( !small.has('key1'), "Least recent key was skipped" );
+			test.ok( small.stats().numEvictions == 0, "Loading does not evict" );
+			
+			// a key already in the cache keeps its value if the snapshot's copy of it does not fit
+			var bigFile = file + '.big';
+			var big = new MegaCache();
+			big.set( 'other', 'value' );
+			big.set( 'key0', 'X'.repeat(100000) );
+			big.save( bigFile );
+			
+			var limited = new MegaCache( 0, 65536, { shards: 1 } );
+			limited.set( 'key0', 'value0' );
+			info = limited.load( bigFile );
+			fs.unlinkSync( bigFile );
+			test.ok( info.numKeys == 0, "Nothing loaded into a full shard: " + info.numKeys );
+			test.ok( info.numSkipped == 2, "Both keys were skipped: " + info.numSkipped );
+			test.ok( limited.peek('key0') === 'value0', "Existing key was not lost" );
+			test.ok( limited.stats().numKeys == 1, "numKeys is unchanged after load" );
+			
+			// loaded keys that were already in the cache take their place in the snapshot's order, after the cache's own keys
+			var mergeFile = file + '.merge';
+			var snap = new MegaCache();
+			[ 'a', 'b', 'c', 'd' ].forEach( function(key) { snap.set( key, key ); } );
+			snap.save( mergeFile );
+			
+			var merged = new MegaCache();
+			[ 'z', 'b', 'y' ].forEach( function(key) { merged.set( key, 'old' ); } );
+			merged.load( mergeFile );
+			fs.unlinkSync( mergeFile );
+			loaded = [];
+			for (var key = merged.nextKey(); key; key = merged.nextKey(key)) loaded.push( key );
+			test.ok( loaded.join(' ') === 'y z d c b a', "Snapshot order survives a merge: " + loaded.join(' ') );
+			test.ok( merged.peek('b') === 'b', "Existing key took the snapshot's value" );
+			
+			// corrupt a byte in the middle, and the checksum catches it
+			var data = fs.readFileSync( file );
+			data[ Math.floor(data.length / 2) ] ^= 0xFF;
+			fs.writeFileSync( file, data );
+			try {
+				new MegaCache().load(file);
+				test.ok( false, "Corrupt snapshot throws" );
+			}
+			catch (err) {
+				test.ok( /checksum/.test(err.message), "Corrupt snapshot throws: " + err.message );
+			}
+			
+			fs.writeFileSync( file, data.slice(0, data.length - 20) );
+			try {
+				new MegaCache().load(file);
+				test.ok( false, "Truncated snapshot throws" );
+			}
+			catch (err) {
+				test.ok( /truncated/.test(err.message), "Truncated snapshot throws: " + err.message );
+			}
+			
+			fs.unlinkSync( file );
+			try {
+				new MegaCache().load(file);
+				test.ok( false, "Missing snapshot throws" );
+			}
+			catch (err) {
+				test.ok( /Failed to load snapshot/.test(err.message), "Missing snapshot throws: " + err.message );
+			}
+			test.done();
+		},
+		
+		function Snapshot_saveAsync(test) {
+			// background save is a point-in-time copy, so changes made after it starts are not in the file
+			var idx;
+			var file = Path.join( os.tmpdir(), 'megacache-test-async-' + process.pid + '.snap' );
+			var cache = new MegaCache();
+			for (idx = 0; idx < 1000; idx++) cache.set( 'key' + idx, 'value' + idx );
+			
+			// bigger than a snapshot block, so the child has to find room for it without malloc
+			cache.set( 'huge', Buffer.alloc(3 * 1024 * 1024, 'h') );
+			
+			var promise = cache.saveAsync( file );
+			cache.set( 'after', 'value' );
+			cache.delete( 'key0' );
+			
+			cache.saveAsync( file ).then( function() {
+				test.ok( false, "Second save should have been rejected" );
+			},
+			function(err) {
+				test.ok( /already in progress/.test(err.message), "Only one background save at a time: " + err.message );
+			} );
+			
+			promise.then( function(info) {
+				test.ok( info.numKeys == 1001, "saveAsync() wrote all keys: " + info.numKeys );
+				test.ok( info.numBytes == fs.statSync(file).size, "numBytes is the file size" );
+				test.ok( info.pause <= info.elapsed, "Pause is reported: " + info.pause + " ms" );
+				test.ok( !fs.existsSync(file + '.tmp'), "No temp file left behind" );
+				
+				var copy = new MegaCache();
+				copy.load( file );
+				test.ok( copy.get('key0') === 'value0', "Key deleted after the save started is in the snapshot" );
+				test.ok( !copy.has('after'), "Key added after the save started is not in the snapshot" );
+				test.ok( copy.get('huge').equals(Buffer.alloc(3 * 1024 * 1024, 'h')), "Huge value is intact" );
+				fs.unlinkSync( file );
+				
+				return cache.saveAsync( Path.join(os.tmpdir(), 'no-such-dir-' + process.pid, 'test.snap') );
+			} ).then( function() {
+				test.ok( false, "Save to missing directory should have failed" );
+				test.done();
+			},
+			function(err) {
+				test.ok( /Failed to save snapshot/.test(err.message), "Failed save rejects: " + err.message );
+				test.ok( /No such file/.test(err.message), "OS error is included: " + err.message );
+				test.done();
+			} );
+		},
+		
+		function Persist_reopen(test) {
+			// a cache file picks up where it left off: values, types, TTLs and LRU order all survive close() and reopen
+			var idx;
+			var file = Path.join( os.tmpdir(), 'megacache-test-' + process.pid + '.cache' );
+			var cache = new MegaCache( 0, 0, { file: file } );
+			test.ok( cache.stats().restored === false, "New file is not restored" );
+			test.ok( cache.stats().generation == 1, "First generation" );
+			
+			for (idx = 0; idx < 1000; idx++) cache.set( 'key' + idx, 'value' + idx );
+			cache.set( 'buf', Buffer.from('ABC') );
+			cache.set( 'num', 1.5 );
+			cache.set( 'obj', { foo: 'bar' } );
+			cache.set( 'big', Buffer.alloc(100000, 'x') );
+			cache.set( 'ttl', 'value', 3600 );
+			cache.get( 'key0' );
+			cache.delete( 'key1' );
+			
+			var order = [];
+			for (var key = cache.nextKey(); key; key = cache.nextKey(key)) order.push( key );
+			
+			// only one user of a file at a time
+			try {
+				new MegaCache( 0, 0, { file: file } );
+				test.ok( false, "Second open of the same file throws" );
+			}
+			catch (err) {
+				test.ok( /in use/.test(err.message), "Second open of the same file throws: " + err.message );
+			}
+			
+			cache.close();
+			try {
+				cache.set( 'after', 'close' );
+				test.ok( false, "set() after close() throws" );
+			}
+			catch (err) {
+				test.ok( /closed/.test(err.message), "set() after close() throws: " + err.message );
+			}
+			
+			cache = new MegaCache( 0, 0, { file: file } );
+			var stats = cache.stats();
+			test.ok( stats.restored === true, "Reopened file is restored" );
+			test.ok( stats.generation == 2, "Generation goes up on every open: " + stats.generation );
+			test.ok( stats.numKeys == 1004, "numKeys is correct after reopen: " + stats.numKeys );
+			test.ok( stats.fileSize >= stats.dataSize, "fileSize is reported: " + stats.fileSize );
+			test.ok( stats.timerSize > 0, "TTL timers are rebuilt" );
+			
+			var loaded = [];
+			for (var key = cache.nextKey(); key; key = cache.nextKey(key)) loaded.push( key );
+			test.ok( loaded.join(',') === order.join(','), "LRU order is preserved" );
+			
+			test.ok( cache.peek('key500') === 'value500', "String value is correct" );
+			test.ok( cache.peek('buf').toString() === 'ABC', "Buffer value is correct" );
+			test.ok( cache.peek('num') === 1.5, "Number value is correct" );
+			test.ok( cache.peek('obj').foo === 'bar', "Object value is correct" );
+			test.ok( cache.peek('big').length == 100000, "Large value is correct" );
+			test.ok( !cache.has('key1'), "Deleted key stays deleted" );
+			cache.close();
+			
+			// a different shard count does not fit the file
+			try {
+				new MegaCache( 0, 0, { file: file, shards: 4 } );
+				test.ok( false, "Shard count mismatch throws" );
+			}
+			catch (err) {
+				test.ok( /number of shards/.test(err.message), "Shard count mismatch throws: " + err.message );
+			}
+			
+			// a process which dies without close() leaves the file marked dirty, so it starts over
+			require('child_process').execFileSync( process.execPath, ['-e', [
+				"var MegaCache = require(" + JSON.stringify(__dirname) + ");",
+				"var cache = new MegaCache( 0, 0, { file: " + JSON.stringify(file) + " } );",
+				"cache.set( 'crash', 'value' );",
+				"process.exit(0);"
+			].join("\n")] );
+			
+			cache = new MegaCache( 0, 0, { file: file } );
+			stats = cache.stats();
+			test.ok( stats.restored === false, "File is not trusted after a crash" );
+			test.ok( stats.numKeys == 0, "Cache starts over after a crash: " + stats.numKeys );
+			cache.close();
+			
+			fs.unlinkSync( file );
+			test.done();
+		},
+		
+		function LRU_lowWater(test) {
+			// crossing maxKeys evicts down to the low watermark in one batch
+			var idx;
+			var cache = new MegaCache( 100, 0, { lowWater: 90 } );
+			
+			for (idx = 0; idx < 100; idx++) cache.set( 'key' + idx, 'value' + idx );
+			test.ok( cache.stats().numKeys == 100, "numKeys is 100 at the limit" );
+			test.ok( cache.stats().evictionBatches == 0, "no evictions at the limit" );
+			
+			cache.set( 'key100', 'value100' );
+			var stats = cache.stats();
+			test.ok( stats.numKeys == 90, "numKeys incorrect after batch: " + stats.numKeys );
+			test.ok( stats.numEvictions == 11, "numEvictions incorrect after batch: " + stats.numEvictions );
+			test.ok( stats.evictionBatches == 1, "evictionBatches incorrect: " + stats.evictionBatches );
+			test.ok( stats.evictionTime >= 0, "evictionTime is present" );
+			test.ok( !cache.has('key10'), "Oldest keys were evicted" );
+			test.ok( cache.has('key11'), "Newer keys were kept" );
+			
+			// room for 10 more before the next batch
+			for (idx = 101; idx < 111; idx++) cache.set( 'key' + idx, 'value' + idx );
+			test.ok( cache.stats().numKeys == 100, "numKeys is back at the limit" );
+			test.ok( cache.stats().evictionBatches == 1, "Still one batch" );
+			
+			cache.set( 'key111', 'value111' );
+			test.ok( cache.stats().numKeys == 90, "numKeys is at the low mark again" );
+			test.ok( cache.stats().evictionBatches == 2, "Two batches" );
+			
+			test.done();
+		},
+		
+		function LRU_deferEvict(test) {
+			// deferred eviction only happens in explicit evict() calls
+			var idx;
+			var cache = new MegaCache( 100, 0, { lowWater: 50, deferEvict: true } );
+			
+			for (idx = 0; idx < 200; idx++) cache.set( 'key' + idx, 'value' + idx );
+			test.ok( cache.stats().numKeys == 200, "No evictions during set" );
+			
+			test.ok( cache.evict(30) == 30, "evict() honors the budget" );
+			test.ok( cache.stats().numKeys == 170, "numKeys after budgeted evict: " + cache.stats().numKeys );
+			test.ok( !cache.has('key29'), "Oldest keys were evicted first" );
+			
+			test.ok( cache.evict() == 120, "evict() with no budget goes to the low mark" );
+			test.ok( cache.stats().numKeys == 50, "numKeys at the low mark: " + cache.stats().numKeys );
+			test.ok( cache.has('key150'), "Newest keys were kept" );
+			
+			test.ok( cache.evict() == 0, "Nothing left to evict" );
+			test.ok( cache.stats().numEvictions == 150, "numEvictions is correct" );
+			test.ok( cache.stats().evictionBatches == 2, "evictionBatches is correct" );
+			
+			test.done();
+		},
+		
 		function LRU_fillBytes(test) {
-			// {"indexSize":129,"metaSize":320,"dataSize":150,"numKeys":10,"numIndexes":1,"numEvictions":0}
+			// {"indexSize":129,"metaSize":450,"dataSize":150,"numKeys":10,"numIndexes":1,"numEvictions":0}
 			var idx, key, value, item;
-			var cache = new MegaCache( 0, 129 + 320 + 150 );
+			var cache = new MegaCache( 0, 129 + 450 + 150 );
 			
 			for (idx = 11; idx <= 20; idx++) {
 				cache.set( 'key' + idx, 'ABCDEFGHIJ' );
@@ -663,7 +1833,7 @@ module.exports = {
 		
 		function LRU_overflowBytes(test) {
 			var idx, key, value, item;
-			var cache = new MegaCache( 0, 600 );
+			var cache = new MegaCache( 0, 729 );
 			
 			for (idx = 11; idx <= 21; idx++) {
 				cache.set( 'key' + idx, 'ABCDEFGHIJ' );
@@ -687,7 +1857,7 @@ module.exports = {
 		
 		function LRU_overflowBytesMultiple(test) {
 			var idx, key, value, item;
-			var cache = new MegaCache( 0, 600 );
+			var cache = new MegaCache( 0, 729 );
 			
 			for (idx = 11; idx <= 20; idx++) {
 				cache.set( 'key' + idx, 'ABCDEFGHIJ' );
@@ -704,19 +1874,19 @@ module.exports = {
 			test.ok( stats.dataSize == 150, "dataSize incorrect: " + stats.dataSize );
 			
 			// cause everything to be expunged at once and replaced with boom
-			// (292 byte buf + `boom` key == 300 bytes exactly)
-			var buf = Buffer.alloc( 435 );
+			// (551 byte buf + `boom` key + 45 byte meta + 129 byte index == 729 bytes exactly)
+			var buf = Buffer.alloc( 551 );
 			cache.set( 'boom', buf );
 			
 			value = cache.get('boom');
 			test.ok( !!value, "Unable to fetch boom");
-			test.ok( value.length == 435, "Boom has incorrect length: " + value.length );
+			test.ok( value.length == 551, "Boom has incorrect length: " + value.length );
 			
 			stats = cache.stats();
 			// test.debug("Stats: ", stats);
 			
 			test.ok( stats.numKeys == 1, "Cache has incorrect count after boom: " + stats.numKeys );
-			test.ok( stats.dataSize == 439, "Cache has incorrect dataSize after boom: " + stats.dataSize );
+			test.ok( stats.dataSize == 555, "Cache has incorrect dataSize after boom: " + stats.dataSize );
 			test.ok( stats.numEvictions == 10, "numEvictions incorrect after boom: " + stats.numEvictions );
 			
 			// internal API checks
@@ -726,7 +1896,7 @@ module.exports = {
 			var last_key = cache.prevKey();
 			test.ok( last_key === "boom", "Last list item is not boom: " + last_key );
 			
-			// now cause an implosion (cannot store > 600 bytes, will immediately be expunged)
+			// now cause an implosion (cannot store > 729 bytes, will immediately be expunged)
 			var buf2 = Buffer.alloc( 700 );
 			cache.set( 'implode', buf2 );
 			
@@ -873,7 +2043,80 @@ module.exports = {
 			test.ok( !value, "Special key shuld be expunged, but is still here: " + value );
 			
 			test.done();
-		}
+		},
+		
+		function LRU_bigLimits(test) {
+			// limits over 4 GB are kept as is, rather than wrapping around to something tiny
+			var idx;
+			var cache = new MegaCache( 0, Math.pow(2, 32) + 500 );
+			for (idx = 0; idx < 1000; idx++) {
+				cache.set( 'key' + idx, 'ABCDEFGHIJ' );
+			}
+			
+			var stats = cache.stats();
+			test.ok( stats.numKeys == 1000, "numKeys incorrect with 4 GB+ maxBytes: " + stats.numKeys );
+			test.ok( stats.numEvictions == 0, "numEvictions incorrect with 4 GB+ maxBytes: " + stats.numEvictions );
+			test.done();
+		},
+		
+		function LRU_setLimits(test) {
+			// lowering a limit at runtime evicts the excess in batches, oldest keys first
+			var idx;
+			var cache = new MegaCache();
+			for (idx = 0; idx < 5000; idx++) {
+				cache.set( 'key' + idx, 'ABCDEFGHIJ' );
+			}
+			
+			cache.setLimits( 100 ).then( function(count) {
+				var stats = cache.stats();
+				test.ok( count == 4900, "setLimits() evicted the excess: " + count );
+				test.ok( stats.numKeys == 100, "numKeys incorrect after setLimits(): " + stats.numKeys );
+				test.ok( cache.get('key4999') === 'ABCDEFGHIJ', "Newest key survived" );
+				test.ok( cache.get('key0') === undefined, "Oldest key was evicted" );
+				
+				// raising it again lets the cache grow
+				return cache.setLimits( 200 );
+			} ).then( function(count) {
+				test.ok( count == 0, "Nothing evicted when raising the limit: " + count );
+				for (idx = 0; idx < 500; idx++) {
+					cache.set( 'more' + idx, 'ABCDEFGHIJ' );
+				}
+				test.ok( cache.stats().numKeys == 200, "numKeys follows the raised limit: " + cache.stats().numKeys );
+				test.done();
+			} );
+			
+			// stores right after a lowered limit only evict a batch each, instead of all of the excess
+			var shrunk = new MegaCache();
+			for (idx = 0; idx < 5000; idx++) {
+				shrunk.set( 'key' + idx, 'ABCDEFGHIJ' );
+			}
+			shrunk.setLimits( 10 );
+			shrunk.set( 'one_more', 'ABCDEFGHIJ' );
+			test.ok( shrunk.stats().numKeys > 10, "One store did not evict everything: " + shrunk.stats().numKeys );
+			test.ok( shrunk.stats().numKeys < 5001, "One store evicted a batch: " + shrunk.stats().numKeys );
+		},
 		
+		function LRU_arenaAccounting(test) {
+			// charging the arena's rounded sizes holds fewer keys for the same limit, and stays within it
+			var idx;
+			var data = new MegaCache( 0, 1024 * 1024 );
+			var arena = new MegaCache( 0, 1024 * 1024, { accounting: 'arena' } );
+			for (idx = 0; idx < 50000; idx++) {
+				data.set( 'key' + idx, 'ABCDEFGHIJK' );
+				arena.set( 'key' + idx, 'ABCDEFGHIJK' );
+			}
+			
+			var stats = arena.stats();
+			test.ok( stats.numKeys < data.stats().numKeys, "Arena accounting holds fewer keys: " + stats.numKeys + " vs " + data.stats().numKeys );
+			test.ok( stats.arenaUsed <= 1024 * 1024, "arenaUsed is within maxBytes: " + stats.arenaUsed );
+			test.ok( data.stats().arenaUsed > 1024 * 1024, "Data accounting goes over in arena terms: " + data.stats().arenaUsed );
+			
+			var err = null;
+			try { new MegaCache( 0, 0, { accounting: 'rss' } ); }
+			catch (e) { err = e; }
+			test.ok( !!err, "Constructor threw on unknown accounting mode" );
+			test.done();
+		}
+	
 	]
 };